@@ -0,0 +1,505 @@
+/* backend.c
+ * Font table backends for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+#ifdef _WIN32
+
+/* The system font table, via GDI */
+
+static int gdiInit (regfont_backend *backend, const char *params) {
+  if (params && *params) {
+    fprintf (stderr, "ERROR: The gdi backend takes no parameters\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int gdiAddFont (regfont_backend *backend, const char *filename) {
+  return AddFontResource (filename);
+}
+
+static int gdiRemoveFont (regfont_backend *backend, const char *filename) {
+  return RemoveFontResource (filename);
+}
+
+typedef struct {
+  HWND *windows;
+  size_t count;
+  size_t size;
+} gdi_windows;
+
+static BOOL CALLBACK gdiCollectWindow (HWND hwnd, LPARAM lparam) {
+  gdi_windows *list = (gdi_windows *) lparam;
+
+  if (list->count == list->size) {
+    size_t size = list->size ? list->size * 2 : 256;
+    HWND *windows = realloc (list->windows, size * sizeof (HWND));
+    if (!windows)
+      return FALSE;
+    list->windows = windows;
+    list->size = size;
+  }
+  list->windows[list->count++] = hwnd;
+  return TRUE;
+}
+
+static void gdiBroadcast (regfont_backend *backend,
+    regfont_broadcast_strategy strategy, unsigned long timeout,
+    regfont_broadcast_result *result) {
+  gdi_windows list = {NULL, 0, 0};
+  DWORD_PTR answer;
+  size_t i;
+
+  switch (strategy) {
+  case REGFONT_BROADCAST_SEND:
+    SendMessage (HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
+    break;
+  case REGFONT_BROADCAST_POST:
+    PostMessage (HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
+    break;
+  case REGFONT_BROADCAST_TIMEOUT:
+    /* Message each top-level window ourselves, so that hung windows
+     * can be counted */
+    EnumWindows (gdiCollectWindow, (LPARAM) &list);
+    for (i = 0; i < list.count; i++) {
+      if (SendMessageTimeout (list.windows[i], WM_FONTCHANGE, 0, 0,
+            SMTO_NORMAL | SMTO_ABORTIFHUNG, (UINT) timeout, &answer) == 0) {
+        dbtrace ("    Window %p did not answer font change message",
+            (void *) list.windows[i]);
+        result->timed_out++;
+      }
+    }
+    result->recipients = (unsigned long) list.count;
+    free (list.windows);
+    break;
+  case REGFONT_BROADCAST_NONE:
+  default:
+    break;
+  }
+}
+
+#endif
+
+/* An in-process stand-in for the system font table.  Every call costs
+ * a configurable latency and may fail at a configurable rate, so
+ * registration throughput can be measured without a Windows desktop. */
+
+typedef struct sim_font {
+  struct sim_font *next;
+  int count;
+  char name[1];
+} sim_font;
+
+typedef struct {
+  unsigned long latency;
+  unsigned long jitter;
+  double spike_rate;
+  unsigned long spike_latency;
+  double fail_rate;
+  unsigned long broadcast_cost;
+  unsigned long recipients;
+  double hung_rate;
+  unsigned long hang_time;
+  int preloaded;
+  int report;
+  unsigned long long rng;
+  regfont_mutex lock;
+
+  sim_font *table[4096];
+
+  unsigned long calls;
+  unsigned long failures;
+  unsigned long broadcasts;
+  unsigned long long call_time;
+  unsigned long long broadcast_time;
+  unsigned long long started;
+  unsigned long *latencies;
+  size_t nlatencies;
+  size_t latencies_size;
+} sim_state;
+
+static unsigned long long simRandom (sim_state *sim) {
+  /* xorshift64* */
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return sim->rng * 2685821657736338717ULL;
+}
+
+static double simUniform (sim_state *sim) {
+  return (double) (simRandom (sim) >> 11) / 9007199254740992.0;
+}
+
+static unsigned long simHash (const char *name) {
+  unsigned long hash = 5381;
+
+  for ( ; *name; name++)
+    hash = hash * 33 + (unsigned char) *name;
+  return hash;
+}
+
+static sim_font **simLookup (sim_state *sim, const char *name) {
+  sim_font **font = &sim->table[simHash (name) %
+    (sizeof (sim->table) / sizeof (sim->table[0]))];
+
+  while (*font && strcmp ((*font)->name, name) != 0)
+    font = &(*font)->next;
+  return font;
+}
+
+static int simSetParam (sim_state *sim, const char *key, size_t keylen,
+    const char *value) {
+  char *end = NULL;
+
+#define SIM_KEY(k) (keylen == sizeof (k) - 1 && strncmp (key, k, keylen) == 0)
+  if (SIM_KEY ("latency"))
+    sim->latency = strtoul (value, &end, 10);
+  else if (SIM_KEY ("jitter"))
+    sim->jitter = strtoul (value, &end, 10);
+  else if (SIM_KEY ("spike"))
+    sim->spike_rate = strtod (value, &end);
+  else if (SIM_KEY ("spikelatency"))
+    sim->spike_latency = strtoul (value, &end, 10);
+  else if (SIM_KEY ("fail"))
+    sim->fail_rate = strtod (value, &end);
+  else if (SIM_KEY ("broadcast"))
+    sim->broadcast_cost = strtoul (value, &end, 10);
+  else if (SIM_KEY ("recipients"))
+    sim->recipients = strtoul (value, &end, 10);
+  else if (SIM_KEY ("hung"))
+    sim->hung_rate = strtod (value, &end);
+  else if (SIM_KEY ("hangtime"))
+    sim->hang_time = strtoul (value, &end, 10);
+  else if (SIM_KEY ("seed"))
+    sim->rng = strtoull (value, &end, 10) | 1;
+  else if (SIM_KEY ("preloaded"))
+    sim->preloaded = *value ? (int) strtol (value, &end, 10) : 1;
+  else if (SIM_KEY ("report"))
+    sim->report = *value ? (int) strtol (value, &end, 10) : 1;
+  else
+    return -1;
+#undef SIM_KEY
+
+  if (end && *end != '\0' && *end != ',')
+    return -1;
+  return 0;
+}
+
+static int simInit (regfont_backend *backend, const char *params) {
+  sim_state *sim;
+  const char *p = params;
+
+  sim = calloc (1, sizeof (sim_state));
+  if (!sim) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return -1;
+  }
+  sim->rng = 0x9E3779B97F4A7C15ULL;
+  sim->recipients = 1;
+  sim->hang_time = 10000000;
+  regfont_mutex_init (&sim->lock);
+  backend->data = sim;
+
+  /* params is a comma separated list of key=value pairs */
+  while (p && *p) {
+    const char *comma = strchr (p, ',');
+    const char *equals = strchr (p, '=');
+    size_t keylen;
+
+    if (!comma)
+      comma = p + strlen (p);
+    if (equals && equals < comma)
+      keylen = (size_t) (equals - p);
+    else {
+      keylen = (size_t) (comma - p);
+      equals = NULL;
+    }
+
+    if (simSetParam (sim, p, keylen, equals ? equals + 1 : "") != 0) {
+      fprintf (stderr, "ERROR: Invalid sim backend parameter: %.*s\n",
+          (int) (comma - p), p);
+      regfont_mutex_destroy (&sim->lock);
+      free (sim);
+      backend->data = NULL;
+      return -1;
+    }
+    dbprintf ("Simulated font table: %.*s", (int) (comma - p), p);
+
+    p = *comma ? comma + 1 : comma;
+  }
+
+  sim->started = regfont_now_us ();
+  return 0;
+}
+
+/* Burn the simulated cost of one call and record how long it took.
+ * Calls may overlap, so only the bookkeeping is done under the lock;
+ * on success the lock is still held for the caller to update the
+ * table. */
+static int simCall (sim_state *sim) {
+  unsigned long long start = regfont_now_us ();
+  long long cost = (long long) sim->latency;
+  int failed;
+
+  regfont_mutex_lock (&sim->lock);
+  if (sim->jitter)
+    cost += (long long) (simRandom (sim) % (2 * sim->jitter + 1)) -
+      (long long) sim->jitter;
+  if (cost < 0)
+    cost = 0;
+  if (sim->spike_rate > 0 && simUniform (sim) < sim->spike_rate)
+    cost += sim->spike_latency;
+  failed = sim->fail_rate > 0 && simUniform (sim) < sim->fail_rate;
+  regfont_mutex_unlock (&sim->lock);
+
+  if (cost)
+    regfont_sleep_us ((unsigned long long) cost);
+
+  cost = (long long) (regfont_now_us () - start);
+  regfont_mutex_lock (&sim->lock);
+  sim->calls++;
+  sim->call_time += cost;
+  if (failed)
+    sim->failures++;
+
+  if (sim->nlatencies == sim->latencies_size) {
+    size_t size = sim->latencies_size ? sim->latencies_size * 2 : 1024;
+    unsigned long *latencies = realloc (sim->latencies,
+        size * sizeof (unsigned long));
+    if (latencies) {
+      sim->latencies = latencies;
+      sim->latencies_size = size;
+    }
+  }
+  if (sim->nlatencies < sim->latencies_size)
+    sim->latencies[sim->nlatencies++] = (unsigned long) cost;
+
+  if (failed)
+    regfont_mutex_unlock (&sim->lock);
+  return !failed;
+}
+
+static int simAddFont (regfont_backend *backend, const char *filename) {
+  sim_state *sim = backend->data;
+  sim_font **font;
+
+  if (!simCall (sim))
+    return 0;
+
+  font = simLookup (sim, filename);
+  if (!*font) {
+    *font = malloc (sizeof (sim_font) + strlen (filename));
+    if (!*font) {
+      regfont_mutex_unlock (&sim->lock);
+      return 0;
+    }
+    (*font)->next = NULL;
+    (*font)->count = 0;
+    strcpy ((*font)->name, filename);
+  }
+  (*font)->count++;
+
+  regfont_mutex_unlock (&sim->lock);
+  return 1;
+}
+
+static int simRemoveFont (regfont_backend *backend, const char *filename) {
+  sim_state *sim = backend->data;
+  sim_font **font;
+  sim_font *removed;
+
+  if (!simCall (sim))
+    return 0;
+
+  font = simLookup (sim, filename);
+  if (!*font) {
+    regfont_mutex_unlock (&sim->lock);
+    return sim->preloaded;
+  }
+
+  if (--(*font)->count == 0) {
+    removed = *font;
+    *font = removed->next;
+    free (removed);
+  }
+
+  regfont_mutex_unlock (&sim->lock);
+  return 1;
+}
+
+/* Each simulated recipient takes the broadcast cost to handle the
+ * message, or the hang time if it is hung.  Only the timeout strategy
+ * can give up on a recipient. */
+static void simBroadcast (regfont_backend *backend,
+    regfont_broadcast_strategy strategy, unsigned long timeout,
+    regfont_broadcast_result *result) {
+  sim_state *sim = backend->data;
+  unsigned long long start = regfont_now_us ();
+  unsigned long long cost = 0, limit = (unsigned long long) timeout * 1000ULL;
+  unsigned long i;
+
+  if (strategy == REGFONT_BROADCAST_NONE)
+    return;
+
+  for (i = 0; i < sim->recipients; i++) {
+    unsigned long long recipient = sim->broadcast_cost;
+
+    if (sim->hung_rate > 0 && simUniform (sim) < sim->hung_rate)
+      recipient = sim->hang_time;
+
+    if (strategy == REGFONT_BROADCAST_TIMEOUT && recipient > limit) {
+      recipient = limit;
+      result->timed_out++;
+    }
+    cost += recipient;
+  }
+
+  if (strategy == REGFONT_BROADCAST_TIMEOUT)
+    result->recipients = sim->recipients;
+
+  if (strategy != REGFONT_BROADCAST_POST && cost)
+    regfont_sleep_us (cost);
+
+  sim->broadcasts++;
+  sim->broadcast_time += regfont_now_us () - start;
+}
+
+static int compareLatency (const void *a, const void *b) {
+  unsigned long la = *(const unsigned long *) a;
+  unsigned long lb = *(const unsigned long *) b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+static unsigned long simPercentile (sim_state *sim, int percentile) {
+  size_t i;
+
+  if (sim->nlatencies == 0)
+    return 0;
+  i = (sim->nlatencies * (size_t) percentile + 99) / 100;
+  return sim->latencies[i > 0 ? i - 1 : 0];
+}
+
+static void simFinish (regfont_backend *backend) {
+  sim_state *sim = backend->data;
+  unsigned long long elapsed;
+  size_t i;
+
+  if (!sim)
+    return;
+
+  elapsed = regfont_now_us () - sim->started;
+
+  if (sim->report) {
+    qsort (sim->latencies, sim->nlatencies, sizeof (unsigned long),
+        compareLatency);
+    msgprintf (backend->session, stdout,
+        "Simulated font table: %lu calls, %lu failed, %lu broadcasts\n",
+        sim->calls, sim->failures, sim->broadcasts);
+    msgprintf (backend->session, stdout, "Simulated font table: elapsed "
+        "%.3f ms, calls %.3f ms, broadcasts %.3f ms\n", elapsed / 1000.0,
+        sim->call_time / 1000.0, sim->broadcast_time / 1000.0);
+    msgprintf (backend->session, stdout,
+        "Simulated font table: throughput %.1f calls/s\n",
+        elapsed ? sim->calls * 1000000.0 / elapsed : 0.0);
+    msgprintf (backend->session, stdout, "Simulated font table: latency "
+        "p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n",
+        simPercentile (sim, 50), simPercentile (sim, 90),
+        simPercentile (sim, 99), simPercentile (sim, 100));
+  }
+
+  for (i = 0; i < sizeof (sim->table) / sizeof (sim->table[0]); i++) {
+    while (sim->table[i]) {
+      sim_font *next = sim->table[i]->next;
+      free (sim->table[i]);
+      sim->table[i] = next;
+    }
+  }
+  free (sim->latencies);
+  regfont_mutex_destroy (&sim->lock);
+  free (sim);
+  backend->data = NULL;
+}
+
+static regfont_backend regfont_backends[] = {
+#ifdef _WIN32
+  {"gdi", "System font table (AddFontResource/RemoveFontResource)", 1,
+    gdiInit, gdiAddFont, gdiRemoveFont, gdiBroadcast, NULL, NULL, NULL},
+#endif
+  {"sim", "Simulated font table with injected latency and failures", 0,
+    simInit, simAddFont, simRemoveFont, simBroadcast, simFinish, NULL, NULL},
+  {NULL, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+/* Set up backend as a copy of the one spec names, so that each session
+ * has a font table of its own.  spec is NAME or NAME:PARAMS. */
+int selectBackend (regfont_backend *backend, const char *spec) {
+  const regfont_backend *found = regfont_backends;
+  const char *colon = strchr (spec, ':');
+  size_t namelen = colon ? (size_t) (colon - spec) : strlen (spec);
+
+  for ( ; found->name; found++) {
+    if (strlen (found->name) == namelen &&
+        strncmp (found->name, spec, namelen) == 0)
+      break;
+  }
+
+  if (!found->name) {
+    fprintf (stderr, "ERROR: Unknown font table backend: %.*s\n",
+        (int) namelen, spec);
+    return -1;
+  }
+
+  dbprintf ("Selecting font table backend: %s", found->name);
+  *backend = *found;
+  if (backend->init (backend, colon ? colon + 1 : NULL) != 0) {
+    backend->name = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void finishBackend (regfont_backend *backend) {
+  if (backend->name && backend->finish)
+    backend->finish (backend);
+  backend->name = NULL;
+}
+
+void printBackends (void) {
+  regfont_backend *backend = regfont_backends;
+
+  printf ("Font table backends:\n");
+  for ( ; backend->name; backend++)
+    printf ("\t%s\t%s\n", backend->name, backend->description);
+  printf ("Parameters for sim (comma separated, times in microseconds):\n");
+  printf ("\tlatency=US, jitter=US, spike=RATE, spikelatency=US,\n");
+  printf ("\tfail=RATE, broadcast=US, recipients=N, hung=RATE, "
+      "hangtime=US,\n");
+  printf ("\tseed=N, preloaded, report\n");
+}
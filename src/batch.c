@@ -0,0 +1,126 @@
+/* batch.c
+ * Font commands read from a stream for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Commands are read a line at a time, as the server reads them:
+ *
+ *     add PATH
+ *     remove PATH
+ *     flush
+ *     stats
+ *
+ * and each is answered with a line as the server answers it,
+ *
+ *     ok|error COMMAND CODE PATH
+ *
+ * save that stats puts the session totals where the path would be.
+ * Fonts are added and removed as their commands arrive, but the font
+ * change broadcast waits for a flush, or for the caller to close the
+ * session at the end of the stream.  Lines may be of any length, and
+ * blank ones are ignored.  With --dedup, a font added with the contents
+ * of one already added, and not since removed, is skipped. */
+
+/* Returns -1 if the stream could not be read to the end */
+int runBatch (regfont_session *session, FILE *in, FILE *out) {
+  char *line = NULL, *reply = NULL;
+  size_t size = 0, replysize = 0;
+  char totals[128];
+  regfont_totals stats;
+  long len;
+  int retval = 0;
+
+  dbprintf ("Batch: Reading commands");
+  while ((len = regfont_getline (&line, &size, in)) >= 0) {
+    const char *command, *path = NULL;
+    int error = REGFONT_OK;
+
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len > 0 && line[len - 1] == '\r')
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    dbtrace ("Batch: Command: %s", line);
+    if (strncmp (line, "add ", 4) == 0) {
+      command = "add";
+      path = line + 4;
+      error = addFont (session, line + 4);
+    } else if (strncmp (line, "remove ", 7) == 0) {
+      command = "remove";
+      path = line + 7;
+      error = removeFont (session, line + 7);
+    } else if (strcmp (line, "flush") == 0) {
+      command = "flush";
+      regfont_session_flush (session);
+    } else if (strcmp (line, "stats") == 0) {
+      command = "stats";
+      regfont_session_stats (session, &stats);
+      snprintf (totals, sizeof (totals), "added=%lu removed=%lu failed=%lu "
+          "skipped=%lu broadcasts=%lu pending=%lu", stats.added,
+          stats.removed, stats.failed, stats.skipped, stats.broadcasts,
+          stats.pending);
+      path = totals;
+    } else {
+      command = "unknown";
+      path = line;
+      error = REGFONT_BAD_REQUEST;
+    }
+
+    /* Messages about the command go out before its reply */
+    fflush (stdout);
+    fflush (stderr);
+    /* Replies echo the path, however long */
+    if (formatReply (&reply, &replysize, error, command, path) < 0) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      retval = -1;
+      break;
+    }
+    fputs (reply, out);
+    if (fflush (out) != 0) {
+      fprintf (stderr, "ERROR: Could not write batch reply\n");
+      retval = -1;
+      break;
+    }
+  }
+
+  /* regfont_getline also stops short if out of memory */
+  if (retval == 0 && (ferror (in) || !feof (in))) {
+    fprintf (stderr, "ERROR: Could not read batch commands\n");
+    retval = -1;
+  }
+  if (retval == 0)
+    dbprintf ("Batch: Reached end of commands");
+
+  /* Duplicates are told apart across the whole stream */
+  finishDuplicates (session);
+  free (line);
+  free (reply);
+  return retval;
+}
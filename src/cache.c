@@ -0,0 +1,418 @@
+/* cache.c
+ * Persistent font validation cache for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* The cache file is a header followed by an open addressed table of
+ * fixed size entries, mapped read only and probed in place.  Verdicts
+ * made during a run go into a table of the same kind in memory, which
+ * is consulted first and merged into a fresh file that replaces the old
+ * one when the cache is closed, so a crash never leaves a half written
+ * cache behind. */
+#define REGFONT_CACHE_MAGIC "RFCACHE1"
+#define REGFONT_CACHE_VERSION 1
+#define REGFONT_CACHE_MIN_SLOTS 1024
+
+#define REGFONT_CACHE_STRICT 1
+#define REGFONT_CACHE_VERIFY 2
+
+typedef struct {
+  char magic[8];
+  unsigned int version;
+  unsigned int slots;
+  unsigned int count;
+  unsigned int reserved;
+} cache_header;
+
+struct regfont_cache {
+  char *path;
+  regfont_map map;
+  const regfont_cache_entry *entries;
+  unsigned int slots;
+  regfont_mutex lock;
+  regfont_cache_entry *added;
+  unsigned int addedslots;
+  unsigned int nadded;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stale;
+};
+
+static unsigned long long hashBytes (unsigned long long hash, const char *data,
+    size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static unsigned long long foldStamp (const regfont_stat_info *info) {
+  return (info->size * 0x9E3779B97F4A7C15ULL) ^ (unsigned long long)
+    info->mtime;
+}
+
+/* Fill in the key and stamps of a font specification, querying only
+ * the files spec knows nothing of, and recording them there.  Fonts that
+ * cannot be looked up are simply not cached, and get the full check
+ * with its error messages. */
+static int cacheKeyIn (regfont_arena *arena, const char *filename,
+    regfont_cache_entry *entry, regfont_spec_info *spec) {
+  const char *part = filename;
+  unsigned long long hash = 0xCBF29CE484222325ULL;
+  int i;
+
+  memset (entry, 0, sizeof (regfont_cache_entry));
+
+  for (i = 0; i < 2 && part; i++) {
+    const char *pipe_pos = strchr (part, '|');
+    regfont_stat_info *info = &spec->file[i].info;
+    regfont_view name, full;
+
+    name.data = part;
+    name.len = pipe_pos ? (size_t) (pipe_pos - part) : strlen (part);
+    if (fullPath (arena, name, &full) != REGFONT_OK)
+      return -1;
+    if (!spec->file[i].known) {
+      if (regfont_stat (full.data, info) != 0)
+        return -1;
+      spec->file[i].known = -1;
+    }
+    if (info->directory)
+      return -1;
+
+    if (i > 0)
+      hash = hashBytes (hash, "|", 1);
+    hash = hashBytes (hash, full.data, full.len);
+
+    if (i == 0) {
+      entry->size = info->size;
+      entry->mtime = info->mtime;
+    } else {
+      entry->extra = foldStamp (info);
+    }
+
+    part = pipe_pos ? pipe_pos + 1 : NULL;
+  }
+
+  /* More than one '|' is left for checkFontFile to reject */
+  if (part)
+    return -1;
+
+  entry->key = hash ? hash : 1;
+  return 0;
+}
+
+static int cacheKey (const char *filename, regfont_cache_entry *entry,
+    regfont_spec_info *spec) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  int retval = cacheKeyIn (&regfont_path_arena, filename, entry, spec);
+
+  arenaRelease (&regfont_path_arena, mark);
+  return retval;
+}
+
+/* At most slots entries are probed, so a damaged file whose table has
+ * no empty slot cannot keep a lookup going */
+static const regfont_cache_entry *probeCache (
+    const regfont_cache_entry *entries, unsigned int slots,
+    unsigned long long key) {
+  unsigned int i, n, mask = slots - 1;
+
+  for (i = (unsigned int) key & mask, n = 0; n < slots &&
+      entries[i].key != 0; i = (i + 1) & mask, n++) {
+    if (entries[i].key == key)
+      return &entries[i];
+  }
+  return NULL;
+}
+
+static void mapCache (regfont_cache *cache) {
+  const cache_header *header;
+  const regfont_cache_entry *entries;
+  unsigned int count = 0, i;
+
+  if (regfont_map_open (&cache->map, cache->path) != 0) {
+    dbprintf ("No validation cache in %s", cache->path);
+    return;
+  }
+
+  header = (const cache_header *) cache->map.data;
+  if (cache->map.size < sizeof (cache_header) ||
+      memcmp (header->magic, REGFONT_CACHE_MAGIC, 8) != 0 ||
+      header->version != REGFONT_CACHE_VERSION ||
+      header->slots == 0 || (header->slots & (header->slots - 1)) != 0 ||
+      header->count >= header->slots ||
+      (cache->map.size - sizeof (cache_header)) %
+      sizeof (regfont_cache_entry) != 0 ||
+      (cache->map.size - sizeof (cache_header)) /
+      sizeof (regfont_cache_entry) != header->slots) {
+    fprintf (stderr, "ERROR: Ignoring damaged validation cache %s\n",
+        cache->path);
+    regfont_map_close (&cache->map);
+    return;
+  }
+
+  /* saveCache sizes the new table by the count */
+  entries = (const regfont_cache_entry *) (header + 1);
+  for (i = 0; i < header->slots; i++)
+    count += entries[i].key != 0;
+  if (count != header->count) {
+    fprintf (stderr, "ERROR: Ignoring damaged validation cache %s\n",
+        cache->path);
+    regfont_map_close (&cache->map);
+    return;
+  }
+
+  cache->entries = entries;
+  cache->slots = header->slots;
+  dbprintf ("Loaded %u entries from validation cache %s", header->count,
+      cache->path);
+}
+
+int openCache (regfont_session *session, const char *path) {
+  regfont_cache *cache = calloc (1, sizeof (regfont_cache));
+
+  if (cache)
+    cache->path = strdup (path);
+  if (!cache || !cache->path) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    free (cache);
+    return -1;
+  }
+
+  regfont_mutex_init (&cache->lock);
+  mapCache (cache);
+  session->cache = cache;
+  return 0;
+}
+
+/* Put entry in its slot, replacing an entry with the same key if
+ * replace is set.  Returns 1 if a new slot was used. */
+static int placeEntry (regfont_cache_entry *entries, unsigned int slots,
+    const regfont_cache_entry *entry, int replace) {
+  unsigned int i, mask = slots - 1;
+
+  for (i = (unsigned int) entry->key & mask; entries[i].key != 0;
+      i = (i + 1) & mask) {
+    if (entries[i].key == entry->key) {
+      if (replace)
+        entries[i] = *entry;
+      return 0;
+    }
+  }
+  entries[i] = *entry;
+  return 1;
+}
+
+/* Returns 1 and the verdict if filename was checked before and has not
+ * changed since.  Otherwise key is left ready for cacheStore. */
+int cacheLookup (regfont_session *session, const char *filename,
+    regfont_cache_entry *key, int *status, regfont_spec_info *spec) {
+  regfont_cache *cache = session->cache;
+  const regfont_cache_entry *entry = NULL;
+  int hit = 0, stale = 0;
+
+  if (cacheKey (filename, key, spec) != 0)
+    return 0;
+
+  regfont_mutex_lock (&cache->lock);
+  if (cache->added)
+    entry = probeCache (cache->added, cache->addedslots, key->key);
+  if (!entry && cache->entries)
+    entry = probeCache (cache->entries, cache->slots, key->key);
+
+  if (entry) {
+    if (entry->size != key->size || entry->mtime != key->mtime ||
+        entry->extra != key->extra)
+      stale = 1;
+    else if ((!session->options.strict ||
+          (entry->flags & REGFONT_CACHE_STRICT)) &&
+        (!session->options.verify || (entry->flags & REGFONT_CACHE_VERIFY)))
+      hit = 1;
+  }
+
+  if (hit) {
+    cache->hits++;
+    *status = entry->status;
+  } else {
+    cache->misses++;
+  }
+  if (stale)
+    cache->stale++;
+  regfont_mutex_unlock (&cache->lock);
+
+  if (hit) {
+    dbtrace ("    Validation cache hit: %s", errorString (*status));
+    return 1;
+  }
+
+  dbtrace ("    Validation cache %s", stale ? "entry is stale" : "miss");
+  return 0;
+}
+
+void cacheStore (regfont_session *session, regfont_cache_entry *key,
+    int status, regfont_format format) {
+  regfont_cache *cache = session->cache;
+
+  if (key->key == 0)
+    return;
+
+  key->status = (unsigned short) status;
+  key->format = (unsigned char) format;
+  key->flags = (session->options.strict ? REGFONT_CACHE_STRICT : 0) |
+    (session->options.verify ? REGFONT_CACHE_VERIFY : 0);
+
+  regfont_mutex_lock (&cache->lock);
+  if ((cache->nadded + 1) * 2 > cache->addedslots) {
+    unsigned int slots = cache->addedslots ? cache->addedslots * 2 : 256;
+    regfont_cache_entry *added = calloc (slots, sizeof (regfont_cache_entry));
+    unsigned int i;
+
+    if (!added) {
+      regfont_mutex_unlock (&cache->lock);
+      return;
+    }
+    for (i = 0; i < cache->addedslots; i++) {
+      if (cache->added[i].key != 0)
+        placeEntry (added, slots, &cache->added[i], 0);
+    }
+    free (cache->added);
+    cache->added = added;
+    cache->addedslots = slots;
+  }
+  cache->nadded += placeEntry (cache->added, cache->addedslots, key, 1);
+  regfont_mutex_unlock (&cache->lock);
+}
+
+/* Write this run's verdicts and the old entries they did not replace
+ * to a new table */
+static int saveCache (regfont_cache *cache) {
+  cache_header header;
+  regfont_cache_entry *entries;
+  unsigned long long needed;
+  unsigned int slots = REGFONT_CACHE_MIN_SLOTS, count = 0, i;
+  char *tmppath;
+  size_t len;
+  FILE *file;
+  int retval = -1;
+
+  needed = (unsigned long long) cache->nadded + (cache->entries ?
+      ((const cache_header *) cache->map.data)->count : 0);
+  while (slots < needed * 2)
+    slots *= 2;
+
+  entries = calloc (slots, sizeof (regfont_cache_entry));
+  len = strlen (cache->path);
+  tmppath = malloc (len + 5);
+  if (!entries || !tmppath) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    goto cleanup;
+  }
+
+  for (i = 0; i < cache->addedslots; i++) {
+    if (cache->added[i].key != 0)
+      count += placeEntry (entries, slots, &cache->added[i], 0);
+  }
+  for (i = 0; cache->entries && i < cache->slots; i++) {
+    if (cache->entries[i].key != 0)
+      count += placeEntry (entries, slots, &cache->entries[i], 0);
+  }
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, REGFONT_CACHE_MAGIC, 8);
+  header.version = REGFONT_CACHE_VERSION;
+  header.slots = slots;
+  header.count = count;
+
+  memcpy (tmppath, cache->path, len);
+  memcpy (tmppath + len, ".tmp", 5);
+
+  file = fopen (tmppath, "wb");
+  if (!file) {
+    fprintf (stderr, "ERROR: Could not write validation cache %s\n",
+        tmppath);
+    goto cleanup;
+  }
+  if (fwrite (&header, sizeof (header), 1, file) != 1 ||
+      fwrite (entries, sizeof (regfont_cache_entry), slots, file) != slots) {
+    fprintf (stderr, "ERROR: Could not write validation cache %s\n",
+        tmppath);
+    fclose (file);
+    remove (tmppath);
+    goto cleanup;
+  }
+  if (fclose (file) != 0) {
+    fprintf (stderr, "ERROR: Could not write validation cache %s\n",
+        tmppath);
+    remove (tmppath);
+    goto cleanup;
+  }
+
+  /* Windows cannot replace a file that is still mapped */
+  regfont_map_close (&cache->map);
+  cache->entries = NULL;
+
+  if (regfont_replace_file (tmppath, cache->path) != 0) {
+    fprintf (stderr, "ERROR: Could not replace validation cache %s\n",
+        cache->path);
+    remove (tmppath);
+    goto cleanup;
+  }
+  dbprintf ("Saved %u entries to validation cache %s", count, cache->path);
+  retval = 0;
+
+cleanup:
+  free (tmppath);
+  free (entries);
+  return retval;
+}
+
+void closeCache (regfont_session *session) {
+  regfont_cache *cache = session->cache;
+
+  if (!cache)
+    return;
+  session->cache = NULL;
+
+  if (cache->hits + cache->misses > 0)
+    msgprintf (session, stdout, "Validation cache: %lu hits, %lu misses, "
+        "%lu stale entries invalidated\n", cache->hits, cache->misses,
+        cache->stale);
+
+  if (cache->nadded > 0)
+    saveCache (cache);
+
+  regfont_map_close (&cache->map);
+  regfont_mutex_destroy (&cache->lock);
+  free (cache->added);
+  free (cache->path);
+  free (cache);
+}
@@ -0,0 +1,901 @@
+/* compat.c
+ * Platform compatibility layer for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "compat.h"
+
+regfont_atomic regfont_stat_calls = 0;
+REGFONT_THREAD_LOCAL int regfont_debugging = 0;
+
+unsigned long regfont_stat_count (void) {
+  return (unsigned long) regfont_atomic_load (&regfont_stat_calls);
+}
+
+#ifdef _WIN32
+
+#include <fcntl.h>
+#include <io.h>
+#include <ntsecapi.h>
+
+unsigned long long regfont_now_us (void) {
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency (&frequency);
+  QueryPerformanceCounter (&counter);
+
+  return (unsigned long long) (counter.QuadPart / frequency.QuadPart) *
+    1000000ULL + (unsigned long long) (counter.QuadPart % frequency.QuadPart) *
+    1000000ULL / frequency.QuadPart;
+}
+
+unsigned long long regfont_now_ns (void) {
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency (&frequency);
+  QueryPerformanceCounter (&counter);
+
+  return (unsigned long long) (counter.QuadPart / frequency.QuadPart) *
+    1000000000ULL + (unsigned long long) (counter.QuadPart %
+    frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+}
+
+void regfont_sleep_us (unsigned long long us) {
+  Sleep ((DWORD) ((us + 999) / 1000));
+}
+
+int regfont_stat (const char *path, regfont_stat_info *info) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+
+  regfont_atomic_add (&regfont_stat_calls, 1);
+  if (!GetFileAttributesEx (path, GetFileExInfoStandard, &data))
+    return -1;
+  info->size = ((unsigned long long) data.nFileSizeHigh << 32) |
+    data.nFileSizeLow;
+  info->mtime = (long long) (((unsigned long long)
+        data.ftLastWriteTime.dwHighDateTime << 32) |
+      data.ftLastWriteTime.dwLowDateTime);
+  info->directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+  return 0;
+}
+
+int regfont_map_open (regfont_map *map, const char *path) {
+  LARGE_INTEGER size;
+
+  map->data = NULL;
+  map->mapping = NULL;
+  map->file = CreateFile (path, GENERIC_READ, FILE_SHARE_READ |
+      FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (map->file == INVALID_HANDLE_VALUE)
+    return -1;
+
+  regfont_atomic_add (&regfont_stat_calls, 1);
+  if (!GetFileSizeEx (map->file, &size) || size.QuadPart == 0 ||
+      (unsigned long long) size.QuadPart > (size_t) -1)
+    goto fail;
+  map->size = (size_t) size.QuadPart;
+
+  map->mapping = CreateFileMapping (map->file, NULL, PAGE_READONLY, 0, 0,
+      NULL);
+  if (!map->mapping)
+    goto fail;
+  map->data = MapViewOfFile (map->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!map->data)
+    goto fail;
+  return 0;
+
+fail:
+  if (map->mapping)
+    CloseHandle (map->mapping);
+  CloseHandle (map->file);
+  map->data = NULL;
+  return -1;
+}
+
+void regfont_map_close (regfont_map *map) {
+  if (!map->data)
+    return;
+  UnmapViewOfFile (map->data);
+  CloseHandle (map->mapping);
+  CloseHandle (map->file);
+  map->data = NULL;
+}
+
+long regfont_read_file (const char *path, unsigned long long offset,
+    void *buffer, size_t size) {
+  OVERLAPPED overlapped;
+  HANDLE file;
+  DWORD got;
+  BOOL done;
+
+  file = CreateFile (path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+      NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return -1;
+
+  memset (&overlapped, 0, sizeof (overlapped));
+  overlapped.Offset = (DWORD) offset;
+  overlapped.OffsetHigh = (DWORD) (offset >> 32);
+  done = ReadFile (file, buffer, (DWORD) size, &got, &overlapped);
+  CloseHandle (file);
+  if (!done)
+    return GetLastError () == ERROR_HANDLE_EOF ? 0 : -1;
+  return (long) got;
+}
+
+int regfont_replace_file (const char *from, const char *to) {
+  return MoveFileEx (from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
+
+/* TEMP is the user's own, so only reparse points are refused.  Delete
+ * sharing lets a file open here be replaced by regfont_replace_file. */
+FILE *regfont_open_private (const char *path, const char *mode) {
+  DWORD access = GENERIC_READ, disposition = OPEN_EXISTING;
+  BY_HANDLE_FILE_INFORMATION info;
+  int flags = _O_RDONLY | _O_BINARY, fd;
+  HANDLE handle;
+  FILE *file;
+
+  if (mode[0] == 'w' || mode[0] == 'a') {
+    access = GENERIC_WRITE;
+    disposition = OPEN_ALWAYS;
+    flags = _O_WRONLY | _O_BINARY;
+  }
+  if (strchr (mode, '+')) {
+    access = GENERIC_READ | GENERIC_WRITE;
+    flags = (flags & ~(_O_RDONLY | _O_WRONLY)) | _O_RDWR;
+  }
+  if (mode[0] == 'a')
+    flags |= _O_APPEND;
+
+  handle = CreateFile (path, access, FILE_SHARE_READ | FILE_SHARE_WRITE |
+      FILE_SHARE_DELETE, NULL, disposition, FILE_ATTRIBUTE_NORMAL |
+      FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return NULL;
+  if (!GetFileInformationByHandle (handle, &info) ||
+      (info.dwFileAttributes & (FILE_ATTRIBUTE_REPARSE_POINT |
+                                FILE_ATTRIBUTE_DIRECTORY)) ||
+      info.nNumberOfLinks != 1 || (mode[0] == 'w' && !SetEndOfFile (handle))) {
+    CloseHandle (handle);
+    return NULL;
+  }
+
+  fd = _open_osfhandle ((intptr_t) handle, flags);
+  if (fd < 0) {
+    CloseHandle (handle);
+    return NULL;
+  }
+  file = _fdopen (fd, mode);
+  if (!file)
+    _close (fd);
+  return file;
+}
+
+/* Fonts added with AddFontResource last until the user logs off.  The
+ * logon session's LUID is only unique until a restart, so its logon
+ * time goes with it. */
+int regfont_logon_id (char *buffer, size_t size) {
+  PSECURITY_LOGON_SESSION_DATA data;
+  TOKEN_STATISTICS stats;
+  HANDLE token;
+  DWORD len;
+  int retval = -1;
+
+  if (!OpenProcessToken (GetCurrentProcess (), TOKEN_QUERY, &token))
+    return -1;
+  if (GetTokenInformation (token, TokenStatistics, &stats, sizeof (stats),
+        &len) && LsaGetLogonSessionData (&stats.AuthenticationId,
+          &data) == 0) {
+    _snprintf (buffer, size - 1, "%08lx%08lx-%08lx%08lx",
+        (unsigned long) stats.AuthenticationId.HighPart,
+        (unsigned long) stats.AuthenticationId.LowPart,
+        (unsigned long) data->LogonTime.HighPart,
+        (unsigned long) data->LogonTime.LowPart);
+    buffer[size - 1] = '\0';
+    LsaFreeReturnBuffer (data);
+    retval = 0;
+  }
+  CloseHandle (token);
+  return retval;
+}
+
+/* The lock covers a byte far beyond anything written, as Windows locks
+ * keep other handles from the bytes they cover */
+int regfont_lock_file (FILE *file, int exclusive) {
+  HANDLE handle = (HANDLE) _get_osfhandle (_fileno (file));
+  OVERLAPPED overlapped;
+
+  memset (&overlapped, 0, sizeof (overlapped));
+  overlapped.OffsetHigh = 0x7FFFFFFF;
+  return LockFileEx (handle, exclusive ? LOCKFILE_EXCLUSIVE_LOCK |
+      LOCKFILE_FAIL_IMMEDIATELY : 0, 0, 1, 0, &overlapped) ? 0 : -1;
+}
+
+void regfont_unlock_file (FILE *file) {
+  HANDLE handle = (HANDLE) _get_osfhandle (_fileno (file));
+  OVERLAPPED overlapped;
+
+  memset (&overlapped, 0, sizeof (overlapped));
+  overlapped.OffsetHigh = 0x7FFFFFFF;
+  UnlockFileEx (handle, 0, 1, 0, &overlapped);
+}
+
+int regfont_same_file (FILE *file, const char *path) {
+  BY_HANDLE_FILE_INFORMATION a, b;
+  HANDLE handle;
+  BOOL got;
+
+  handle = CreateFile (path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE |
+      FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS |
+      FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+  if (handle == INVALID_HANDLE_VALUE)
+    return 0;
+  got = GetFileInformationByHandle (handle, &b);
+  CloseHandle (handle);
+  return got && GetFileInformationByHandle ((HANDLE) _get_osfhandle (
+        _fileno (file)), &a) &&
+    a.dwVolumeSerialNumber == b.dwVolumeSerialNumber &&
+    a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+}
+
+FILE *regfont_take_stdout (void) {
+  FILE *stream;
+  int fd;
+
+  fflush (stdout);
+  fd = _dup (1);
+  if (fd < 0)
+    return NULL;
+  if (_dup2 (2, 1) != 0) {
+    _close (fd);
+    return NULL;
+  }
+  stream = _fdopen (fd, "w");
+  if (!stream)
+    _close (fd);
+  return stream;
+}
+
+int regfont_cpu_count (void) {
+  SYSTEM_INFO info;
+
+  GetSystemInfo (&info);
+  return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+typedef struct {
+  void (*fn) (void *);
+  void *arg;
+  int debugging;
+} thread_start;
+
+static DWORD WINAPI threadTrampoline (LPVOID param) {
+  thread_start start = *(thread_start *) param;
+
+  free (param);
+  regfont_debugging = start.debugging;
+  start.fn (start.arg);
+  return 0;
+}
+
+int regfont_thread_create (regfont_thread *thread, void (*fn) (void *),
+    void *arg) {
+  thread_start *start = malloc (sizeof (thread_start));
+
+  if (!start)
+    return -1;
+  start->fn = fn;
+  start->arg = arg;
+  start->debugging = regfont_debugging;
+
+  *thread = CreateThread (NULL, 0, threadTrampoline, start, 0, NULL);
+  if (*thread == NULL) {
+    free (start);
+    return -1;
+  }
+  return 0;
+}
+
+void regfont_thread_join (regfont_thread thread) {
+  WaitForSingleObject (thread, INFINITE);
+  CloseHandle (thread);
+}
+
+void regfont_yield (void) {
+  SwitchToThread ();
+}
+
+long regfont_atomic_load (regfont_atomic *value) {
+  return InterlockedCompareExchange (value, 0, 0);
+}
+
+void regfont_atomic_store (regfont_atomic *value, long v) {
+  InterlockedExchange (value, v);
+}
+
+int regfont_atomic_cas (regfont_atomic *value, long expected, long desired) {
+  return InterlockedCompareExchange (value, desired, expected) == expected;
+}
+
+long regfont_atomic_add (regfont_atomic *value, long delta) {
+  return InterlockedExchangeAdd (value, delta) + delta;
+}
+
+void regfont_mutex_init (regfont_mutex *mutex) {
+  InitializeCriticalSection (mutex);
+}
+
+void regfont_mutex_destroy (regfont_mutex *mutex) {
+  DeleteCriticalSection (mutex);
+}
+
+void regfont_mutex_lock (regfont_mutex *mutex) {
+  EnterCriticalSection (mutex);
+}
+
+void regfont_mutex_unlock (regfont_mutex *mutex) {
+  LeaveCriticalSection (mutex);
+}
+
+void regfont_cond_init (regfont_cond *cond) {
+  InitializeConditionVariable (cond);
+}
+
+void regfont_cond_destroy (regfont_cond *cond) {
+}
+
+void regfont_cond_wait (regfont_cond *cond, regfont_mutex *mutex) {
+  SleepConditionVariableCS (cond, mutex, INFINITE);
+}
+
+void regfont_cond_broadcast (regfont_cond *cond) {
+  WakeAllConditionVariable (cond);
+}
+
+static BOOL CALLBACK callOnce (PINIT_ONCE once, PVOID param, PVOID *context) {
+  void (**fn) (void) = param;
+
+  (*fn) ();
+  return TRUE;
+}
+
+void regfont_call_once (regfont_once *once, void (*fn) (void)) {
+  InitOnceExecuteOnce (once, callOnce, &fn, NULL);
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+  defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+unsigned long GetFullPathName (const char *filename, unsigned long size,
+    char *buffer, char **filepart) {
+  char cwd[PATH_MAX];
+  size_t cwdlen = 0, namelen;
+  unsigned long needed;
+
+  if (filename == NULL || *filename == '\0')
+    return 0;
+
+  namelen = strlen (filename);
+  if (filename[0] != '/') {
+    if (getcwd (cwd, sizeof (cwd)) == NULL)
+      return 0;
+    cwdlen = strlen (cwd);
+    if (cwdlen > 0 && cwd[cwdlen - 1] != '/')
+      cwd[cwdlen++] = '/';
+  }
+
+  /* Like Win32, return the size needed including the terminator when
+   * the buffer is too small, otherwise the length copied */
+  needed = (unsigned long) (cwdlen + namelen + 1);
+  if (needed > size)
+    return needed;
+
+  memcpy (buffer, cwd, cwdlen);
+  memcpy (buffer + cwdlen, filename, namelen + 1);
+
+  if (filepart) {
+    *filepart = strrchr (buffer, '/');
+    if (*filepart)
+      (*filepart)++;
+  }
+
+  return needed - 1;
+}
+
+int PathIsDirectory (const char *path) {
+  struct stat st;
+
+  return stat (path, &st) == 0 && S_ISDIR (st.st_mode);
+}
+
+char *PathFindExtension (const char *path) {
+  const char *dot = NULL;
+  const char *p = path;
+
+  for ( ; *p; p++) {
+    if (*p == '/')
+      dot = NULL;
+    else if (*p == '.')
+      dot = p;
+  }
+
+  return (char *) (dot ? dot : p);
+}
+
+unsigned long long regfont_now_us (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000ULL +
+    (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+unsigned long long regfont_now_ns (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL +
+    (unsigned long long) ts.tv_nsec;
+}
+
+void regfont_sleep_us (unsigned long long us) {
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) (us / 1000000ULL);
+  ts.tv_nsec = (long) (us % 1000000ULL) * 1000L;
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+/* statx asks only for what is kept, which network filesystems can
+ * answer without fetching the rest of the attributes */
+int regfont_stat (const char *path, regfont_stat_info *info) {
+#ifdef HAVE_STATX
+  struct statx st;
+
+  regfont_atomic_add (&regfont_stat_calls, 1);
+  if (statx (AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+        &st) != 0)
+    return -1;
+  info->size = (unsigned long long) st.stx_size;
+  info->mtime = (long long) st.stx_mtime.tv_sec * 1000000000LL +
+    st.stx_mtime.tv_nsec;
+  info->directory = S_ISDIR (st.stx_mode);
+#else
+  struct stat st;
+
+  regfont_atomic_add (&regfont_stat_calls, 1);
+  if (stat (path, &st) != 0)
+    return -1;
+  info->size = (unsigned long long) st.st_size;
+  /* macOS and the BSDs name the field differently, and elsewhere only
+   * whole seconds may be kept */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+  info->mtime = (long long) st.st_mtim.tv_sec * 1000000000LL +
+    st.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+  info->mtime = (long long) st.st_mtimespec.tv_sec * 1000000000LL +
+    st.st_mtimespec.tv_nsec;
+#else
+  info->mtime = (long long) st.st_mtime * 1000000000LL;
+#endif
+  info->directory = S_ISDIR (st.st_mode);
+#endif
+  return 0;
+}
+
+int regfont_map_open (regfont_map *map, const char *path) {
+  struct stat st;
+  void *data;
+  int fd;
+
+  map->data = NULL;
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  regfont_atomic_add (&regfont_stat_calls, 1);
+  if (fstat (fd, &st) != 0 || st.st_size == 0 ||
+      (unsigned long long) st.st_size > (size_t) -1) {
+    close (fd);
+    return -1;
+  }
+
+  data = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return -1;
+
+  map->data = data;
+  map->size = (size_t) st.st_size;
+  return 0;
+}
+
+void regfont_map_close (regfont_map *map) {
+  if (!map->data)
+    return;
+  munmap ((void *) map->data, map->size);
+  map->data = NULL;
+}
+
+long regfont_read_file (const char *path, unsigned long long offset,
+    void *buffer, size_t size) {
+  ssize_t got;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  do {
+    got = pread (fd, buffer, size, (off_t) offset);
+  } while (got < 0 && errno == EINTR);
+  close (fd);
+  return (long) got;
+}
+
+int regfont_replace_file (const char *from, const char *to) {
+  return rename (from, to);
+}
+
+/* Elsewhere fonts last until the system restarts */
+int regfont_logon_id (char *buffer, size_t size) {
+#if defined(__linux__)
+  FILE *file = fopen ("/proc/sys/kernel/random/boot_id", "r");
+  int retval = -1;
+
+  if (!file)
+    return -1;
+  if (fgets (buffer, (int) size, file)) {
+    buffer[strcspn (buffer, "\n")] = '\0';
+    retval = *buffer ? 0 : -1;
+  }
+  fclose (file);
+  return retval;
+#elif defined(KERN_BOOTTIME)
+  int mib[2] = {CTL_KERN, KERN_BOOTTIME};
+  struct timeval boot;
+  size_t len = sizeof (boot);
+
+  if (sysctl (mib, 2, &boot, &len, NULL, 0) != 0)
+    return -1;
+  snprintf (buffer, size, "%ld.%06ld", (long) boot.tv_sec,
+      (long) boot.tv_usec);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Creating the file or opening it is all one call, so nothing can be
+ * put in its place in between.  A hard link to a file of the user's
+ * own is refused by its link count. */
+FILE *regfont_open_private (const char *path, const char *mode) {
+  int flags = O_RDONLY, fd;
+  struct stat st;
+  FILE *file;
+
+  if (mode[0] == 'w' || mode[0] == 'a')
+    flags = O_WRONLY | O_CREAT;
+  if (strchr (mode, '+'))
+    flags = (flags & ~O_ACCMODE) | O_RDWR;
+  if (mode[0] == 'a')
+    flags |= O_APPEND;
+
+  fd = open (path, flags | O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) ||
+      st.st_uid != geteuid () || st.st_nlink != 1 ||
+      (mode[0] == 'w' && ftruncate (fd, 0) != 0)) {
+    close (fd);
+    errno = EACCES;
+    return NULL;
+  }
+
+  file = fdopen (fd, mode);
+  if (!file)
+    close (fd);
+  return file;
+}
+
+int regfont_lock_file (FILE *file, int exclusive) {
+  return flock (fileno (file), exclusive ? LOCK_EX | LOCK_NB : LOCK_SH);
+}
+
+void regfont_unlock_file (FILE *file) {
+  flock (fileno (file), LOCK_UN);
+}
+
+int regfont_same_file (FILE *file, const char *path) {
+  struct stat a, b;
+
+  return fstat (fileno (file), &a) == 0 && lstat (path, &b) == 0 &&
+    a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+FILE *regfont_take_stdout (void) {
+  FILE *stream;
+  int fd;
+
+  fflush (stdout);
+  fd = dup (1);
+  if (fd < 0)
+    return NULL;
+  if (dup2 (2, 1) < 0) {
+    close (fd);
+    return NULL;
+  }
+  stream = fdopen (fd, "w");
+  if (!stream)
+    close (fd);
+  return stream;
+}
+
+int regfont_cpu_count (void) {
+  long count = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return count > 0 ? (int) count : 1;
+}
+
+typedef struct {
+  void (*fn) (void *);
+  void *arg;
+  int debugging;
+} thread_start;
+
+static void *threadTrampoline (void *param) {
+  thread_start start = *(thread_start *) param;
+
+  free (param);
+  regfont_debugging = start.debugging;
+  start.fn (start.arg);
+  return NULL;
+}
+
+int regfont_thread_create (regfont_thread *thread, void (*fn) (void *),
+    void *arg) {
+  thread_start *start = malloc (sizeof (thread_start));
+
+  if (!start)
+    return -1;
+  start->fn = fn;
+  start->arg = arg;
+  start->debugging = regfont_debugging;
+
+  if (pthread_create (thread, NULL, threadTrampoline, start) != 0) {
+    free (start);
+    return -1;
+  }
+  return 0;
+}
+
+void regfont_thread_join (regfont_thread thread) {
+  pthread_join (thread, NULL);
+}
+
+void regfont_yield (void) {
+  sched_yield ();
+}
+
+long regfont_atomic_load (regfont_atomic *value) {
+  return __atomic_load_n (value, __ATOMIC_SEQ_CST);
+}
+
+void regfont_atomic_store (regfont_atomic *value, long v) {
+  __atomic_store_n (value, v, __ATOMIC_SEQ_CST);
+}
+
+int regfont_atomic_cas (regfont_atomic *value, long expected, long desired) {
+  return __atomic_compare_exchange_n (value, &expected, desired, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+long regfont_atomic_add (regfont_atomic *value, long delta) {
+  return __atomic_add_fetch (value, delta, __ATOMIC_SEQ_CST);
+}
+
+void regfont_mutex_init (regfont_mutex *mutex) {
+  pthread_mutex_init (mutex, NULL);
+}
+
+void regfont_mutex_destroy (regfont_mutex *mutex) {
+  pthread_mutex_destroy (mutex);
+}
+
+void regfont_mutex_lock (regfont_mutex *mutex) {
+  pthread_mutex_lock (mutex);
+}
+
+void regfont_mutex_unlock (regfont_mutex *mutex) {
+  pthread_mutex_unlock (mutex);
+}
+
+void regfont_cond_init (regfont_cond *cond) {
+  pthread_cond_init (cond, NULL);
+}
+
+void regfont_cond_destroy (regfont_cond *cond) {
+  pthread_cond_destroy (cond);
+}
+
+void regfont_cond_wait (regfont_cond *cond, regfont_mutex *mutex) {
+  pthread_cond_wait (cond, mutex);
+}
+
+void regfont_cond_broadcast (regfont_cond *cond) {
+  pthread_cond_broadcast (cond);
+}
+
+void regfont_call_once (regfont_once *once, void (*fn) (void)) {
+  pthread_once (once, fn);
+}
+
+#endif
+
+long regfont_getline (char **line, size_t *size, FILE *file) {
+  size_t len = 0;
+  int c;
+
+  while ((c = getc (file)) != EOF) {
+    if (len + 2 > *size) {
+      size_t grown = *size ? *size * 2 : 256;
+      char *buffer = realloc (*line, grown);
+
+      if (!buffer)
+        return -1;
+      *line = buffer;
+      *size = grown;
+    }
+    (*line)[len++] = (char) c;
+    if (c == '\n')
+      break;
+  }
+  if (len == 0)
+    return -1;
+  (*line)[len] = '\0';
+  return (long) len;
+}
+
+struct regfont_pool {
+  regfont_mutex lock;
+  regfont_cond changed;
+  regfont_thread *threads;
+  int nthreads;
+  void (*fn) (void *, size_t);
+  void *arg;
+  size_t count;
+  size_t next;
+  size_t done;
+  int stopping;
+};
+
+static void poolWorker (void *param) {
+  regfont_pool *pool = param;
+  size_t item;
+
+  regfont_mutex_lock (&pool->lock);
+  while (1) {
+    while (!pool->stopping && pool->next >= pool->count)
+      regfont_cond_wait (&pool->changed, &pool->lock);
+    if (pool->stopping)
+      break;
+
+    item = pool->next++;
+    regfont_mutex_unlock (&pool->lock);
+    pool->fn (pool->arg, item);
+    regfont_mutex_lock (&pool->lock);
+
+    if (++pool->done == pool->count)
+      regfont_cond_broadcast (&pool->changed);
+  }
+  regfont_mutex_unlock (&pool->lock);
+}
+
+regfont_pool *regfont_pool_create (int threads) {
+  regfont_pool *pool = calloc (1, sizeof (regfont_pool));
+
+  if (!pool)
+    return NULL;
+  pool->threads = calloc ((size_t) threads, sizeof (regfont_thread));
+  if (!pool->threads) {
+    free (pool);
+    return NULL;
+  }
+
+  regfont_mutex_init (&pool->lock);
+  regfont_cond_init (&pool->changed);
+
+  for ( ; pool->nthreads < threads; pool->nthreads++) {
+    if (regfont_thread_create (&pool->threads[pool->nthreads], poolWorker,
+          pool) != 0)
+      break;
+  }
+
+  if (pool->nthreads == 0) {
+    regfont_pool_destroy (pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void regfont_pool_start (regfont_pool *pool, void (*fn) (void *, size_t),
+    void *arg, size_t count) {
+  regfont_mutex_lock (&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->count = count;
+  pool->next = 0;
+  pool->done = 0;
+  regfont_cond_broadcast (&pool->changed);
+  regfont_mutex_unlock (&pool->lock);
+}
+
+void regfont_pool_wait (regfont_pool *pool) {
+  regfont_mutex_lock (&pool->lock);
+  while (pool->done < pool->count)
+    regfont_cond_wait (&pool->changed, &pool->lock);
+  regfont_mutex_unlock (&pool->lock);
+}
+
+void regfont_pool_destroy (regfont_pool *pool) {
+  int i;
+
+  regfont_mutex_lock (&pool->lock);
+  pool->stopping = 1;
+  regfont_cond_broadcast (&pool->changed);
+  regfont_mutex_unlock (&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++)
+    regfont_thread_join (pool->threads[i]);
+
+  regfont_cond_destroy (&pool->changed);
+  regfont_mutex_destroy (&pool->lock);
+  free (pool->threads);
+  free (pool);
+}
@@ -0,0 +1,194 @@
+/* compat.h
+ * Platform compatibility layer for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGFONT_COMPAT_H
+#define REGFONT_COMPAT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <shlwapi.h>
+
+#else
+
+/* Just enough of the Win32 path and string API for regfont to build
+ * and run against a simulated font table on POSIX systems. */
+
+#include <limits.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define MAX_PATH PATH_MAX
+
+/* The stand ins link under names of regfont's own, so as not to clash
+ * with another emulation of the same API in a program using the
+ * library */
+#define GetFullPathName regfont_GetFullPathName
+#define PathIsDirectory regfont_PathIsDirectory
+#define PathFindExtension regfont_PathFindExtension
+
+unsigned long GetFullPathName (const char *filename, unsigned long size,
+    char *buffer, char **filepart);
+int PathIsDirectory (const char *path);
+char *PathFindExtension (const char *path);
+
+#endif
+
+/* Monotonic clock in microseconds and in nanoseconds */
+unsigned long long regfont_now_us (void);
+unsigned long long regfont_now_ns (void);
+void regfont_sleep_us (unsigned long long us);
+
+/* File size and last write time, in whatever units the platform keeps
+ * it.  Returns -1 if the file cannot be queried.  Each is a single
+ * metadata query, and regfont_stat_count says how many have been made,
+ * including those that open a file to map it. */
+typedef struct {
+  unsigned long long size;
+  long long mtime;
+  int directory;
+} regfont_stat_info;
+
+int regfont_stat (const char *path, regfont_stat_info *info);
+unsigned long regfont_stat_count (void);
+
+/* Read only memory maps of whole files.  Empty files cannot be
+ * mapped. */
+typedef struct {
+  const unsigned char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} regfont_map;
+
+int regfont_map_open (regfont_map *map, const char *path);
+void regfont_map_close (regfont_map *map);
+
+/* Read up to size bytes from offset in a file, without buffering.
+ * Returns how many were read, or -1 if the file cannot be read. */
+long regfont_read_file (const char *path, unsigned long long offset,
+    void *buffer, size_t size);
+
+/* Atomically replace to with from */
+int regfont_replace_file (const char *from, const char *to);
+
+/* Read a line of any length into *line, grown as needed, as getline
+ * does.  Returns its length, newline included, or -1 at the end of the
+ * file or if out of memory. */
+long regfont_getline (char **line, size_t *size, FILE *file);
+
+/* Open a file only the current user can have made, without following
+ * a symbolic link, creating it with mode 0600 when writing.  mode is as
+ * for fopen.  Returns NULL if the file is not a regular file of the
+ * user's own with a single name. */
+FILE *regfont_open_private (const char *path, const char *mode);
+
+/* Advisory whole file locks.  A shared lock waits for an exclusive one
+ * to go, while an exclusive lock is only taken if no other is held.
+ * Returns 0 once the lock is held. */
+int regfont_lock_file (FILE *file, int exclusive);
+void regfont_unlock_file (FILE *file);
+
+/* Non-zero if file is still the one at path */
+int regfont_same_file (FILE *file, const char *path);
+
+/* An identifier for how long registered fonts last: the logon session
+ * under Windows, and the time since the system started elsewhere.
+ * Returns -1 if there is none. */
+int regfont_logon_id (char *buffer, size_t size);
+
+/* A stream on the original stdout, for the caller alone, with stdout
+ * itself sent to stderr from then on.  Returns NULL if the descriptors
+ * cannot be duplicated. */
+FILE *regfont_take_stdout (void);
+
+/* Threads */
+#ifdef _MSC_VER
+#define REGFONT_THREAD_LOCAL __declspec(thread)
+#else
+#define REGFONT_THREAD_LOCAL __thread
+#endif
+
+#ifdef _WIN32
+typedef HANDLE regfont_thread;
+typedef CRITICAL_SECTION regfont_mutex;
+typedef CONDITION_VARIABLE regfont_cond;
+typedef INIT_ONCE regfont_once;
+#define REGFONT_ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+#include <pthread.h>
+typedef pthread_t regfont_thread;
+typedef pthread_mutex_t regfont_mutex;
+typedef pthread_cond_t regfont_cond;
+typedef pthread_once_t regfont_once;
+#define REGFONT_ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+
+/* The debug log level of the current thread, which threads it starts
+ * inherit */
+extern REGFONT_THREAD_LOCAL int regfont_debugging;
+
+int regfont_cpu_count (void);
+void regfont_yield (void);
+int regfont_thread_create (regfont_thread *thread, void (*fn) (void *),
+    void *arg);
+void regfont_thread_join (regfont_thread thread);
+void regfont_mutex_init (regfont_mutex *mutex);
+void regfont_mutex_destroy (regfont_mutex *mutex);
+void regfont_mutex_lock (regfont_mutex *mutex);
+void regfont_mutex_unlock (regfont_mutex *mutex);
+void regfont_cond_init (regfont_cond *cond);
+void regfont_cond_destroy (regfont_cond *cond);
+void regfont_cond_wait (regfont_cond *cond, regfont_mutex *mutex);
+void regfont_cond_broadcast (regfont_cond *cond);
+
+/* Runs fn the first time it is called for once, from whichever thread;
+ * every other call waits until fn has returned */
+void regfont_call_once (regfont_once *once, void (*fn) (void));
+
+/* Atomic operations on a shared counter, each a full barrier */
+typedef volatile long regfont_atomic;
+
+long regfont_atomic_load (regfont_atomic *value);
+void regfont_atomic_store (regfont_atomic *value, long v);
+int regfont_atomic_cas (regfont_atomic *value, long expected, long desired);
+long regfont_atomic_add (regfont_atomic *value, long delta);
+
+/* Metadata queries made other than through regfont_stat count here */
+extern regfont_atomic regfont_stat_calls;
+
+/* A fixed set of worker threads that run fn (arg, i) for every i in
+ * [0, count).  regfont_pool_start returns at once; regfont_pool_wait
+ * blocks until every item has run. */
+typedef struct regfont_pool regfont_pool;
+
+regfont_pool *regfont_pool_create (int threads);
+void regfont_pool_start (regfont_pool *pool, void (*fn) (void *, size_t),
+    void *arg, size_t count);
+void regfont_pool_wait (regfont_pool *pool);
+void regfont_pool_destroy (regfont_pool *pool);
+
+#endif
@@ -0,0 +1,370 @@
+/* dedup.c
+ * Duplicate font detection for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Contents are hashed with XXH64, which keeps four independent
+ * accumulators over each 32 byte stripe so that a modern CPU works on
+ * all of them at once.  A matching hash is confirmed by comparing the
+ * files before anything is skipped. */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long readLE64 (const unsigned char *p) {
+  unsigned long long v;
+
+  /* Compilers turn this into a single load on little endian targets */
+  v = (unsigned long long) p[0] | ((unsigned long long) p[1] << 8) |
+    ((unsigned long long) p[2] << 16) | ((unsigned long long) p[3] << 24) |
+    ((unsigned long long) p[4] << 32) | ((unsigned long long) p[5] << 40) |
+    ((unsigned long long) p[6] << 48) | ((unsigned long long) p[7] << 56);
+  return v;
+}
+
+static unsigned long long xxhRound (unsigned long long acc,
+    unsigned long long input) {
+  acc += input * PRIME64_2;
+  acc = ROTL64 (acc, 31);
+  return acc * PRIME64_1;
+}
+
+static unsigned long long xxhMerge (unsigned long long acc,
+    unsigned long long val) {
+  acc ^= xxhRound (0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+unsigned long long hashContents (const unsigned char *data, size_t len,
+    unsigned long long seed) {
+  const unsigned char *p = data, *end = data + len;
+  unsigned long long h;
+
+  if (len >= 32) {
+    unsigned long long v1 = seed + PRIME64_1 + PRIME64_2;
+    unsigned long long v2 = seed + PRIME64_2;
+    unsigned long long v3 = seed;
+    unsigned long long v4 = seed - PRIME64_1;
+    const unsigned char *limit = end - 32;
+
+    do {
+      v1 = xxhRound (v1, readLE64 (p));
+      v2 = xxhRound (v2, readLE64 (p + 8));
+      v3 = xxhRound (v3, readLE64 (p + 16));
+      v4 = xxhRound (v4, readLE64 (p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = ROTL64 (v1, 1) + ROTL64 (v2, 7) + ROTL64 (v3, 12) + ROTL64 (v4, 18);
+    h = xxhMerge (h, v1);
+    h = xxhMerge (h, v2);
+    h = xxhMerge (h, v3);
+    h = xxhMerge (h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+
+  h += (unsigned long long) len;
+
+  for ( ; p + 8 <= end; p += 8) {
+    h ^= xxhRound (0, readLE64 (p));
+    h = ROTL64 (h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (unsigned long long) readLE32 (p) * PRIME64_1;
+    h = ROTL64 (h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for ( ; p < end; p++) {
+    h ^= (unsigned long long) *p * PRIME64_5;
+    h = ROTL64 (h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+/* Split a font specification into the full paths of its one or two
+ * files, made in arena */
+static int splitSpec (regfont_arena *arena, const char *filename,
+    char *parts[2]) {
+  regfont_view full;
+  char *pipe_pos;
+
+  if (fullSpecPath (arena, filename, &full) != REGFONT_OK)
+    return -1;
+  parts[0] = (char *) full.data;
+  parts[1] = NULL;
+  pipe_pos = strchr (parts[0], '|');
+  if (pipe_pos) {
+    *pipe_pos = '\0';
+    parts[1] = pipe_pos + 1;
+  }
+  return 0;
+}
+
+/* Hash the contents of a font, both halves of a PostScript font
+ * chained together.  fp->valid is 0 if it could not be read. */
+int fingerprintFont (const char *filename, regfont_fingerprint *fp) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  char *parts[2];
+  int retval = -1, i;
+
+  fp->hash = 0;
+  fp->size = 0;
+  fp->valid = 0;
+  if (splitSpec (&regfont_path_arena, filename, parts) != 0)
+    goto cleanup;
+
+  for (i = 0; i < 2 && parts[i]; i++) {
+    regfont_map map;
+
+    if (regfont_map_open (&map, parts[i]) != 0) {
+      regfont_stat_info info;
+
+      /* Empty files cannot be mapped, but hash like any other */
+      if (regfont_stat (parts[i], &info) != 0 || info.size != 0)
+        goto cleanup;
+      fp->hash = hashContents ((const unsigned char *) "", 0, fp->hash);
+      continue;
+    }
+    fp->hash = hashContents (map.data, map.size, fp->hash);
+    fp->size += map.size;
+    regfont_map_close (&map);
+  }
+
+  fp->valid = -1;
+  retval = 0;
+
+cleanup:
+  arenaRelease (&regfont_path_arena, mark);
+  return retval;
+}
+
+static int sameFile (const char *a, const char *b) {
+  regfont_map ma, mb;
+  int same;
+
+  if (regfont_map_open (&ma, a) != 0)
+    return 0;
+  if (regfont_map_open (&mb, b) != 0) {
+    regfont_map_close (&ma);
+    return 0;
+  }
+  same = ma.size == mb.size && memcmp (ma.data, mb.data, ma.size) == 0;
+  regfont_map_close (&mb);
+  regfont_map_close (&ma);
+  return same;
+}
+
+/* Two specifications with the same fingerprint hold the same fonts if
+ * each of their files match.  Pairs of empty files are left to the
+ * hash. */
+static int sameContents (const char *a, const char *b) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  char *aparts[2], *bparts[2];
+  int same = 0, i;
+
+  if (splitSpec (&regfont_path_arena, a, aparts) != 0 ||
+      splitSpec (&regfont_path_arena, b, bparts) != 0 ||
+      (aparts[1] == NULL) != (bparts[1] == NULL))
+    goto cleanup;
+
+  for (i = 0; i < 2 && aparts[i]; i++) {
+    regfont_stat_info ainfo, binfo;
+
+    if (regfont_stat (aparts[i], &ainfo) != 0 ||
+        regfont_stat (bparts[i], &binfo) != 0 || ainfo.size != binfo.size)
+      goto cleanup;
+    if (ainfo.size > 0 && !sameFile (aparts[i], bparts[i]))
+      goto cleanup;
+  }
+  same = 1;
+
+cleanup:
+  arenaRelease (&regfont_path_arena, mark);
+  return same;
+}
+
+/* The same font, however it was named */
+static int samePath (const char *a, const char *b) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  regfont_view afull, bfull;
+  int same;
+
+  same = fullSpecPath (&regfont_path_arena, a, &afull) == REGFONT_OK &&
+    fullSpecPath (&regfont_path_arena, b, &bfull) == REGFONT_OK &&
+    strcmp (afull.data, bfull.data) == 0;
+  arenaRelease (&regfont_path_arena, mark);
+  return same;
+}
+
+/* The first font seen with each fingerprint, for the rest of the run
+ * of the session */
+
+typedef struct {
+  unsigned long long hash;
+  unsigned long long size;
+  char *filename;
+} dedup_entry;
+
+struct regfont_duplicates {
+  dedup_entry *table;
+  size_t slots;
+  size_t count;
+  unsigned long skipped;
+};
+
+static int growDuplicates (regfont_duplicates *dups) {
+  size_t slots = dups->slots ? dups->slots * 2 : 1024;
+  dedup_entry *table = calloc (slots, sizeof (dedup_entry));
+  size_t i;
+
+  if (!table)
+    return -1;
+  for (i = 0; i < dups->slots; i++) {
+    dedup_entry *entry = &dups->table[i];
+    size_t j;
+
+    if (!entry->filename)
+      continue;
+    for (j = (size_t) entry->hash & (slots - 1); table[j].filename;
+        j = (j + 1) & (slots - 1))
+      ;
+    table[j] = *entry;
+  }
+  free (dups->table);
+  dups->table = table;
+  dups->slots = slots;
+  return 0;
+}
+
+/* Returns the font that filename duplicates, after saying so, or NULL
+ * if it is the first of its contents, which is then remembered.  A font
+ * is never a duplicate of itself. */
+const char *duplicateOf (regfont_session *session, const char *filename,
+    const regfont_fingerprint *fp) {
+  regfont_duplicates *dups = session->duplicates;
+  size_t i;
+
+  if (!fp->valid)
+    return NULL;
+
+  if (!dups)
+    dups = session->duplicates = calloc (1, sizeof (regfont_duplicates));
+  if (!dups || ((dups->count + 1) * 2 > dups->slots &&
+        growDuplicates (dups) != 0)) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+
+  for (i = (size_t) fp->hash & (dups->slots - 1); dups->table[i].filename;
+      i = (i + 1) & (dups->slots - 1)) {
+    dedup_entry *entry = &dups->table[i];
+
+    if (entry->hash != fp->hash || entry->size != fp->size)
+      continue;
+    if (samePath (entry->filename, filename))
+      return NULL;
+    if (sameContents (entry->filename, filename)) {
+      msgprintf (session, stdout, "Skipped duplicate font: %s (same as %s)\n",
+          filename, entry->filename);
+      dups->skipped++;
+      return entry->filename;
+    }
+  }
+
+  dups->table[i].filename = strdup (filename);
+  if (!dups->table[i].filename)
+    return NULL;
+  dups->table[i].hash = fp->hash;
+  dups->table[i].size = fp->size;
+  dups->count++;
+  return NULL;
+}
+
+/* A font that has been removed no longer hides later copies of it */
+void forgetDuplicate (regfont_session *session, const char *filename,
+    const regfont_fingerprint *fp) {
+  regfont_duplicates *dups = session->duplicates;
+  size_t mask, i, j, home;
+
+  if (!dups || !fp->valid)
+    return;
+  mask = dups->slots - 1;
+
+  for (i = (size_t) fp->hash & mask; dups->table[i].filename;
+      i = (i + 1) & mask) {
+    dedup_entry *entry = &dups->table[i];
+
+    if (entry->hash == fp->hash && entry->size == fp->size &&
+        samePath (entry->filename, filename))
+      break;
+  }
+  if (!dups->table[i].filename)
+    return;
+  free (dups->table[i].filename);
+  dups->count--;
+
+  /* Entries after the gap move back into it, unless that would put
+   * them before their home slot */
+  for (j = (i + 1) & mask; dups->table[j].filename; j = (j + 1) & mask) {
+    home = (size_t) dups->table[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      dups->table[i] = dups->table[j];
+      i = j;
+    }
+  }
+  dups->table[i].filename = NULL;
+}
+
+void finishDuplicates (regfont_session *session) {
+  regfont_duplicates *dups = session->duplicates;
+  size_t i;
+
+  if (!dups)
+    return;
+  session->duplicates = NULL;
+
+  if (dups->skipped > 0)
+    msgprintf (session, stdout, "Skipped %lu duplicate fonts\n",
+        dups->skipped);
+
+  for (i = 0; i < dups->slots; i++)
+    free (dups->table[i].filename);
+  free (dups->table);
+  free (dups);
+}
@@ -0,0 +1,136 @@
+/* extbench.c
+ * Microbenchmark of font extension classification for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the packed extension lookup in fonttype.c with the chain of
+ * CompareString calls checkFile used to make. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <strings.h>
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Only this benchmark still uses CompareString, so the stand in for it
+ * lives here */
+#ifndef _WIN32
+#define LOCALE_USER_DEFAULT 0
+#define NORM_IGNORECASE 1
+#define CSTR_LESS_THAN 1
+#define CSTR_EQUAL 2
+#define CSTR_GREATER_THAN 3
+
+static int CompareString (unsigned long locale, unsigned long flags,
+    const char *string1, int count1, const char *string2, int count2) {
+  int cmp;
+
+  (void) locale;
+  (void) count1;
+  (void) count2;
+
+  if (flags & NORM_IGNORECASE)
+    cmp = strcasecmp (string1, string2);
+  else
+    cmp = strcmp (string1, string2);
+
+  if (cmp < 0)
+    return CSTR_LESS_THAN;
+  else if (cmp > 0)
+    return CSTR_GREATER_THAN;
+  return CSTR_EQUAL;
+}
+#endif
+
+const char *extensions[] = {
+  "ttf", "TTF", "otf", "Otf", "ttc", "fon", "fnt", "fot", "mmm",
+  "pfm", "PFB", "txt", "afm", "pdf", "t", "", "ttff", "tt1"
+};
+
+#define NEXTENSIONS (sizeof (extensions) / sizeof (extensions[0]))
+
+regfont_font_type compareStringChain (const char *ext) {
+  if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "pfm", -1) == CSTR_EQUAL)
+    return REGFONT_PFM;
+  if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "pfb", -1) == CSTR_EQUAL)
+    return REGFONT_PFB;
+  if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "fon", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "fnt", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "ttf", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "ttc", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "fot", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "otf", -1) != CSTR_EQUAL &&
+      CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+        ext, -1, "mmm", -1) != CSTR_EQUAL)
+    return REGFONT_NOT_FONT;
+  return REGFONT_ANY;
+}
+
+double timeClassifier (regfont_font_type (*classify) (const char *),
+    unsigned long iterations, unsigned long *checksum) {
+  unsigned long long start;
+  unsigned long i, sum = 0;
+
+  start = regfont_now_us ();
+  for (i = 0; i < iterations; i++)
+    sum += (unsigned long) classify (extensions[i % NEXTENSIONS]);
+  *checksum = sum;
+
+  return (regfont_now_us () - start) * 1000.0 / iterations;
+}
+
+int main (int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul (argv[1], NULL, 10) : 10000000;
+  unsigned long chain_sum, table_sum;
+  double chain_ns, table_ns;
+  size_t i;
+
+  for (i = 0; i < NEXTENSIONS; i++) {
+    if (compareStringChain (extensions[i]) !=
+        classifyExtension (extensions[i])) {
+      fprintf (stderr, "ERROR: Classifiers disagree on \"%s\"\n",
+          extensions[i]);
+      return 1;
+    }
+  }
+
+  chain_ns = timeClassifier (compareStringChain, iterations, &chain_sum);
+  table_ns = timeClassifier (classifyExtension, iterations, &table_sum);
+
+  printf ("{\"benchmark\": \"extension\", \"iterations\": %lu, "
+      "\"compare_string_ns\": %.2f, \"table_ns\": %.2f, "
+      "\"speedup\": %.1f, \"checksum\": %lu}\n", iterations, chain_ns,
+      table_ns, table_ns > 0 ? chain_ns / table_ns : 0.0,
+      chain_sum ^ table_sum);
+
+  return 0;
+}
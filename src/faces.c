@@ -0,0 +1,235 @@
+/* faces.c
+ * Face enumeration for TrueType, OpenType and collection fonts.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Mapping a file reads none of it, so a face is looked at only when it
+ * is asked about, and then only the pages holding its offset table, its
+ * table directory and, for its names, its name table are read.  A
+ * collection of hundreds of megabytes costs a few pages a face. */
+
+/* Map path and read the collection header, if it has one.  Returns -1
+ * if the file cannot be read.  A damaged collection header leaves no
+ * faces and says what is wrong in problem. */
+int openFaces (regfont_faces *faces, const char *path) {
+  const unsigned char *data;
+  unsigned long version;
+
+  faces->nfaces = 0;
+  faces->problem = NULL;
+  if (regfont_map_open (&faces->map, path) != 0)
+    return -1;
+  data = faces->map.data;
+
+  faces->format = sniffFontHeader (data, faces->map.size, NULL);
+  switch (faces->format) {
+  case REGFONT_FORMAT_TRUETYPE:
+  case REGFONT_FORMAT_OPENTYPE:
+    faces->nfaces = 1;
+    break;
+  case REGFONT_FORMAT_COLLECTION:
+    if (faces->map.size < 12) {
+      faces->problem = "Collection header is truncated";
+      break;
+    }
+    version = readBE32 (data + 4);
+    faces->nfaces = readBE32 (data + 8);
+    if (version != 0x00010000UL && version != 0x00020000UL)
+      faces->problem = "Unknown collection version";
+    else if (faces->nfaces == 0)
+      faces->problem = "Collection holds no faces";
+    else if ((faces->map.size - 12) / 4 < faces->nfaces)
+      faces->problem = "Collection header is truncated";
+    if (faces->problem)
+      faces->nfaces = 0;
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+void closeFaces (regfont_faces *faces) {
+  regfont_map_close (&faces->map);
+}
+
+static unsigned long faceOffset (const regfont_faces *faces,
+    unsigned long face) {
+  if (faces->format != REGFONT_FORMAT_COLLECTION)
+    return 0;
+  return readBE32 (faces->map.data + 12 + 4 * face);
+}
+
+/* Check that the offset table and table directory of a face lie in the
+ * file and that every table it lists does too.  No table is read.
+ * Returns NULL if the face is sound, and what is wrong otherwise. */
+const char *faceProblem (const regfont_faces *faces, unsigned long face,
+    unsigned int *ntables) {
+  const unsigned char *data = faces->map.data;
+  size_t size = faces->map.size, offset = faceOffset (faces, face);
+  unsigned long tag;
+  unsigned int n, i;
+
+  *ntables = 0;
+  if (offset > size || size - offset < 12)
+    return "Offset table lies outside the file";
+  tag = readBE32 (data + offset);
+  if (tag != 0x00010000UL && tag != 0x74727565UL && tag != 0x4F54544FUL)
+    return "Not a TrueType or OpenType face";
+  n = readBE16 (data + offset + 4);
+  if (n == 0)
+    return "Face has no tables";
+  if ((size - offset - 12) / 16 < n)
+    return "Table directory is truncated";
+
+  for (i = 0; i < n; i++) {
+    const unsigned char *record = data + offset + 12 + 16 * (size_t) i;
+    size_t start = readBE32 (record + 8), length = readBE32 (record + 12);
+
+    if (start > size || length > size - start)
+      return "A table runs past the end of the file";
+  }
+  *ntables = n;
+  return NULL;
+}
+
+int faceNames (const regfont_faces *faces, unsigned long face, char *family,
+    char *style) {
+  return sfntFaceNames (faces->map.data, faces->map.size,
+      faceOffset (faces, face), family, style);
+}
+
+/* Validate the header and every face of a collection, for --strict */
+int checkCollection (regfont_session *session, const char *fullfilename,
+    regfont_view name) {
+  regfont_faces faces;
+  const char *problem;
+  unsigned long i;
+  unsigned int ntables;
+
+  if (openFaces (&faces, fullfilename) != 0) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) name.len, name.data);
+    msgprintf (session, stderr, "ERROR:     File is empty or cannot be read\n");
+    return REGFONT_CORRUPT_FONT;
+  }
+
+  problem = faces.problem;
+  for (i = 0; !problem && i < faces.nfaces; i++)
+    problem = faceProblem (&faces, i, &ntables);
+  dbtrace ("    Collection holds %lu faces", faces.nfaces);
+  closeFaces (&faces);
+
+  if (problem) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) name.len, name.data);
+    if (i > 0)
+      msgprintf (session, stderr, "ERROR:     Face %lu: %s\n", i - 1, problem);
+    else
+      msgprintf (session, stderr, "ERROR:     %s\n", problem);
+    return REGFONT_CORRUPT_FONT;
+  }
+  return REGFONT_OK;
+}
+
+/* Print one font for --info.  Returns non-zero if it is damaged. */
+static int printFaces (const char *spec) {
+  char family[REGFONT_NAME_SIZE], style[REGFONT_NAME_SIZE];
+  const char *problem;
+  regfont_faces faces;
+  unsigned long i;
+  unsigned int ntables;
+  char *path;
+  int damaged = 0;
+
+  /* A PostScript font is described by its .pfm */
+  path = strdup (spec);
+  if (!path) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return -1;
+  }
+  if (strchr (path, '|'))
+    *strchr (path, '|') = '\0';
+
+  if (openFaces (&faces, path) != 0) {
+    fprintf (stderr, "ERROR: Could not read font: %s\n", spec);
+    free (path);
+    return -1;
+  }
+  free (path);
+
+  if (faces.format == REGFONT_FORMAT_PFM) {
+    printf ("%s: %s\n", spec, formatName (faces.format));
+    if (pfmFaceNames (faces.map.data, faces.map.size, family, style) == 0)
+      printf ("    0: %s %s\n", family, style);
+  } else if (faces.problem) {
+    fprintf (stderr, "ERROR: Font file is corrupt: %s\n", spec);
+    fprintf (stderr, "ERROR:     %s\n", faces.problem);
+    damaged = -1;
+  } else if (faces.nfaces == 0) {
+    printf ("%s: %s\n", spec, formatName (faces.format));
+  } else {
+    printf ("%s: %s, %lu face%s\n", spec, formatName (faces.format),
+        faces.nfaces, faces.nfaces == 1 ? "" : "s");
+    for (i = 0; i < faces.nfaces; i++) {
+      problem = faceProblem (&faces, i, &ntables);
+      if (problem) {
+        fprintf (stderr, "ERROR: Font file is corrupt: %s\n", spec);
+        fprintf (stderr, "ERROR:     Face %lu: %s\n", i, problem);
+        damaged = -1;
+      } else if (faceNames (&faces, i, family, style) == 0) {
+        printf ("    %lu: %s %s, %u tables\n", i, family, style, ntables);
+      } else {
+        printf ("    %lu: no name, %u tables\n", i, ntables);
+      }
+    }
+  }
+
+  closeFaces (&faces);
+  return damaged;
+}
+
+/* --info: describe each font without registering it */
+int printFontInfo (regfont_source *fonts) {
+  unsigned long long start = regfont_now_ns ();
+  unsigned long files = 0, failed = 0;
+  char *spec;
+
+  while ((spec = fonts->next (fonts)) != NULL) {
+    files++;
+    if (printFaces (spec) != 0)
+      failed++;
+  }
+
+  printf ("Inspected %lu fonts in %.3f ms", files,
+      (regfont_now_ns () - start) / 1e6);
+  if (failed > 0)
+    printf (", %lu damaged or unreadable", failed);
+  printf ("\n");
+  return failed > 0 ? -1 : 0;
+}
@@ -0,0 +1,943 @@
+/* family.c
+ * Font family index for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* The index file is a header, the offsets of the root directories, a
+ * table of indexed files sorted by path and a table of faces sorted by
+ * case folded family name, followed by a pool of the strings they all
+ * point into.  A lookup maps the file and binary searches the faces;
+ * an update walks the roots again but only parses files whose size or
+ * modification time changed. */
+#define REGFONT_INDEX_MAGIC "RFINDEX1"
+#define REGFONT_INDEX_VERSION 1
+
+typedef struct {
+  char magic[8];
+  unsigned int version;
+  unsigned int nroots;
+  unsigned int nfiles;
+  unsigned int nfaces;
+  unsigned int poolsize;
+  unsigned int reserved;
+} index_header;
+
+/* spec is what gets registered: the path itself, or "pfm|pfb" */
+typedef struct {
+  unsigned long long size;
+  long long mtime;
+  unsigned int path;
+  unsigned int spec;
+} index_file;
+
+typedef struct {
+  unsigned int family;
+  unsigned int style;
+  unsigned int file;
+  unsigned int face;
+} index_face;
+
+typedef struct {
+  regfont_map map;
+  const index_header *header;
+  const unsigned int *roots;
+  const index_file *files;
+  const index_face *faces;
+  const char *pool;
+} regfont_index;
+
+static size_t alignIndex (size_t size) {
+  return (size + 7) & ~(size_t) 7;
+}
+
+/* Returns -1 if there is no index at path, and -2 (after saying so) if
+ * there is one but it is damaged */
+static int openIndex (regfont_index *index, const char *path) {
+  const index_header *header;
+  size_t rootsize, size;
+  unsigned int i;
+
+  memset (index, 0, sizeof (regfont_index));
+  if (regfont_map_open (&index->map, path) != 0)
+    return -1;
+
+  header = (const index_header *) index->map.data;
+  if (index->map.size < sizeof (index_header) ||
+      memcmp (header->magic, REGFONT_INDEX_MAGIC, 8) != 0 ||
+      header->version != REGFONT_INDEX_VERSION)
+    goto damaged;
+
+  rootsize = alignIndex ((size_t) header->nroots * sizeof (unsigned int));
+  size = sizeof (index_header) + rootsize +
+    (size_t) header->nfiles * sizeof (index_file) +
+    (size_t) header->nfaces * sizeof (index_face) + header->poolsize;
+  if (size != index->map.size || header->poolsize == 0)
+    goto damaged;
+
+  index->header = header;
+  index->roots = (const unsigned int *) (header + 1);
+  index->files = (const index_file *) ((const char *) index->roots +
+      rootsize);
+  index->faces = (const index_face *) (index->files + header->nfiles);
+  index->pool = (const char *) (index->faces + header->nfaces);
+
+  /* Every string must lie inside the pool, which ends in a NUL */
+  if (index->pool[header->poolsize - 1] != '\0')
+    goto damaged;
+  for (i = 0; i < header->nroots; i++) {
+    if (index->roots[i] >= header->poolsize)
+      goto damaged;
+  }
+  for (i = 0; i < header->nfiles; i++) {
+    if (index->files[i].path >= header->poolsize ||
+        index->files[i].spec >= header->poolsize)
+      goto damaged;
+  }
+  for (i = 0; i < header->nfaces; i++) {
+    if (index->faces[i].family >= header->poolsize ||
+        index->faces[i].style >= header->poolsize ||
+        index->faces[i].file >= header->nfiles)
+      goto damaged;
+  }
+  return 0;
+
+damaged:
+  fprintf (stderr, "ERROR: Font index %s is damaged\n", path);
+  regfont_map_close (&index->map);
+  index->header = NULL;
+  return -2;
+}
+
+static void closeIndex (regfont_index *index) {
+  regfont_map_close (&index->map);
+  index->header = NULL;
+}
+
+/* Case insensitive for ASCII letters only, so that the order does not
+ * depend on the locale */
+static int foldCompare (const char *a, const char *b) {
+  for ( ; ; a++, b++) {
+    unsigned int ca = (unsigned char) *a, cb = (unsigned char) *b;
+    if (ca >= 'A' && ca <= 'Z')
+      ca |= 0x20;
+    if (cb >= 'A' && cb <= 'Z')
+      cb |= 0x20;
+    if (ca != cb || ca == '\0')
+      return (int) ca - (int) cb;
+  }
+}
+
+/* Name decoding */
+
+static size_t putUTF8 (char *out, size_t pos, size_t size, unsigned long c) {
+  unsigned char buf[4];
+  size_t len, i;
+
+  if (c < 0x80) {
+    buf[0] = (unsigned char) c;
+    len = 1;
+  } else if (c < 0x800) {
+    buf[0] = (unsigned char) (0xC0 | (c >> 6));
+    buf[1] = (unsigned char) (0x80 | (c & 0x3F));
+    len = 2;
+  } else if (c < 0x10000) {
+    buf[0] = (unsigned char) (0xE0 | (c >> 12));
+    buf[1] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+    buf[2] = (unsigned char) (0x80 | (c & 0x3F));
+    len = 3;
+  } else {
+    buf[0] = (unsigned char) (0xF0 | (c >> 18));
+    buf[1] = (unsigned char) (0x80 | ((c >> 12) & 0x3F));
+    buf[2] = (unsigned char) (0x80 | ((c >> 6) & 0x3F));
+    buf[3] = (unsigned char) (0x80 | (c & 0x3F));
+    len = 4;
+  }
+
+  if (pos + len >= size)
+    return pos;
+  for (i = 0; i < len; i++)
+    out[pos + i] = (char) buf[i];
+  return pos + len;
+}
+
+static void decodeUTF16BE (const unsigned char *p, size_t len, char *out,
+    size_t size) {
+  size_t i, pos = 0;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    unsigned long c = readBE16 (p + i);
+
+    if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+      unsigned long low = readBE16 (p + i + 2);
+      if (low >= 0xDC00 && low < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        i += 2;
+      }
+    }
+    if (c == 0)
+      break;
+    pos = putUTF8 (out, pos, size, c);
+  }
+  out[pos] = '\0';
+}
+
+/* Mac Roman and Windows ANSI names are taken as Latin-1, which is right
+ * for the ASCII that nearly all family names are written in */
+static void decodeLatin1 (const unsigned char *p, size_t len, char *out,
+    size_t size) {
+  size_t i, pos = 0;
+
+  for (i = 0; i < len && p[i] != '\0'; i++)
+    pos = putUTF8 (out, pos, size, p[i]);
+  out[pos] = '\0';
+}
+
+/* Prefer Windows US English, then any Windows or Unicode name, then a
+ * Macintosh Roman one */
+static int nameScore (unsigned int platform, unsigned int encoding,
+    unsigned int language) {
+  if (platform == 3 && (encoding == 1 || encoding == 10 || encoding == 0))
+    return language == 0x409 ? 4 : 3;
+  if (platform == 0)
+    return 2;
+  if (platform == 1 && encoding == 0)
+    return language == 0 ? 1 : 0;
+  return 0;
+}
+
+/* Read the family and style of the sfnt face whose offset table is at
+ * offset.  The typographic family and subfamily (name IDs 16 and 17)
+ * are preferred, so that every weight of a family shares a name. */
+int sfntFaceNames (const unsigned char *data, size_t size,
+    size_t offset, char *family, char *style) {
+  static const unsigned int ids[4] = {1, 2, 16, 17};
+  const unsigned char *best[4] = {NULL, NULL, NULL, NULL};
+  size_t bestlen[4] = {0, 0, 0, 0};
+  int bestscore[4] = {0, 0, 0, 0}, unicode[4] = {0, 0, 0, 0};
+  size_t name = 0, namelen = 0, strings;
+  unsigned int ntables, count, i, j;
+
+  if (offset > size || size - offset < 12)
+    return -1;
+  ntables = readBE16 (data + offset + 4);
+  if ((size - offset - 12) / 16 < ntables)
+    return -1;
+
+  for (i = 0; i < ntables; i++) {
+    const unsigned char *record = data + offset + 12 + 16 * (size_t) i;
+    if (readBE32 (record) == 0x6E616D65UL) { /* 'name' */
+      name = readBE32 (record + 8);
+      namelen = readBE32 (record + 12);
+      break;
+    }
+  }
+  if (name == 0 || name > size || namelen > size - name || namelen < 6)
+    return -1;
+
+  count = readBE16 (data + name + 2);
+  strings = name + readBE16 (data + name + 4);
+  if ((namelen - 6) / 12 < count)
+    return -1;
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *record = data + name + 6 + 12 * (size_t) i;
+    unsigned int platform = readBE16 (record);
+    unsigned int encoding = readBE16 (record + 2);
+    unsigned int language = readBE16 (record + 4);
+    unsigned int id = readBE16 (record + 6);
+    size_t len = readBE16 (record + 8);
+    size_t start = strings + readBE16 (record + 10);
+    int score;
+
+    if (start > size || len > size - start)
+      continue;
+    score = nameScore (platform, encoding, language);
+    for (j = 0; j < 4; j++) {
+      if (ids[j] == id && score > bestscore[j]) {
+        best[j] = data + start;
+        bestlen[j] = len;
+        bestscore[j] = score;
+        unicode[j] = platform != 1;
+      }
+    }
+  }
+
+  j = best[2] ? 2 : 0;
+  if (!best[j])
+    return -1;
+  if (unicode[j])
+    decodeUTF16BE (best[j], bestlen[j], family, REGFONT_NAME_SIZE);
+  else
+    decodeLatin1 (best[j], bestlen[j], family, REGFONT_NAME_SIZE);
+
+  j = best[3] ? 3 : 1;
+  if (!best[j])
+    strcpy (style, "Regular");
+  else if (unicode[j])
+    decodeUTF16BE (best[j], bestlen[j], style, REGFONT_NAME_SIZE);
+  else
+    decodeLatin1 (best[j], bestlen[j], style, REGFONT_NAME_SIZE);
+
+  return family[0] ? 0 : -1;
+}
+
+/* PFM files keep the face name at the offset in dfFace, and the style
+ * only as a weight and an italic flag */
+int pfmFaceNames (const unsigned char *data, size_t size, char *family,
+    char *style) {
+  unsigned long face;
+  unsigned int weight;
+  int italic;
+
+  if (size < 0x6D)
+    return -1;
+  italic = data[0x50] != 0;
+  weight = (unsigned int) data[0x53] | ((unsigned int) data[0x54] << 8);
+  face = (unsigned long) data[0x69] | ((unsigned long) data[0x6A] << 8) |
+    ((unsigned long) data[0x6B] << 16) | ((unsigned long) data[0x6C] << 24);
+  if (face >= size)
+    return -1;
+
+  decodeLatin1 (data + face, size - face, family, REGFONT_NAME_SIZE);
+  if (weight >= 600)
+    strcpy (style, italic ? "Bold Italic" : "Bold");
+  else
+    strcpy (style, italic ? "Italic" : "Regular");
+
+  return family[0] ? 0 : -1;
+}
+
+/* Building an index */
+
+typedef struct {
+  char *path;
+  char *spec;
+  unsigned long long size;
+  long long mtime;
+  unsigned int index;
+} build_file;
+
+typedef struct {
+  char *family;
+  char *style;
+  build_file *file;
+  unsigned int face;
+} build_face;
+
+typedef struct {
+  char **roots;
+  unsigned int nroots;
+  build_file **files;
+  size_t nfiles;
+  size_t sizefiles;
+  build_face *faces;
+  size_t nfaces;
+  size_t sizefaces;
+  unsigned long parsed;
+  unsigned long unchanged;
+  unsigned long found;
+  int failed;
+} index_build;
+
+static build_file *addBuildFile (index_build *build, const char *path,
+    const char *spec, const regfont_stat_info *info) {
+  build_file *file;
+
+  if (build->nfiles == build->sizefiles) {
+    size_t size = build->sizefiles ? build->sizefiles * 2 : 1024;
+    build_file **files = realloc (build->files, size * sizeof (build_file *));
+
+    if (!files)
+      goto nomem;
+    build->files = files;
+    build->sizefiles = size;
+  }
+
+  file = malloc (sizeof (build_file));
+  if (!file)
+    goto nomem;
+  file->path = strdup (path);
+  file->spec = strcmp (path, spec) == 0 ? file->path : strdup (spec);
+  if (!file->path || !file->spec) {
+    if (file->spec != file->path)
+      free (file->spec);
+    free (file->path);
+    free (file);
+    goto nomem;
+  }
+  file->size = info->size;
+  file->mtime = info->mtime;
+  build->files[build->nfiles++] = file;
+  return file;
+
+nomem:
+  fprintf (stderr, "ERROR: Out of memory\n");
+  build->failed = 1;
+  return NULL;
+}
+
+static void addBuildFace (index_build *build, build_file *file,
+    const char *family, const char *style, unsigned int face) {
+  build_face *entry;
+
+  if (build->nfaces == build->sizefaces) {
+    size_t size = build->sizefaces ? build->sizefaces * 2 : 1024;
+    build_face *faces = realloc (build->faces, size * sizeof (build_face));
+
+    if (!faces) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      build->failed = 1;
+      return;
+    }
+    build->faces = faces;
+    build->sizefaces = size;
+  }
+
+  entry = &build->faces[build->nfaces];
+  entry->family = strdup (family);
+  entry->style = strdup (style);
+  if (!entry->family || !entry->style) {
+    free (entry->family);
+    free (entry->style);
+    fprintf (stderr, "ERROR: Out of memory\n");
+    build->failed = 1;
+    return;
+  }
+  entry->file = file;
+  entry->face = face;
+  build->nfaces++;
+}
+
+/* Find the .pfb that goes with a .pfm in the same directory */
+static char *pairedPfb (const char *pfm) {
+  static const char *extensions[] = {"pfb", "PFB", "Pfb"};
+  const char *dot = PathFindExtension (pfm);
+  size_t stem = (size_t) (dot - pfm);
+  char *spec = malloc (stem * 2 + 10);
+  regfont_stat_info info;
+  size_t i;
+
+  if (!spec || *dot != '.')
+    goto fail;
+
+  for (i = 0; i < sizeof (extensions) / sizeof (extensions[0]); i++) {
+    char *pfb = spec + stem + 5;
+
+    memcpy (pfb, pfm, stem + 1);
+    strcpy (pfb + stem + 1, extensions[i]);
+    if (regfont_stat (pfb, &info) == 0 && !info.directory) {
+      memcpy (spec, pfm, stem + 4);
+      spec[stem + 4] = '|';
+      memmove (spec + stem + 5, pfb, strlen (pfb) + 1);
+      return spec;
+    }
+  }
+
+fail:
+  free (spec);
+  return NULL;
+}
+
+/* Parse a changed or new file and add whatever faces it has */
+static void parseIndexFile (index_build *build, const char *path,
+    const regfont_stat_info *info) {
+  const char *extension = PathFindExtension (path);
+  char family[REGFONT_NAME_SIZE], style[REGFONT_NAME_SIZE];
+  char *spec = NULL;
+  build_file *file = NULL;
+  regfont_faces faces;
+  unsigned long i;
+  unsigned int ntables;
+
+  if (*extension)
+    extension++;
+  if (openFaces (&faces, path) != 0) {
+    fprintf (stderr, "ERROR: Could not read font: %s\n", path);
+    return;
+  }
+  build->parsed++;
+
+  /* Files without names are indexed too, so they are not read again
+   * while they stay unchanged */
+  if (classifyExtension (extension) == REGFONT_PFM) {
+    spec = pairedPfb (path);
+    if (!spec)
+      dbtrace ("No .pfb found for %s", path);
+    file = addBuildFile (build, path, spec ? spec : path, info);
+    if (file && spec && pfmFaceNames (faces.map.data, faces.map.size,
+          family, style) == 0)
+      addBuildFace (build, file, family, style, 0);
+    free (spec);
+    closeFaces (&faces);
+    return;
+  }
+
+  /* Only sfnt fonts have a name table, and only sound faces are read */
+  file = addBuildFile (build, path, path, info);
+  for (i = 0; file && i < faces.nfaces; i++) {
+    const char *problem = faceProblem (&faces, i, &ntables);
+
+    if (problem)
+      dbtrace ("Skipping face %lu of %s: %s", i, path, problem);
+    else if (faceNames (&faces, i, family, style) == 0)
+      addBuildFace (build, file, family, style, (unsigned int) i);
+    else
+      dbtrace ("No family name found in face %lu of %s", i, path);
+  }
+
+  closeFaces (&faces);
+}
+
+/* Reuse the faces an unchanged file had in the old index */
+static void copyIndexFile (index_build *build, const regfont_index *old,
+    unsigned int fileno, const unsigned int *facelist, unsigned int nfaces) {
+  const index_file *from = &old->files[fileno];
+  regfont_stat_info info;
+  build_file *file;
+  unsigned int i;
+
+  info.size = from->size;
+  info.mtime = from->mtime;
+  file = addBuildFile (build, old->pool + from->path, old->pool + from->spec,
+      &info);
+  if (!file)
+    return;
+
+  for (i = 0; i < nfaces; i++) {
+    const index_face *face = &old->faces[facelist[i]];
+    addBuildFace (build, file, old->pool + face->family,
+        old->pool + face->style, face->face);
+  }
+  build->unchanged++;
+}
+
+static int findIndexFile (const regfont_index *old, const char *path) {
+  unsigned int lo = 0, hi = old->header ? old->header->nfiles : 0;
+
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp (old->pool + old->files[mid].path, path);
+
+    if (cmp == 0)
+      return (int) mid;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+static int compareBuildFiles (const void *a, const void *b) {
+  return strcmp ((*(build_file * const *) a)->path,
+      (*(build_file * const *) b)->path);
+}
+
+static int compareBuildFaces (const void *a, const void *b) {
+  const build_face *fa = a, *fb = b;
+  int cmp = foldCompare (fa->family, fb->family);
+
+  if (cmp == 0)
+    cmp = foldCompare (fa->style, fb->style);
+  if (cmp == 0)
+    cmp = strcmp (fa->file->path, fb->file->path);
+  return cmp;
+}
+
+static int writeIndex (index_build *build, const char *path) {
+  index_header header;
+  index_file *files = NULL;
+  index_face *faces = NULL;
+  unsigned int *roots = NULL;
+  char *pool = NULL, *tmppath = NULL;
+  size_t poolsize = 1, used = 1, rootsize, i, len;
+  FILE *file = NULL;
+  int retval = -1;
+
+  qsort (build->files, build->nfiles, sizeof (build_file *),
+      compareBuildFiles);
+  for (i = 0; i < build->nfiles; i++)
+    build->files[i]->index = (unsigned int) i;
+  qsort (build->faces, build->nfaces, sizeof (build_face), compareBuildFaces);
+
+  for (i = 0; i < build->nroots; i++)
+    poolsize += strlen (build->roots[i]) + 1;
+  for (i = 0; i < build->nfiles; i++) {
+    poolsize += strlen (build->files[i]->path) + 1;
+    if (build->files[i]->spec != build->files[i]->path)
+      poolsize += strlen (build->files[i]->spec) + 1;
+  }
+  for (i = 0; i < build->nfaces; i++)
+    poolsize += strlen (build->faces[i].family) +
+      strlen (build->faces[i].style) + 2;
+  if (poolsize > 0xFFFFFFFFUL) {
+    fprintf (stderr, "ERROR: Font index is too large\n");
+    return -1;
+  }
+
+  rootsize = alignIndex (build->nroots * sizeof (unsigned int));
+  roots = calloc (1, rootsize + 1);
+  files = calloc (build->nfiles + 1, sizeof (index_file));
+  faces = calloc (build->nfaces + 1, sizeof (index_face));
+  pool = calloc (1, poolsize);
+  len = strlen (path);
+  tmppath = malloc (len + 5);
+  if (!roots || !files || !faces || !pool || !tmppath) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    goto cleanup;
+  }
+
+#define POOL_STRING(s) \
+  (len = strlen (s) + 1, memcpy (pool + used, (s), len), used += len, \
+   (unsigned int) (used - len))
+
+  for (i = 0; i < build->nroots; i++)
+    roots[i] = POOL_STRING (build->roots[i]);
+  for (i = 0; i < build->nfiles; i++) {
+    build_file *from = build->files[i];
+    files[i].size = from->size;
+    files[i].mtime = from->mtime;
+    files[i].path = POOL_STRING (from->path);
+    files[i].spec = from->spec == from->path ? files[i].path :
+      POOL_STRING (from->spec);
+  }
+  for (i = 0; i < build->nfaces; i++) {
+    faces[i].family = POOL_STRING (build->faces[i].family);
+    faces[i].style = POOL_STRING (build->faces[i].style);
+    faces[i].file = build->faces[i].file->index;
+    faces[i].face = build->faces[i].face;
+  }
+
+#undef POOL_STRING
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, REGFONT_INDEX_MAGIC, 8);
+  header.version = REGFONT_INDEX_VERSION;
+  header.nroots = build->nroots;
+  header.nfiles = (unsigned int) build->nfiles;
+  header.nfaces = (unsigned int) build->nfaces;
+  header.poolsize = (unsigned int) poolsize;
+
+  len = strlen (path);
+  memcpy (tmppath, path, len);
+  memcpy (tmppath + len, ".tmp", 5);
+
+  file = fopen (tmppath, "wb");
+  if (!file ||
+      fwrite (&header, sizeof (header), 1, file) != 1 ||
+      (rootsize && fwrite (roots, rootsize, 1, file) != 1) ||
+      fwrite (files, sizeof (index_file), build->nfiles, file) !=
+      build->nfiles ||
+      fwrite (faces, sizeof (index_face), build->nfaces, file) !=
+      build->nfaces ||
+      fwrite (pool, 1, poolsize, file) != poolsize) {
+    fprintf (stderr, "ERROR: Could not write font index %s\n", tmppath);
+    if (file)
+      fclose (file);
+    remove (tmppath);
+    goto cleanup;
+  }
+  if (fclose (file) != 0 || regfont_replace_file (tmppath, path) != 0) {
+    fprintf (stderr, "ERROR: Could not replace font index %s\n", path);
+    remove (tmppath);
+    goto cleanup;
+  }
+  retval = 0;
+
+cleanup:
+  free (tmppath);
+  free (pool);
+  free (faces);
+  free (files);
+  free (roots);
+  return retval;
+}
+
+static void freeBuild (index_build *build) {
+  size_t i;
+
+  for (i = 0; i < build->nroots; i++)
+    free (build->roots[i]);
+  free (build->roots);
+  for (i = 0; i < build->nfiles; i++) {
+    if (build->files[i]->spec != build->files[i]->path)
+      free (build->files[i]->spec);
+    free (build->files[i]->path);
+    free (build->files[i]);
+  }
+  free (build->files);
+  for (i = 0; i < build->nfaces; i++) {
+    free (build->faces[i].family);
+    free (build->faces[i].style);
+  }
+  free (build->faces);
+}
+
+static int addRoot (index_build *build, const char *dir) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  regfont_view fullpath;
+  char **roots;
+  unsigned int i;
+  int retval = -1;
+
+  if (fullPath (&regfont_path_arena, viewOf (dir), &fullpath) !=
+      REGFONT_OK) {
+    fprintf (stderr, "ERROR: Could not get full path for directory: %s\n",
+        dir);
+    goto cleanup;
+  }
+  retval = 0;
+  for (i = 0; i < build->nroots; i++) {
+    if (strcmp (build->roots[i], fullpath.data) == 0)
+      goto cleanup;
+  }
+
+  roots = realloc (build->roots, (build->nroots + 1) * sizeof (char *));
+  if (!roots || !(roots[build->nroots] = strdup (fullpath.data))) {
+    if (roots)
+      build->roots = roots;
+    fprintf (stderr, "ERROR: Out of memory\n");
+    retval = -1;
+    goto cleanup;
+  }
+  build->roots = roots;
+  build->nroots++;
+
+cleanup:
+  arenaRelease (&regfont_path_arena, mark);
+  return retval;
+}
+
+/* Bring the index at path up to date with its root directories, adding
+ * dirs to them.  Files are walked in parallel; only new and changed
+ * ones are read. */
+int updateIndex (const char *path, int n, char **dirs, int threads) {
+  regfont_index old;
+  index_build build;
+  regfont_source *walk;
+  unsigned int *facelists = NULL, *firstface = NULL;
+  unsigned long long start = regfont_now_us ();
+  unsigned long dropped = 0;
+  char *filename;
+  unsigned int i;
+  int retval = -1;
+
+  memset (&build, 0, sizeof (build));
+  if (openIndex (&old, path) == -1)
+    dbprintf ("Creating font index %s", path);
+  else if (!old.header)
+    goto cleanup;
+
+  for (i = 0; old.header && i < old.header->nroots; i++) {
+    if (addRoot (&build, old.pool + old.roots[i]) != 0)
+      goto cleanup;
+  }
+  for (i = 0; i < (unsigned int) n; i++) {
+    if (addRoot (&build, dirs[i]) != 0)
+      goto cleanup;
+  }
+  if (build.nroots == 0) {
+    fprintf (stderr, "ERROR: No directories to index\n");
+    goto cleanup;
+  }
+
+  /* Group the old faces by file, so an unchanged file can take its
+   * faces with it */
+  if (old.header) {
+    unsigned int nfiles = old.header->nfiles, nfaces = old.header->nfaces;
+
+    firstface = calloc ((size_t) nfiles + 1, sizeof (unsigned int));
+    facelists = calloc ((size_t) nfaces + 1, sizeof (unsigned int));
+    if (!firstface || !facelists) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      goto cleanup;
+    }
+    for (i = 0; i < nfaces; i++)
+      firstface[old.faces[i].file + 1]++;
+    for (i = 0; i < nfiles; i++)
+      firstface[i + 1] += firstface[i];
+    for (i = 0; i < nfaces; i++)
+      facelists[firstface[old.faces[i].file]++] = i;
+    for (i = nfiles; i > 0; i--)
+      firstface[i] = firstface[i - 1];
+    firstface[0] = 0;
+  }
+
+  walk = walkSource ((int) build.nroots, build.roots, threads,
+      REGFONT_WALK_PFM);
+  if (!walk)
+    goto cleanup;
+
+  while (!build.failed && (filename = walk->next (walk)) != NULL) {
+    regfont_stat_info info;
+    int fileno;
+
+    if (regfont_stat (filename, &info) != 0)
+      continue;
+    fileno = findIndexFile (&old, filename);
+    if (fileno >= 0)
+      build.found++;
+    if (fileno >= 0 && old.files[fileno].size == info.size &&
+        old.files[fileno].mtime == info.mtime)
+      copyIndexFile (&build, &old, (unsigned int) fileno,
+          facelists + firstface[fileno],
+          firstface[fileno + 1] - firstface[fileno]);
+    else
+      parseIndexFile (&build, filename, &info);
+  }
+  closeSource (walk);
+
+  if (build.failed)
+    goto cleanup;
+  if (old.header)
+    dropped = old.header->nfiles - build.found;
+
+  /* The old map has to go before the file can be replaced on Windows */
+  closeIndex (&old);
+  if (writeIndex (&build, path) != 0)
+    goto cleanup;
+
+  printf ("Font index %s: %lu files, %lu faces (%lu read, %lu unchanged, "
+      "%lu gone) in %.1f ms\n", path, (unsigned long) build.nfiles,
+      (unsigned long) build.nfaces, build.parsed, build.unchanged,
+      dropped, (regfont_now_us () - start) / 1000.0);
+  retval = 0;
+
+cleanup:
+  closeIndex (&old);
+  free (facelists);
+  free (firstface);
+  freeBuild (&build);
+  return retval;
+}
+
+/* Fonts of one family, looked up in an index */
+
+typedef struct {
+  regfont_index index;
+  unsigned int *files;
+  unsigned int nfiles;
+  unsigned int i;
+} family_state;
+
+static char *familyNext (regfont_source *source) {
+  family_state *state = source->data;
+
+  if (state->i >= state->nfiles)
+    return NULL;
+  return (char *) state->index.pool +
+    state->index.files[state->files[state->i++]].spec;
+}
+
+static void freeFamily (family_state *state) {
+  closeIndex (&state->index);
+  free (state->files);
+  free (state);
+}
+
+static void familyClose (regfont_source *source) {
+  freeFamily (source->data);
+}
+
+static int compareFileNumbers (const void *a, const void *b) {
+  unsigned int fa = *(const unsigned int *) a, fb = *(const unsigned int *) b;
+
+  return fa < fb ? -1 : fa > fb;
+}
+
+regfont_source *familySource (const char *path, const char *family) {
+  family_state *state = calloc (1, sizeof (family_state));
+  unsigned long long start = regfont_now_us ();
+  unsigned int lo, hi, first, i, n = 0;
+  regfont_source *source;
+
+  if (!state) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  if (openIndex (&state->index, path) == -1) {
+    fprintf (stderr, "ERROR: Could not open font index %s\n", path);
+    free (state);
+    return NULL;
+  } else if (!state->index.header) {
+    free (state);
+    return NULL;
+  }
+
+  lo = 0;
+  hi = state->index.header->nfaces;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (foldCompare (state->index.pool + state->index.faces[mid].family,
+          family) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  first = lo;
+  while (hi < state->index.header->nfaces &&
+      foldCompare (state->index.pool + state->index.faces[hi].family,
+        family) == 0)
+    hi++;
+
+  if (hi == first) {
+    fprintf (stderr, "ERROR: No fonts of family %s in font index %s\n",
+        family, path);
+    freeFamily (state);
+    return NULL;
+  }
+
+  /* A collection can hold several faces of one family */
+  state->files = malloc ((hi - first) * sizeof (unsigned int));
+  if (!state->files) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    freeFamily (state);
+    return NULL;
+  }
+  for (i = first; i < hi; i++) {
+    dbtrace ("Family %s: %s %s (face %u)", family,
+        state->index.pool + state->index.faces[i].family,
+        state->index.pool + state->index.faces[i].style,
+        state->index.faces[i].face);
+    state->files[n++] = state->index.faces[i].file;
+  }
+  qsort (state->files, n, sizeof (unsigned int), compareFileNumbers);
+  for (i = 0; i < n; i++) {
+    if (state->nfiles == 0 ||
+        state->files[state->nfiles - 1] != state->files[i])
+      state->files[state->nfiles++] = state->files[i];
+  }
+  dbprintf ("Found %u faces in %u files of family %s in %.3f ms", hi - first,
+      state->nfiles, family, (regfont_now_us () - start) / 1000.0);
+
+  source = newSource (familyNext, familyClose, state);
+  if (!source)
+    freeFamily (state);
+  return source;
+}
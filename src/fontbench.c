@@ -0,0 +1,706 @@
+/* fontbench.c
+ * Font checking and registration benchmarks for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Times the sfnt checksum kernels, then generates a synthetic font
+ * corpus of each requested size and times checkFile,
+ * checkPostScriptFile, a directory walk and the complete add and remove
+ * pipeline against the simulated font table.  Each result is
+ * printed as a line of JSON, so runs can be saved and compared across
+ * commits. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Microbenchmarks repeat a pass over the corpus for at least this long */
+#define BENCH_MIN_US 200000ULL
+
+/* The checksum kernels are timed over a buffer this big */
+#define BENCH_CHECKSUM_BYTES (16UL << 20)
+
+/* Deep paths go this many directories down */
+#define BENCH_MAX_DEPTH 24
+
+/* One font in twenty of each kind */
+enum BENCH_KINDS {
+  BENCH_TTF = 0,
+  BENCH_OTF = 9,
+  BENCH_TTC = 12,
+  BENCH_PAIR = 13,
+  BENCH_MISNAMED = 16,
+  BENCH_NOT_FONT = 17,
+  BENCH_UPPER = 18,
+  BENCH_DEEP = 19,
+  BENCH_KIND_COUNT = 20
+};
+
+typedef struct {
+  char *root;
+  char **specs;
+  size_t nspecs;
+  char **singles;
+  size_t nsingles;
+  char **pairs;
+  size_t npairs;
+  char **dirs;
+  size_t ndirs;
+  size_t nfiles;
+} bench_corpus;
+
+/* With --cold, the add and remove runs start from an empty page cache,
+ * as on a freshly mounted share */
+int bench_cold = 0;
+
+/* One session for every benchmark, so that removing finds the fonts
+ * that adding registered.  Each benchmark sets the options it needs. */
+regfont_session *bench_session = NULL;
+
+const char *bench_styles[] = {"Regular", "Bold", "Italic", "Bold Italic"};
+
+void putBE16 (unsigned char *p, unsigned int v) {
+  p[0] = (unsigned char) (v >> 8);
+  p[1] = (unsigned char) v;
+}
+
+void putBE32 (unsigned char *p, unsigned long v) {
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+void putLE16 (unsigned char *p, unsigned int v) {
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char) (v >> 8);
+}
+
+void putLE32 (unsigned char *p, unsigned long v) {
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char) (v >> 8);
+  p[2] = (unsigned char) (v >> 16);
+  p[3] = (unsigned char) (v >> 24);
+}
+
+unsigned long tableChecksum (const unsigned char *p, size_t len) {
+  unsigned long sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i += 4)
+    sum = (sum + readBE32 (p + i)) & 0xFFFFFFFFUL;
+  return sum;
+}
+
+/* Write a minimal sfnt font at out, with a head table and a name table
+ * holding family and style in UTF-16BE.  Table offsets count from base,
+ * the start of the file, as a collection needs.  Returns its length,
+ * a multiple of four. */
+size_t buildSfnt (unsigned char *out, size_t base, unsigned long version,
+    const char *family, const char *style) {
+  unsigned char *head = out + 44, *name = out + 44 + 56;
+  size_t flen = strlen (family), slen = strlen (style), namelen, i;
+  unsigned long sum;
+
+  memset (out, 0, 44 + 56);
+  putBE32 (out, version);
+  putBE16 (out + 4, 2);
+  putBE16 (out + 6, 32);
+  putBE16 (out + 8, 1);
+  putBE16 (out + 10, 0);
+
+  putBE32 (head, 0x00010000UL);
+  putBE32 (head + 4, 0x00010000UL);
+  putBE32 (head + 12, 0x5F0F3CF5UL);
+  putBE16 (head + 18, 1000);
+
+  namelen = 6 + 2 * 12 + 2 * (flen + slen);
+  memset (name, 0, (namelen + 3) & ~(size_t) 3);
+  putBE16 (name + 2, 2);
+  putBE16 (name + 4, 6 + 2 * 12);
+  for (i = 0; i < 2; i++) {
+    unsigned char *record = name + 6 + i * 12;
+
+    putBE16 (record, 3);
+    putBE16 (record + 2, 1);
+    putBE16 (record + 4, 0x409);
+    putBE16 (record + 6, (unsigned int) i + 1);
+    putBE16 (record + 8, (unsigned int) (2 * (i ? slen : flen)));
+    putBE16 (record + 10, (unsigned int) (i ? 2 * flen : 0));
+  }
+  for (i = 0; i < flen + slen; i++)
+    putBE16 (name + 30 + 2 * i, (unsigned char)
+        (i < flen ? family[i] : style[i - flen]));
+
+  memcpy (out + 12, "head", 4);
+  putBE32 (out + 16, tableChecksum (head, 56));
+  putBE32 (out + 20, (unsigned long) (base + 44));
+  putBE32 (out + 24, 54);
+  memcpy (out + 28, "name", 4);
+  putBE32 (out + 32, tableChecksum (name, (namelen + 3) & ~(size_t) 3));
+  putBE32 (out + 36, (unsigned long) (base + 44 + 56));
+  putBE32 (out + 40, (unsigned long) namelen);
+
+  sum = tableChecksum (out, 44 + 56 + ((namelen + 3) & ~(size_t) 3));
+  putBE32 (head + 8, (0xB1B0AFBAUL - sum) & 0xFFFFFFFFUL);
+  return 44 + 56 + ((namelen + 3) & ~(size_t) 3);
+}
+
+size_t buildCollection (unsigned char *out, const char *family) {
+  size_t len = 20;
+
+  memcpy (out, "ttcf", 4);
+  putBE32 (out + 4, 0x00010000UL);
+  putBE32 (out + 8, 2);
+  putBE32 (out + 12, (unsigned long) len);
+  len += buildSfnt (out + len, len, 0x00010000UL, family, "Regular");
+  putBE32 (out + 16, (unsigned long) len);
+  len += buildSfnt (out + len, len, 0x00010000UL, family, "Bold");
+  return len;
+}
+
+/* The Windows font metrics header, with the face name at 0xC0 */
+size_t buildPfm (unsigned char *out, const char *family, int style) {
+  size_t len = 0xC0 + strlen (family) + 1;
+
+  memset (out, 0, 0xC0);
+  putLE16 (out, 0x0100);
+  putLE32 (out + 2, (unsigned long) len);
+  out[0x50] = (unsigned char) (style & 2 ? 1 : 0);
+  putLE16 (out + 0x53, style & 1 ? 700 : 400);
+  putLE32 (out + 0x69, 0xC0);
+  memcpy (out + 0xC0, family, strlen (family) + 1);
+  return len;
+}
+
+size_t buildPfb (unsigned char *out, const char *family) {
+  int len = sprintf ((char *) out + 6, "%%!PS-AdobeFont-1.0: %s 001.000\n"
+      "/FontName /%s def\ncurrentfile eexec\n", family, family);
+
+  out[0] = 0x80;
+  out[1] = 0x01;
+  putLE32 (out + 2, (unsigned long) len);
+  out[6 + len] = 0x80;
+  out[7 + len] = 0x03;
+  return (size_t) len + 8;
+}
+
+int writeFile (const char *path, const unsigned char *data, size_t len) {
+  FILE *file = fopen (path, "wb");
+
+  if (!file) {
+    fprintf (stderr, "ERROR: Could not create %s\n", path);
+    return -1;
+  }
+  if (fwrite (data, 1, len, file) != len) {
+    fprintf (stderr, "ERROR: Could not write %s\n", path);
+    fclose (file);
+    return -1;
+  }
+  return fclose (file);
+}
+
+int addName (char ***list, size_t *n, const char *name) {
+  if ((*n & (*n - 1)) == 0) {
+    char **grown = realloc (*list, (*n ? *n * 2 : 1) * sizeof (char *));
+
+    if (!grown)
+      return -1;
+    *list = grown;
+  }
+  (*list)[*n] = strdup (name);
+  if (!(*list)[*n])
+    return -1;
+  (*n)++;
+  return 0;
+}
+
+int makeDirectory (bench_corpus *corpus, const char *path) {
+  if (mkdir (path, 0755) != 0) {
+    fprintf (stderr, "ERROR: Could not create directory %s\n", path);
+    return -1;
+  }
+  return addName (&corpus->dirs, &corpus->ndirs, path);
+}
+
+/* The directory a font goes in, created along the way.  Fonts are
+ * shared out a hundred to a directory, except deep ones, which go down
+ * a chain of directories to a depth that varies with their number. */
+int fontDirectory (bench_corpus *corpus, size_t i, char *dir, size_t size) {
+  size_t depth, d;
+  int len;
+
+  if (i % BENCH_KIND_COUNT != BENCH_DEEP) {
+    snprintf (dir, size, "%s/d%05lu", corpus->root, (unsigned long) (i / 100));
+    return access (dir, F_OK) == 0 ? 0 : makeDirectory (corpus, dir);
+  }
+
+  depth = (i / BENCH_KIND_COUNT) % BENCH_MAX_DEPTH + 1;
+  len = snprintf (dir, size, "%s/deep", corpus->root);
+  if (access (dir, F_OK) != 0 && makeDirectory (corpus, dir) != 0)
+    return -1;
+  for (d = 0; d < depth; d++) {
+    len += snprintf (dir + len, size - (size_t) len,
+        "/a-rather-long-directory-name-at-level-%02lu", (unsigned long) d);
+    if (access (dir, F_OK) != 0 && makeDirectory (corpus, dir) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Write font i of the corpus and note its specification */
+int generateFont (bench_corpus *corpus, size_t i, unsigned char *data) {
+  char dir[MAX_PATH], path[MAX_PATH + 32], pfb[MAX_PATH + 32], family[64];
+  const char *style = bench_styles[i % 4];
+  size_t kind = i % BENCH_KIND_COUNT, len;
+
+  if (fontDirectory (corpus, i, dir, sizeof (dir)) != 0)
+    return -1;
+  snprintf (family, sizeof (family), "Bench Family %lu",
+      (unsigned long) (i / 4));
+
+  if (kind >= BENCH_PAIR && kind < BENCH_MISNAMED) {
+    char spec[2 * MAX_PATH + 66];
+
+    snprintf (path, sizeof (path), "%s/font%07lu.pfm", dir, (unsigned long) i);
+    snprintf (pfb, sizeof (pfb), "%s/font%07lu.pfb", dir, (unsigned long) i);
+    len = buildPfm (data, family, (int) (i % 4));
+    if (writeFile (path, data, len) != 0)
+      return -1;
+    len = buildPfb (data, family);
+    if (writeFile (pfb, data, len) != 0)
+      return -1;
+    snprintf (spec, sizeof (spec), "%s|%s", path, pfb);
+    corpus->nfiles += 2;
+    return addName (&corpus->specs, &corpus->nspecs, spec) ||
+      addName (&corpus->pairs, &corpus->npairs, spec);
+  }
+
+  if (kind < BENCH_OTF || kind == BENCH_DEEP) {
+    snprintf (path, sizeof (path), "%s/font%07lu.ttf", dir, (unsigned long) i);
+    len = buildSfnt (data, 0, 0x00010000UL, family, style);
+  } else if (kind < BENCH_TTC) {
+    snprintf (path, sizeof (path), "%s/font%07lu.otf", dir, (unsigned long) i);
+    len = buildSfnt (data, 0, 0x4F54544FUL, family, style);
+  } else if (kind == BENCH_TTC) {
+    snprintf (path, sizeof (path), "%s/font%07lu.ttc", dir, (unsigned long) i);
+    len = buildCollection (data, family);
+  } else if (kind == BENCH_MISNAMED) {
+    /* PostScript outlines under a TrueType name, caught by --strict */
+    snprintf (path, sizeof (path), "%s/font%07lu.ttf", dir, (unsigned long) i);
+    len = buildPfb (data, family);
+  } else if (kind == BENCH_NOT_FONT) {
+    snprintf (path, sizeof (path), "%s/font%07lu.txt", dir, (unsigned long) i);
+    len = (size_t) sprintf ((char *) data, "Not a font\n");
+  } else {
+    snprintf (path, sizeof (path), "%s/FONT%07lu.TTF", dir, (unsigned long) i);
+    len = buildSfnt (data, 0, 0x00010000UL, family, style);
+  }
+
+  if (writeFile (path, data, len) != 0)
+    return -1;
+  corpus->nfiles++;
+  return addName (&corpus->specs, &corpus->nspecs, path) ||
+    addName (&corpus->singles, &corpus->nsingles, path);
+}
+
+int generateCorpus (bench_corpus *corpus, const char *parent, size_t n) {
+  unsigned char data[1024];
+  char root[MAX_PATH];
+  size_t i;
+
+  memset (corpus, 0, sizeof (bench_corpus));
+  snprintf (root, sizeof (root), "%s/corpus-%lu", parent, (unsigned long) n);
+  corpus->root = strdup (root);
+  if (!corpus->root || makeDirectory (corpus, root) != 0)
+    return -1;
+
+  for (i = 0; i < n; i++) {
+    if (generateFont (corpus, i, data) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+void removeCorpus (bench_corpus *corpus) {
+  size_t i;
+
+  for (i = 0; i < corpus->nspecs; i++) {
+    char *pipe_pos = strchr (corpus->specs[i], '|');
+
+    if (pipe_pos) {
+      unlink (pipe_pos + 1);
+      *pipe_pos = '\0';
+    }
+    unlink (corpus->specs[i]);
+    free (corpus->specs[i]);
+  }
+  for (i = corpus->ndirs; i > 0; i--) {
+    rmdir (corpus->dirs[i - 1]);
+    free (corpus->dirs[i - 1]);
+  }
+  for (i = 0; i < corpus->nsingles; i++)
+    free (corpus->singles[i]);
+  for (i = 0; i < corpus->npairs; i++)
+    free (corpus->pairs[i]);
+  free (corpus->specs);
+  free (corpus->singles);
+  free (corpus->pairs);
+  free (corpus->dirs);
+  free (corpus->root);
+}
+
+/* Error messages and registration reports would swamp the results, so
+ * they go to /dev/null while a benchmark runs */
+int bench_saved_stdout = -1, bench_saved_stderr = -1;
+
+void quiet (void) {
+  int null = open ("/dev/null", O_WRONLY);
+
+  fflush (stdout);
+  fflush (stderr);
+  bench_saved_stdout = dup (1);
+  bench_saved_stderr = dup (2);
+  if (null >= 0) {
+    dup2 (null, 1);
+    dup2 (null, 2);
+    close (null);
+  }
+}
+
+void unquiet (void) {
+  fflush (stdout);
+  fflush (stderr);
+  if (bench_saved_stdout >= 0) {
+    dup2 (bench_saved_stdout, 1);
+    close (bench_saved_stdout);
+  }
+  if (bench_saved_stderr >= 0) {
+    dup2 (bench_saved_stderr, 2);
+    close (bench_saved_stderr);
+  }
+}
+
+void benchCheck (const char *benchmark, char **fonts, size_t n,
+    size_t corpus, int postscript, int strict, int verify) {
+  unsigned long long start, elapsed;
+  unsigned long passes = 0, failed = 0, queries;
+  size_t i;
+
+  if (n == 0)
+    return;
+
+  bench_session->options.strict = strict;
+  bench_session->options.verify = verify;
+  quiet ();
+  queries = regfont_stat_count ();
+  start = regfont_now_us ();
+  do {
+    for (i = 0; i < n; i++) {
+      int retval = postscript ?
+        checkPostScriptFile (bench_session, fonts[i], NULL, NULL) :
+        checkFile (bench_session, viewOf (fonts[i]), REGFONT_ANY, NULL,
+            NULL);
+
+      if (passes == 0 && retval != REGFONT_OK)
+        failed++;
+    }
+    passes++;
+    elapsed = regfont_now_us () - start;
+  } while (elapsed < BENCH_MIN_US);
+  queries = regfont_stat_count () - queries;
+  unquiet ();
+  bench_session->options.strict = 0;
+  bench_session->options.verify = 0;
+
+  printf ("{\"benchmark\": \"%s\", \"corpus\": %lu, \"fonts\": %lu, "
+      "\"passes\": %lu, \"ns_per_font\": %.1f, \"stat_per_font\": %.2f, "
+      "\"failed\": %lu}\n", benchmark, (unsigned long) corpus,
+      (unsigned long) n, passes, elapsed * 1000.0 / ((double) passes * n),
+      (double) queries / ((double) passes * n), failed);
+}
+
+void benchChecksumKernel (const char *kernel,
+    unsigned long (*checksum) (const unsigned char *, size_t),
+    const unsigned char *data, unsigned long expected) {
+  unsigned long long start, elapsed;
+  unsigned long passes = 0, sum;
+  int matches = -1;
+
+  start = regfont_now_us ();
+  do {
+    sum = checksum (data, BENCH_CHECKSUM_BYTES);
+    if (sum != expected)
+      matches = 0;
+    passes++;
+    elapsed = regfont_now_us () - start;
+  } while (elapsed < BENCH_MIN_US);
+
+  printf ("{\"benchmark\": \"checksum\", \"kernel\": \"%s\", "
+      "\"bytes\": %lu, \"passes\": %lu, \"gb_per_s\": %.2f, "
+      "\"matches\": %s}\n", kernel, BENCH_CHECKSUM_BYTES, passes,
+      (double) passes * BENCH_CHECKSUM_BYTES / (elapsed * 1000.0),
+      matches ? "true" : "false");
+}
+
+/* The scalar kernel against the one --verify uses.  They are also
+ * compared over a length that is not a multiple of the vector width. */
+int benchChecksum (void) {
+  unsigned char *data = malloc (BENCH_CHECKSUM_BYTES);
+  unsigned long seed = 1, expected;
+  size_t i;
+
+  if (!data) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return -1;
+  }
+  for (i = 0; i < BENCH_CHECKSUM_BYTES; i++) {
+    seed = (seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+
+  chooseChecksumKernel ();
+  if (sfntChecksum (data, BENCH_CHECKSUM_BYTES - 3) !=
+      sfntChecksumScalar (data, BENCH_CHECKSUM_BYTES - 3))
+    fprintf (stderr, "ERROR: %s checksum kernel is wrong\n",
+        checksumKernelName ());
+
+  expected = sfntChecksumScalar (data, BENCH_CHECKSUM_BYTES);
+  benchChecksumKernel ("scalar", sfntChecksumScalar, data, expected);
+  benchChecksumKernel (checksumKernelName (), sfntChecksum, data,
+      expected);
+  fflush (stdout);
+  free (data);
+  return 0;
+}
+
+/* With pair, .pfm and .pfb files are taken too and paired as --pair
+ * does */
+void benchWalk (bench_corpus *corpus, int jobs, int pair) {
+  regfont_source *fonts;
+  unsigned long long start, elapsed;
+  unsigned long found = 0;
+
+  if (pair)
+    quiet ();
+  start = regfont_now_us ();
+  fonts = walkSource (1, &corpus->root, jobs,
+      pair ? REGFONT_WALK_PFM | REGFONT_WALK_PFB : 0);
+  if (fonts && pair)
+    fonts = pairSource (fonts);
+  if (!fonts) {
+    if (pair)
+      unquiet ();
+    return;
+  }
+  while (fonts->next (fonts))
+    found++;
+  closeSource (fonts);
+  elapsed = regfont_now_us () - start;
+  if (pair)
+    unquiet ();
+
+  printf ("{\"benchmark\": \"%s\", \"corpus\": %lu, \"jobs\": %d, "
+      "\"files\": %lu, \"directories\": %lu, \"ms\": %.3f, "
+      "\"files_per_s\": %.0f}\n", pair ? "walk_pair" : "walk",
+      (unsigned long) corpus->nspecs, jobs, found,
+      (unsigned long) corpus->ndirs, elapsed / 1000.0,
+      elapsed ? found * 1e6 / elapsed : 0.0);
+}
+
+/* Needs root on Linux.  Returns -1 if the cache could not be dropped. */
+int dropCaches (void) {
+  int fd, written;
+
+  sync ();
+  fd = open ("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd < 0)
+    return -1;
+  written = (int) write (fd, "3\n", 2);
+  close (fd);
+  return written == 2 ? 0 : -1;
+}
+
+void benchPipeline (bench_corpus *corpus, int remove, int jobs, int strict,
+    int prefetch) {
+  regfont_source *fonts = argvSource (corpus->nspecs, corpus->specs);
+  unsigned long long start, elapsed;
+  const char *engine = "none";
+  regfont_prefetcher *prefetcher;
+
+  if (!fonts)
+    return;
+
+  if (prefetch) {
+    prefetcher = prefetchCreate (jobs);
+    if (prefetcher)
+      engine = prefetchEngine (prefetcher);
+    prefetchDestroy (prefetcher);
+  }
+
+  if (bench_cold && dropCaches () != 0) {
+    fprintf (stderr, "ERROR: Could not drop the page cache, running warm\n");
+    bench_cold = 0;
+  }
+
+  bench_session->options.strict = strict;
+  bench_session->options.prefetch = prefetch;
+  quiet ();
+  start = regfont_now_us ();
+  if (remove)
+    removeFonts (bench_session, fonts);
+  else
+    addFonts (bench_session, fonts);
+  elapsed = regfont_now_us () - start;
+  unquiet ();
+  bench_session->options.strict = 0;
+  bench_session->options.prefetch = 0;
+  closeSource (fonts);
+
+  printf ("{\"benchmark\": \"%s%s%s\", \"corpus\": %lu, \"jobs\": %d, "
+      "\"prefetch\": \"%s\", \"cold\": %s, \"ms\": %.3f, "
+      "\"fonts_per_s\": %.0f}\n", remove ? "remove" : "add",
+      strict ? "_strict" : "", prefetch ? "_prefetch" : "",
+      (unsigned long) corpus->nspecs, jobs, engine,
+      bench_cold ? "true" : "false", elapsed / 1000.0,
+      elapsed ? corpus->nspecs * 1e6 / elapsed : 0.0);
+}
+
+int benchCorpus (const char *parent, size_t n, int jobs, int keep) {
+  bench_corpus corpus;
+  unsigned long long start, elapsed;
+
+  start = regfont_now_us ();
+  if (generateCorpus (&corpus, parent, n) != 0) {
+    removeCorpus (&corpus);
+    return -1;
+  }
+  elapsed = regfont_now_us () - start;
+  printf ("{\"benchmark\": \"corpus\", \"corpus\": %lu, \"files\": %lu, "
+      "\"directories\": %lu, \"ms\": %.3f}\n", (unsigned long) n,
+      (unsigned long) corpus.nfiles, (unsigned long) corpus.ndirs,
+      elapsed / 1000.0);
+
+  if (jobs >= 0) {
+    benchCheck ("check_file", corpus.singles, corpus.nsingles, n, 0, 0, 0);
+    benchCheck ("check_file_strict", corpus.singles, corpus.nsingles, n, 0,
+        -1, 0);
+    benchCheck ("check_file_verify", corpus.singles, corpus.nsingles, n, 0,
+        0, -1);
+    benchCheck ("check_postscript", corpus.pairs, corpus.npairs, n, -1, 0,
+        0);
+    benchWalk (&corpus, jobs, 0);
+    benchWalk (&corpus, jobs, -1);
+    benchPipeline (&corpus, 0, jobs, 0, 0);
+    benchPipeline (&corpus, 0, jobs, 0, -1);
+    benchPipeline (&corpus, 0, jobs, -1, 0);
+    benchPipeline (&corpus, 0, jobs, -1, -1);
+    benchPipeline (&corpus, -1, jobs, 0, 0);
+    fflush (stdout);
+  }
+
+  if (keep)
+    fprintf (stderr, "Kept corpus of %lu fonts in %s\n", (unsigned long) n,
+        corpus.root);
+  else
+    removeCorpus (&corpus);
+  return 0;
+}
+
+void printBenchUsage (void) {
+  printf ("Usage: fontbench [-j N] [-d DIR] [--keep] [--corpus] [--cold] "
+      "[SIZE...]\n");
+  printf ("\t-j N\t\tThreads checking fonts (default: number of CPUs)\n");
+  printf ("\t-d DIR\t\tWhere to generate corpora (default: /tmp)\n");
+  printf ("\t--keep\t\tKeep the corpora instead of deleting them\n");
+  printf ("\t--corpus\tOnly generate the corpora, implies --keep\n");
+  printf ("\t--cold\t\tDrop the page cache before each add and remove "
+      "(needs root)\n");
+  printf ("\tSIZE\t\tFonts in each corpus (default: 10 100 1000 10000)\n");
+}
+
+int main (int argc, char **argv) {
+  static const size_t default_sizes[] = {10, 100, 1000, 10000};
+  const char *parent = "/tmp";
+  char template[MAX_PATH];
+  size_t sizes[64], nsizes = 0, i;
+  int jobs = regfont_cpu_count (), keep = 0, corpusonly = 0, retval = 0;
+
+  for (i = 1; i < (size_t) argc; i++) {
+    if (strcmp (argv[i], "-j") == 0 && i + 1 < (size_t) argc) {
+      jobs = atoi (argv[++i]);
+    } else if (strcmp (argv[i], "-d") == 0 && i + 1 < (size_t) argc) {
+      parent = argv[++i];
+    } else if (strcmp (argv[i], "--keep") == 0) {
+      keep = -1;
+    } else if (strcmp (argv[i], "--corpus") == 0) {
+      corpusonly = -1;
+      keep = -1;
+    } else if (strcmp (argv[i], "--cold") == 0) {
+      bench_cold = -1;
+    } else if (argv[i][0] >= '1' && argv[i][0] <= '9' &&
+        nsizes < sizeof (sizes) / sizeof (sizes[0])) {
+      sizes[nsizes++] = (size_t) strtoul (argv[i], NULL, 10);
+    } else {
+      printBenchUsage ();
+      return argv[i][0] == '-' && argv[i][1] == 'h' ? 0 : 1;
+    }
+  }
+  if (nsizes == 0) {
+    nsizes = sizeof (default_sizes) / sizeof (default_sizes[0]);
+    memcpy (sizes, default_sizes, sizeof (default_sizes));
+  }
+  if (jobs < 1)
+    jobs = 1;
+
+  snprintf (template, sizeof (template), "%s/regfont-bench-XXXXXX", parent);
+  if (!mkdtemp (template)) {
+    fprintf (stderr, "ERROR: Could not create a directory in %s\n", parent);
+    return 1;
+  }
+
+  if (!corpusonly) {
+    regfont_options options;
+
+    regfont_default_options (&options);
+    options.backend = "sim";
+    options.jobs = jobs;
+    bench_session = regfont_session_open (&options);
+    if (!bench_session || benchChecksum () != 0)
+      return 1;
+  }
+
+  for (i = 0; i < nsizes && retval == 0; i++) {
+    if (benchCorpus (template, sizes[i], corpusonly ? -1 : jobs, keep) != 0)
+      retval = 1;
+  }
+
+  regfont_session_close (bench_session);
+  if (!keep)
+    rmdir (template);
+  return retval;
+}
@@ -0,0 +1,225 @@
+/* fonttype.c
+ * Font file type detection for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+static const char *regfont_format_names[] = {
+  "unknown",
+  "TrueType",
+  "OpenType (CFF)",
+  "TrueType collection",
+  "Windows font resource",
+  "Windows bitmap font",
+  "PostScript font binary",
+  "PostScript font metrics"
+};
+
+const char *formatName (regfont_format format) {
+  if ((size_t) format >= sizeof (regfont_format_names) /
+      sizeof (regfont_format_names[0]))
+    return regfont_format_names[0];
+  return regfont_format_names[format];
+}
+
+unsigned int readBE16 (const unsigned char *p) {
+  return ((unsigned int) p[0] << 8) | (unsigned int) p[1];
+}
+
+unsigned long readBE32 (const unsigned char *p) {
+  return ((unsigned long) p[0] << 24) | ((unsigned long) p[1] << 16) |
+    ((unsigned long) p[2] << 8) | (unsigned long) p[3];
+}
+
+unsigned long readLE32 (const unsigned char *p) {
+  return ((unsigned long) p[3] << 24) | ((unsigned long) p[2] << 16) |
+    ((unsigned long) p[1] << 8) | (unsigned long) p[0];
+}
+
+static unsigned int readLE16 (const unsigned char *p) {
+  return ((unsigned int) p[1] << 8) | (unsigned int) p[0];
+}
+
+/* Classify a file from its first bytes.  size is how many bytes of the
+ * file header are available; the file at path, if given, is read only
+ * for the NE header of an executable when it lies beyond them. */
+regfont_format sniffFontHeader (const unsigned char *header, size_t size,
+    const char *path) {
+  unsigned long tag;
+
+  if (size >= 4) {
+    tag = readBE32 (header);
+    if (tag == 0x00010000UL || tag == 0x74727565UL) /* 'true' */
+      return REGFONT_FORMAT_TRUETYPE;
+    if (tag == 0x4F54544FUL) /* 'OTTO' */
+      return REGFONT_FORMAT_OPENTYPE;
+    if (tag == 0x74746366UL) /* 'ttcf' */
+      return REGFONT_FORMAT_COLLECTION;
+  }
+
+  /* PFB files are a series of segments, the first of them ASCII */
+  if (size >= 2 && header[0] == 0x80 && header[1] == 0x01)
+    return REGFONT_FORMAT_PFB;
+
+  if (size >= 0x40 && header[0] == 'M' && header[1] == 'Z') {
+    size_t offset = (size_t) readLE32 (header + 0x3C);
+    unsigned char ne[2];
+
+    if (offset < size && size - offset >= 2) {
+      ne[0] = header[offset];
+      ne[1] = header[offset + 1];
+    } else if (!path || regfont_read_file (path, offset, ne, 2) != 2) {
+      return REGFONT_FORMAT_UNKNOWN;
+    }
+
+    if (ne[0] == 'N' && ne[1] == 'E')
+      return REGFONT_FORMAT_FON;
+    return REGFONT_FORMAT_UNKNOWN;
+  }
+
+  /* PFM and FNT share the Windows font resource header layout: a
+   * version word followed by the file size */
+  if (size >= 6) {
+    unsigned int version = readLE16 (header);
+    if (version == 0x0100)
+      return REGFONT_FORMAT_PFM;
+    if (version == 0x0200 || version == 0x0300)
+      return REGFONT_FORMAT_FNT;
+  }
+
+  return REGFONT_FORMAT_UNKNOWN;
+}
+
+/* Unbuffered, so that checking a file allocates nothing */
+regfont_format sniffFontFile (const char *filename) {
+  unsigned char header[REGFONT_SNIFF_SIZE];
+  long size;
+
+  size = regfont_read_file (filename, 0, header, sizeof (header));
+  if (size < 0)
+    return REGFONT_FORMAT_UNKNOWN;
+  return sniffFontHeader (header, (size_t) size, filename);
+}
+
+/* Font extensions are classified without any locale aware string
+ * comparison.  An extension of exactly three ASCII letters is folded to
+ * lower case and packed five bits a letter into an integer, and the
+ * packed value indexes a small perfect hash table.  The table is laid
+ * out by the compiler from the packed keys, and REGFONT_EXT_SLOTS is the
+ * smallest modulus under which the keys below do not collide. */
+#define REGFONT_EXT(a, b, c) ((((unsigned long) (a) - 'a' + 1) << 10) | \
+    (((unsigned long) (b) - 'a' + 1) << 5) | ((unsigned long) (c) - 'a' + 1))
+#define REGFONT_EXT_SLOTS 18
+
+#define SFNT_FORMATS ((1U << REGFONT_FORMAT_TRUETYPE) | \
+    (1U << REGFONT_FORMAT_OPENTYPE))
+
+typedef struct {
+  unsigned long key;
+  regfont_font_type type;
+  unsigned int formats;
+} regfont_extension;
+
+/* .mmm multiple master metrics have no documented signature, so any
+ * content is accepted for them */
+static const regfont_extension regfont_extensions[REGFONT_EXT_SLOTS] = {
+  [REGFONT_EXT ('f','o','n') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('f','o','n'), REGFONT_ANY, 1U << REGFONT_FORMAT_FON},
+  [REGFONT_EXT ('f','n','t') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('f','n','t'), REGFONT_ANY, 1U << REGFONT_FORMAT_FNT},
+  [REGFONT_EXT ('t','t','f') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('t','t','f'), REGFONT_ANY, SFNT_FORMATS},
+  [REGFONT_EXT ('t','t','c') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('t','t','c'), REGFONT_ANY, 1U << REGFONT_FORMAT_COLLECTION},
+  [REGFONT_EXT ('f','o','t') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('f','o','t'), REGFONT_ANY, 1U << REGFONT_FORMAT_FON},
+  [REGFONT_EXT ('o','t','f') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('o','t','f'), REGFONT_ANY, SFNT_FORMATS},
+  [REGFONT_EXT ('m','m','m') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('m','m','m'), REGFONT_ANY, ~0U},
+  [REGFONT_EXT ('p','f','m') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('p','f','m'), REGFONT_PFM, 1U << REGFONT_FORMAT_PFM},
+  [REGFONT_EXT ('p','f','b') % REGFONT_EXT_SLOTS] =
+    {REGFONT_EXT ('p','f','b'), REGFONT_PFB, 1U << REGFONT_FORMAT_PFB}
+};
+
+/* Returns 0 for anything that is not three ASCII letters */
+static unsigned long foldExtension (const char *extension) {
+  unsigned long key = 0;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    unsigned int c = (unsigned char) extension[i] | 0x20;
+    if (c < 'a' || c > 'z')
+      return 0;
+    key = (key << 5) | (c - 'a' + 1);
+  }
+
+  return extension[3] == '\0' ? key : 0;
+}
+
+static const regfont_extension *lookupExtension (const char *extension) {
+  unsigned long key = foldExtension (extension);
+  const regfont_extension *entry =
+    &regfont_extensions[key % REGFONT_EXT_SLOTS];
+
+  return key != 0 && entry->key == key ? entry : NULL;
+}
+
+/* Classify an extension (without the dot) as REGFONT_ANY, REGFONT_PFM,
+ * REGFONT_PFB or REGFONT_NOT_FONT */
+regfont_font_type classifyExtension (const char *extension) {
+  const regfont_extension *entry = lookupExtension (extension);
+
+  return entry ? entry->type : REGFONT_NOT_FONT;
+}
+
+/* The formats a file with the given extension (without the dot) may
+ * hold */
+int extensionAllowsFormat (const char *extension, regfont_format format) {
+  const regfont_extension *entry = lookupExtension (extension);
+
+  return entry && (entry->formats & (1U << format)) != 0;
+}
+
+/* ASCII case insensitive equality, for file names that only need to
+ * match the way the user typed them */
+int asciiCaseEqual (regfont_view a, regfont_view b) {
+  size_t i;
+
+  if (a.len != b.len)
+    return 0;
+  for (i = 0; i < a.len; i++) {
+    unsigned int ca = (unsigned char) a.data[i], cb = (unsigned char) b.data[i];
+    if (ca >= 'A' && ca <= 'Z')
+      ca |= 0x20;
+    if (cb >= 'A' && cb <= 'Z')
+      cb |= 0x20;
+    if (ca != cb)
+      return 0;
+  }
+  return -1;
+}
@@ -0,0 +1,404 @@
+/* journal.c
+ * Session journal of registered fonts for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* Every font successfully added or removed is appended to the journal
+ * as a line of "+ PATH" or "- PATH", with full paths.  Each line goes to
+ * the file in a single write as soon as the font table has taken it, so
+ * a crash loses nothing that was registered.  A line cut short by a
+ * crash is ignored when the journal is read.
+ *
+ * Each process holds a shared lock on the journal while it has it
+ * open.  One that finds no other lock held compacts the journal to the
+ * fonts still registered, through a new file put in place of the old,
+ * so the journal only grows with what is left registered.  The others
+ * then find their file is no longer the journal and open it again.
+ *
+ * Registered fonts only last as long as the logon session, so the
+ * journal starts with a line naming the one it was written in, and a
+ * journal from any other is taken to list nothing. */
+#define REGFONT_JOURNAL_HEADER 128
+
+/* Returns a path for the caller to free, or NULL if out of memory */
+char *defaultJournalPath (void) {
+  const char *dir;
+  char *path;
+  size_t size;
+
+#ifdef _WIN32
+  dir = getenv ("TEMP");
+  if (!dir)
+    dir = ".";
+  size = strlen (dir) + sizeof ("\\regfont.journal");
+  path = malloc (size);
+  if (path)
+    _snprintf (path, size, "%s\\regfont.journal", dir);
+#else
+  dir = getenv ("XDG_RUNTIME_DIR");
+  if (dir && !*dir)
+    dir = NULL;
+  /* Room for the longest user id */
+  size = (dir ? strlen (dir) : 0) + sizeof ("/tmp/regfont-.journal") + 20;
+  path = malloc (size);
+  if (path && dir)
+    snprintf (path, size, "%s/regfont.journal", dir);
+  else if (path)
+    snprintf (path, size, "/tmp/regfont-%lu.journal",
+        (unsigned long) getuid ());
+#endif
+
+  return path;
+}
+
+static int compareJournalEntries (const void *a, const void *b) {
+  const regfont_journal_entry *ea = a, *eb = b;
+  int cmp = strcmp (ea->path, eb->path);
+
+  if (cmp == 0)
+    cmp = ea->order < eb->order ? -1 : ea->order > eb->order;
+  return cmp;
+}
+
+static int compareJournalOrder (const void *a, const void *b) {
+  const regfont_journal_entry *ea = a, *eb = b;
+
+  return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+/* Read the journal into entries, one per line */
+static regfont_journal_entry *readJournalFile (FILE *file, size_t *count) {
+  regfont_journal_entry *entries = NULL;
+  size_t n = 0, size = 0, linesize = 0;
+  char *line = NULL;
+
+  while (regfont_getline (&line, &linesize, file) >= 0) {
+    size_t len = strlen (line);
+
+    if (len < 4 || line[len - 1] != '\n' || line[1] != ' ' ||
+        (line[0] != '+' && line[0] != '-'))
+      continue;
+    line[len - 1] = '\0';
+
+    if (n == size) {
+      size_t newsize = size ? size * 2 : 256;
+      regfont_journal_entry *grown = realloc (entries,
+          newsize * sizeof (regfont_journal_entry));
+
+      if (!grown)
+        break;
+      entries = grown;
+      size = newsize;
+    }
+    entries[n].path = strdup (line + 2);
+    if (!entries[n].path)
+      break;
+    entries[n].delta = line[0] == '+' ? 1 : -1;
+    entries[n].order = n;
+    n++;
+  }
+  free (line);
+
+  *count = n;
+  return entries;
+}
+
+/* Fonts are registered once for each add, so the deltas of each path
+ * are summed.  Returns the fonts still registered, each once with the
+ * number of times it was added, in the order they were first added. */
+static regfont_journal_entry *liveFonts (regfont_journal_entry *entries,
+    size_t n, size_t *count) {
+  size_t live = 0, i, j;
+
+  if (n > 1)
+    qsort (entries, n, sizeof (regfont_journal_entry),
+        compareJournalEntries);
+  for (i = 0; i < n; i = j) {
+    regfont_journal_entry entry = entries[i];
+
+    entry.delta = 0;
+    for (j = i; j < n && strcmp (entries[j].path, entry.path) == 0; j++) {
+      entry.delta += entries[j].delta;
+      if (j > i)
+        free (entries[j].path);
+    }
+    if (entry.delta > 0)
+      entries[live++] = entry;
+    else
+      free (entry.path);
+  }
+  if (live > 1)
+    qsort (entries, live, sizeof (regfont_journal_entry),
+        compareJournalOrder);
+
+  *count = live;
+  return entries;
+}
+
+/* Returns -1 if there is no telling one logon session from another */
+static int journalHeader (char *header, size_t size) {
+  char id[REGFONT_JOURNAL_HEADER - 16];
+
+  if (regfont_logon_id (id, sizeof (id)) != 0)
+    return -1;
+  snprintf (header, size, "# logon %s\n", id);
+  return 0;
+}
+
+/* Leaves file at its start */
+static int currentJournal (FILE *file) {
+  char expected[REGFONT_JOURNAL_HEADER], line[REGFONT_JOURNAL_HEADER];
+  int current;
+
+  if (journalHeader (expected, sizeof (expected)) != 0)
+    return 1;
+  rewind (file);
+  current = fgets (line, sizeof (line), file) &&
+    strcmp (line, expected) == 0;
+  rewind (file);
+  return current;
+}
+
+/* Returns 1 if the journal at path was replaced.  The caller holds the
+ * only lock on file. */
+static int compactJournal (FILE *file, const char *path) {
+  regfont_journal_entry *entries;
+  size_t n, live = 0, records = 0, len = strlen (path), i;
+  char header[REGFONT_JOURNAL_HEADER], *tmppath = NULL;
+  FILE *tmp = NULL;
+  int retval = 0, current = currentJournal (file), written, k;
+
+  entries = readJournalFile (file, &n);
+  if (current) {
+    entries = liveFonts (entries, n, &live);
+  } else {
+    for (i = 0; i < n; i++)
+      free (entries[i].path);
+  }
+  for (i = 0; i < live; i++)
+    records += (size_t) entries[i].delta;
+  if (current && records == n)
+    goto cleanup;
+
+  tmppath = malloc (len + 5);
+  if (tmppath) {
+    memcpy (tmppath, path, len);
+    memcpy (tmppath + len, ".tmp", 5);
+    tmp = regfont_open_private (tmppath, "wb");
+  }
+  if (!tmp) {
+    fprintf (stderr, "ERROR: Could not compact session journal %s\n", path);
+    goto cleanup;
+  }
+  if (journalHeader (header, sizeof (header)) == 0)
+    fputs (header, tmp);
+  for (i = 0; i < live; i++)
+    for (k = 0; k < entries[i].delta; k++)
+      fprintf (tmp, "+ %s\n", entries[i].path);
+  written = !ferror (tmp);
+  if (fclose (tmp) != 0 || !written ||
+      regfont_replace_file (tmppath, path) != 0) {
+    fprintf (stderr, "ERROR: Could not compact session journal %s\n", path);
+    remove (tmppath);
+    goto cleanup;
+  }
+  if (current)
+    dbprintf ("Compacted session journal %s from %lu to %lu records", path,
+        (unsigned long) n, (unsigned long) records);
+  else
+    dbprintf ("Started session journal %s afresh, dropping %lu records "
+        "from another logon session", path, (unsigned long) n);
+  retval = 1;
+
+cleanup:
+  for (i = 0; i < live; i++)
+    free (entries[i].path);
+  free (entries);
+  free (tmppath);
+  return retval;
+}
+
+/* The journal is refused if it is not the user's own, since a planted
+ * one could have -r --session remove any font */
+int openJournal (regfont_session *session, const char *path) {
+  FILE *file;
+  long size;
+
+  while (1) {
+    file = regfont_open_private (path, "ab+");
+    if (!file) {
+      fprintf (stderr, "ERROR: Could not open session journal %s\n", path);
+      return -1;
+    }
+    if (regfont_lock_file (file, -1) == 0) {
+      if (regfont_same_file (file, path) && compactJournal (file, path)) {
+        fclose (file);
+        continue;
+      }
+      regfont_unlock_file (file);
+    }
+    if (regfont_lock_file (file, 0) == 0 && regfont_same_file (file, path))
+      break;
+    fclose (file);
+  }
+  setvbuf (file, NULL, _IONBF, 0);
+
+  /* End a line left cut short by a crash, so the next record is not
+   * glued to it.  The NUL before the newline, which no path can hold,
+   * keeps the torn line from being read as a record. */
+  if (fseek (file, 0, SEEK_END) == 0 && (size = ftell (file)) > 0 &&
+      fseek (file, size - 1, SEEK_SET) == 0 && fgetc (file) != '\n') {
+    fseek (file, 0, SEEK_END);
+    fwrite ("\0\n", 1, 2, file);
+  }
+  fseek (file, 0, SEEK_END);
+
+  regfont_mutex_init (&session->journal_lock);
+  session->journal = file;
+  dbprintf ("Journalling fonts to %s", path);
+  return 0;
+}
+
+/* path is the full path the font table was given.  The record is
+ * made whole first, so that it goes out in one write however long. */
+void journalFont (regfont_session *session, int remove, const char *path) {
+  regfont_arena_mark mark;
+  size_t len;
+  char *record;
+
+  if (!session->journal)
+    return;
+
+  mark = arenaMark (&regfont_path_arena);
+  len = strlen (path);
+  record = arenaAlloc (&regfont_path_arena, len + 3);
+  if (!record) {
+    msgprintf (session, stderr, "ERROR: Out of memory\n");
+    arenaRelease (&regfont_path_arena, mark);
+    return;
+  }
+  record[0] = remove ? '-' : '+';
+  record[1] = ' ';
+  memcpy (record + 2, path, len);
+  record[len + 2] = '\n';
+
+  regfont_mutex_lock (&session->journal_lock);
+  if (fwrite (record, 1, len + 3, session->journal) != len + 3 ||
+      fflush (session->journal) != 0)
+    msgprintf (session, stderr, "ERROR: Could not write session journal\n");
+  regfont_mutex_unlock (&session->journal_lock);
+  arenaRelease (&regfont_path_arena, mark);
+}
+
+void closeJournal (regfont_session *session) {
+  if (!session->journal)
+    return;
+  fclose (session->journal);
+  session->journal = NULL;
+  regfont_mutex_destroy (&session->journal_lock);
+}
+
+/* Undoing a session */
+
+/* The fonts the journal says are still registered */
+regfont_journal_entry *sessionFonts (const char *path, size_t *count) {
+  regfont_journal_entry *entries;
+  size_t n = 0, live;
+  FILE *file = regfont_open_private (path, "rb");
+
+  if (file && currentJournal (file)) {
+    entries = readJournalFile (file, &n);
+  } else {
+    entries = NULL;
+    if (file)
+      dbprintf ("Session journal %s is from another logon session", path);
+  }
+  if (file)
+    fclose (file);
+  entries = liveFonts (entries, n, &live);
+
+  dbprintf ("Session journal %s: %lu fonts in %lu records", path,
+      (unsigned long) live, (unsigned long) n);
+  *count = live;
+  return entries;
+}
+
+/* Remove every font the journal says is still registered, without
+ * checking them again, and send a single font change broadcast */
+int removeSession (regfont_session *session, const char *path) {
+  regfont_journal_entry *entries;
+  size_t live, i;
+  unsigned long removed = 0, failed = 0;
+  FILE *file;
+  int retval = 0;
+
+  entries = sessionFonts (path, &live);
+  if (live == 0) {
+    msgprintf (session, stdout, "No fonts registered in this session\n");
+    free (entries);
+    return 0;
+  }
+
+  for (i = 0; i < live; i++) {
+    int k;
+
+    for (k = 0; k < entries[i].delta; k++) {
+      if (registerFont (session, -1, entries[i].path) != REGFONT_OK)
+        break;
+      removed++;
+    }
+    if (k < entries[i].delta)
+      failed++;
+  }
+
+  if (removed > 0)
+    broadcastFontChange (session);
+
+  /* A font the table refuses to remove is no longer registered, so the
+   * journal starts afresh either way */
+  file = regfont_open_private (path, "wb");
+  if (!file || fclose (file) != 0) {
+    fprintf (stderr, "ERROR: Could not clear session journal %s\n", path);
+    retval = -1;
+  }
+
+  if (failed > 0)
+    msgprintf (session, stdout, "Removed %lu session fonts, %lu were no "
+        "longer registered\n", removed, failed);
+  else
+    msgprintf (session, stdout, "Removed %lu session fonts\n", removed);
+
+  for (i = 0; i < live; i++)
+    free (entries[i].path);
+  free (entries);
+  return retval;
+}
@@ -0,0 +1,1022 @@
+/* libregfont.c
+ * Font checking and registration for regfont, as a library.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Messages longer than this are formatted on the heap */
+#define REGFONT_MESSAGE_SIZE 1024
+
+static REGFONT_THREAD_LOCAL regfont_output *regfont_capture = NULL;
+
+/* Append a record to the current capture.  Each record is the stream
+ * it belongs to ('o' or 'e') followed by its text and a terminator. */
+static void captureOutput (FILE *stream, const char *fmt, va_list ap) {
+  regfont_output *output = regfont_capture;
+  va_list copy;
+  int len;
+
+  va_copy (copy, ap);
+  len = vsnprintf (NULL, 0, fmt, copy);
+  va_end (copy);
+  if (len < 0)
+    return;
+
+  if (output->len + (size_t) len + 2 > output->size) {
+    size_t size = output->size ? output->size : 256;
+    char *data;
+
+    while (output->len + (size_t) len + 2 > size)
+      size *= 2;
+    data = realloc (output->data, size);
+    if (!data)
+      return;
+    output->data = data;
+    output->size = size;
+  }
+
+  output->data[output->len++] = stream == stdout ? 'o' : 'e';
+  vsnprintf (output->data + output->len, (size_t) len + 1, fmt, ap);
+  output->len += (size_t) len + 1;
+}
+
+/* Messages go to the session's callback if it has one */
+static void deliverOutput (regfont_session *session, FILE *stream,
+    const char *text) {
+  if (session && session->options.message)
+    session->options.message (session->options.message_context,
+        stream != stdout, text);
+  else
+    fputs (text, stream);
+}
+
+static void replayOutput (regfont_session *session, regfont_output *output) {
+  size_t pos = 0;
+
+  while (pos < output->len) {
+    const char *text = output->data + pos + 1;
+    deliverOutput (session, output->data[pos] == 'o' ? stdout : stderr,
+        text);
+    pos += strlen (text) + 2;
+  }
+  output->len = 0;
+}
+
+void msgprintf (regfont_session *session, FILE *stream, const char *fmt,
+    ...) {
+  char buffer[REGFONT_MESSAGE_SIZE], *text = buffer;
+  va_list ap, copy;
+  int len;
+
+  va_start (ap, fmt);
+  if (regfont_capture) {
+    captureOutput (stream, fmt, ap);
+  } else if (!session || !session->options.message) {
+    vfprintf (stream, fmt, ap);
+  } else {
+    va_copy (copy, ap);
+    len = vsnprintf (buffer, sizeof (buffer), fmt, copy);
+    va_end (copy);
+    if (len >= (int) sizeof (buffer)) {
+      text = malloc ((size_t) len + 1);
+      if (text)
+        vsnprintf (text, (size_t) len + 1, fmt, ap);
+      else
+        text = buffer;
+    }
+    if (len >= 0)
+      deliverOutput (session, stream, text);
+    if (text != buffer)
+      free (text);
+  }
+  va_end (ap);
+}
+
+const char *errorString (int error) {
+  switch (error) {
+  case REGFONT_OK:
+    return "Success";
+  case REGFONT_INVALID_FONT_PATH:
+    return "Could not get full path for font";
+  case REGFONT_FONT_NOT_FOUND:
+    return "Font not found";
+  case REGFONT_FULL_FONT_PATH_TOO_LONG:
+    return "Full path for font too long";
+  case REGFONT_FONT_IS_DIRECTORY:
+    return "Font is directory";
+  case REGFONT_NOT_FONT_FILE:
+    return "Not a font file";
+  case REGFONT_NOT_POSTSCRIPT:
+    return "Not a PostScript font";
+  case REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY:
+    return "PostScript font specified incorrectly";
+  case REGFONT_MISMATCHED_POSTSCRIPT_FILES:
+    return "pfm and pfb filenames must match";
+  case REGFONT_FONT_TABLE_FAILED:
+    return "System font table refused the font";
+  case REGFONT_BAD_REQUEST:
+    return "Bad request";
+  case REGFONT_CONTENT_MISMATCH:
+    return "File contents do not match its extension";
+  case REGFONT_CORRUPT_FONT:
+    return "Font file is corrupt";
+  case REGFONT_SKIPPED_DUPLICATE:
+    return "Skipped duplicate font";
+  default:
+    return "Unknown error";
+  }
+}
+
+/* Check name, making its full path in arena.  file, if given, is what is
+ * already known of the file, which is then not queried or read again. */
+static int checkFileIn (regfont_session *session, regfont_arena *arena,
+    regfont_view name, regfont_font_type type, regfont_format *detected,
+    const regfont_file_info *file) {
+  const regfont_stat_info *info = file && file->known ? &file->info : NULL;
+  regfont_stat_info queried;
+  regfont_view full;
+  char *fileextension;
+  regfont_font_type exttype;
+  unsigned long long start;
+  int retval;
+
+  dbtrace ("    Checking file...");
+
+  dbtrace ("    Getting full path...");
+  start = statsStart (session);
+  retval = fullPath (arena, name, &full);
+  statsRecord (session, REGFONT_PHASE_PATH, start);
+
+  if (retval == REGFONT_FULL_FONT_PATH_TOO_LONG) {
+    msgprintf (session, stderr, "ERROR: Full path for font too long: %.*s\n",
+        (int) name.len, name.data);
+    return retval;
+  } else if (retval != REGFONT_OK) {
+    msgprintf (session, stderr,
+        "ERROR: Could not get full path for font: %.*s\n",
+        (int) name.len, name.data);
+    return retval;
+  }
+  dbtrace ("    Full path: %s", full.data);
+
+  /* One query answers whether the file exists and is a directory */
+  if (!info) {
+    dbtrace ("    Querying file...");
+    start = statsStart (session);
+    if (regfont_stat (full.data, &queried) == 0)
+      info = &queried;
+    statsRecord (session, REGFONT_PHASE_STAT, start);
+  }
+  if (!info) {
+    msgprintf (session, stderr, "ERROR: Font not found: %.*s\n", (int) name.len,
+        name.data);
+    return REGFONT_FONT_NOT_FOUND;
+  }
+  dbtrace ("    File %.*s found", (int) name.len, name.data);
+
+  if (info->directory) {
+    msgprintf (session, stderr,
+        "ERROR: Font is directory: %.*s\n", (int) name.len,
+        name.data);
+    return REGFONT_FONT_IS_DIRECTORY;
+  }
+  dbtrace ("    File is not a directory");
+
+  dbtrace ("    Getting file extension...");
+  start = statsStart (session);
+  fileextension = PathFindExtension (full.data);
+  dbtrace ("    File extension found: %s", fileextension);
+
+  if (strlen (fileextension) > 0)
+    fileextension++;
+
+  dbtrace ("    Checking if file is a font...");
+  exttype = classifyExtension (fileextension);
+  statsRecord (session, REGFONT_PHASE_EXTENSION, start);
+  switch (type) {
+    case REGFONT_PFM:
+      if (exttype != REGFONT_PFM) {
+        if (exttype == REGFONT_PFB) {
+          msgprintf (session, stderr,
+              "ERROR: PostScript font specified incorrectly\n");
+          msgprintf (session, stderr,
+              "ERROR:     Use \"font.pfm|font.pfb\".\n");
+        } else {
+          msgprintf (session, stderr,
+              "ERROR: Not a PostScript font file: %.*s\n",
+              (int) name.len, name.data);
+          msgprintf (session, stderr,
+              "ERROR:     Extension of first file must be pfm\n");
+        }
+        return REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY;
+      }
+      break;
+    case REGFONT_PFB:
+      if (exttype != REGFONT_PFB) {
+        if (exttype == REGFONT_PFM) {
+          msgprintf (session, stderr,
+              "ERROR: PostScript font specified incorrectly\n");
+          msgprintf (session, stderr,
+              "ERROR:     Use \"font.pfm|font.pfb\".\n");
+        } else {
+          msgprintf (session, stderr,
+              "ERROR: Not a PostScript font file: %.*s\n",
+              (int) name.len, name.data);
+          msgprintf (session, stderr,
+              "ERROR:     Extension of second file must be pfb\n");
+        }
+        return REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY;
+      }
+      break;
+    case REGFONT_ANY:
+    default:
+      if (exttype != REGFONT_ANY) {
+        msgprintf (session, stderr, "ERROR: Not a font file: %.*s\n",
+            (int) name.len, name.data);
+        msgprintf (session, stderr,
+            "ERROR:     Extension of file must be one of:\n");
+        msgprintf (session, stderr,
+            "ERROR:     fon, fnt, ttf, ttc, fot, otf, mmm\n");
+        return REGFONT_NOT_FONT_FILE;
+      }
+      break;
+  }
+
+  if (session->options.strict) {
+    regfont_format format;
+
+    dbtrace ("    Checking file contents...");
+    start = statsStart (session);
+    format = file && file->hasheader ?
+      sniffFontHeader (file->header, file->headerlen, full.data) :
+      sniffFontFile (full.data);
+    dbtrace ("    File contents: %s", formatName (format));
+    if (detected)
+      *detected = format;
+    if (!extensionAllowsFormat (fileextension, format)) {
+      statsRecord (session, REGFONT_PHASE_CONTENTS, start);
+      msgprintf (session, stderr,
+          "ERROR: File contents do not match extension: "
+          "%.*s\n", (int) name.len, name.data);
+      msgprintf (session, stderr, "ERROR:     File contents look like: %s\n",
+          formatName (format));
+      return REGFONT_CONTENT_MISMATCH;
+    }
+
+    /* Every face of a collection must be sound, but only the headers
+     * are read */
+    retval = format == REGFONT_FORMAT_COLLECTION ?
+      checkCollection (session, full.data, name) : REGFONT_OK;
+    statsRecord (session, REGFONT_PHASE_CONTENTS, start);
+    if (retval != REGFONT_OK)
+      return retval;
+  }
+
+  if (session->options.verify && type == REGFONT_ANY) {
+    start = statsStart (session);
+    retval = verifyFontFile (session, full.data, name);
+    statsRecord (session, REGFONT_PHASE_VERIFY, start);
+    if (retval != REGFONT_OK)
+      return retval;
+  }
+
+  dbtrace ("    File is a font");
+  dbtrace ("    Completed checking file");
+
+  return REGFONT_OK;
+}
+
+/* Paths made by a check are gone when it returns, so checks in the
+ * steady state allocate nothing */
+int checkFile (regfont_session *session, regfont_view name,
+    regfont_font_type type, regfont_format *detected,
+    const regfont_file_info *file) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  int retval = checkFileIn (session, &regfont_path_arena, name, type,
+      detected, file);
+
+  arenaRelease (&regfont_path_arena, mark);
+  return retval;
+}
+
+/* spec, if given, is what is already known of the two files.  The
+ * halves are checked where they lie in filename, without copying. */
+int checkPostScriptFile (regfont_session *session, const char *filename,
+    regfont_format *detected, regfont_spec_info *spec) {
+  const char *pipe_pos;
+  regfont_view pfm, pfb, pfmstem, pfbstem;
+  unsigned long long start;
+  int retval;
+
+  dbtrace ("    Checking for PostScript font...");
+
+  pipe_pos = strchr (filename, '|');
+  if (!pipe_pos) {
+    dbtrace ("    Not a PostScript font (no '|' character found)");
+    return REGFONT_NOT_POSTSCRIPT;
+  }
+  dbtrace ("    PostScript font found ('|' character found)");
+  start = statsStart (session);
+
+  pfm.data = filename;
+  pfm.len = (size_t) (pipe_pos - filename);
+  dbtrace ("    pfm file: %.*s", (int) pfm.len, pfm.data);
+  pfb = viewOf (pipe_pos + 1);
+  dbtrace ("    pfb file: %s", pfb.data);
+
+  retval = checkFile (session, pfm, REGFONT_PFM, detected,
+      spec ? &spec->file[0] : NULL);
+  if (retval != REGFONT_OK) {
+    statsRecordFile (session, REGFONT_PHASE_POSTSCRIPT, start, filename);
+    dbtrace ("    PostScript font check complete");
+    return retval;
+  }
+
+  retval = checkFile (session, pfb, REGFONT_PFB, NULL,
+      spec ? &spec->file[1] : NULL);
+  if (retval != REGFONT_OK) {
+    statsRecordFile (session, REGFONT_PHASE_POSTSCRIPT, start, filename);
+    dbtrace ("    PostScript font check complete");
+    return retval;
+  }
+
+  dbtrace ("    Checking if pfm matches pfb...");
+  pfmstem = viewStem (pfm);
+  pfbstem = viewStem (pfb);
+  statsRecordFile (session, REGFONT_PHASE_POSTSCRIPT, start, filename);
+  if (!asciiCaseEqual (pfmstem, pfbstem)) {
+    msgprintf (session, stderr,
+        "ERROR: PostScript font specified incorrectly\n");
+    msgprintf (session, stderr, "ERROR:     pfm and pfb filenames must match "
+        "(%.*s != %.*s)\n", (int) pfmstem.len, pfmstem.data,
+        (int) pfbstem.len, pfbstem.data);
+    dbtrace ("    PostScript font check complete");
+    return REGFONT_MISMATCHED_POSTSCRIPT_FILES;
+  }
+  dbtrace ("    pfm file matches pfb file");
+
+  dbtrace ("    PostScript font check complete");
+  return retval;
+}
+
+/* spec, if given, is what is already known of the files of the font,
+ * and is filled in further as they are checked */
+static int checkFontFile (regfont_session *session, char *filename,
+    regfont_spec_info *spec) {
+  regfont_cache_entry key;
+  regfont_spec_info unknown;
+  regfont_format format = REGFONT_FORMAT_UNKNOWN;
+  unsigned long long start = statsStart (session), lookup;
+  int retval, hit = 0;
+
+  dbtrace ("    Checking font...");
+
+  if (!spec) {
+    unknown.file[0].known = unknown.file[0].hasheader = 0;
+    unknown.file[1].known = unknown.file[1].hasheader = 0;
+    spec = &unknown;
+  }
+
+  if (session->cache) {
+    lookup = statsStart (session);
+    hit = cacheLookup (session, filename, &key, &retval, spec);
+    statsRecord (session, REGFONT_PHASE_CACHE, lookup);
+  }
+  if (hit) {
+    if (retval != REGFONT_OK)
+      msgprintf (session, stderr,
+          "ERROR: %s: %s\n", errorString (retval), filename);
+    statsRecordFile (session, REGFONT_PHASE_CHECK, start, filename);
+    dbtrace ("    Font check complete");
+    return retval;
+  }
+
+  retval = checkPostScriptFile (session, filename, &format, spec);
+
+  if (retval == REGFONT_NOT_POSTSCRIPT)
+    retval = checkFile (session, viewOf (filename), REGFONT_ANY, &format,
+        &spec->file[0]);
+
+  if (session->cache)
+    cacheStore (session, &key, retval, format);
+
+  statsRecordFile (session, REGFONT_PHASE_CHECK, start, filename);
+  dbtrace ("    Font check complete");
+  return retval;
+}
+
+/* Register or unregister a font that has already been checked.  The
+ * font table is given the full path the check used. */
+int registerFont (regfont_session *session, int remove, char *filename) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  regfont_view full;
+  unsigned long long start;
+  int retval, done;
+
+  retval = fullSpecPath (&regfont_path_arena, filename, &full);
+  if (retval != REGFONT_OK) {
+    msgprintf (session, stderr, "ERROR: Could not get full path for font: %s\n",
+        filename);
+    goto cleanup;
+  }
+
+  if (remove) {
+    dbtrace ("    Removing font from system font table...");
+    start = statsStart (session);
+    done = session->backend.removeFont (&session->backend, full.data);
+    statsRecordFile (session, REGFONT_PHASE_REGISTER, start, filename);
+    if (done == 0) {
+      msgprintf (session, stderr,
+          "ERROR: Removing %s from system font table failed\n",
+          filename);
+      retval = REGFONT_FONT_TABLE_FAILED;
+      goto cleanup;
+    }
+    journalFont (session, remove, full.data);
+    regfont_atomic_add (&session->removed, 1);
+    msgprintf (session, stdout, "Successfully removed font: %s\n", filename);
+  } else {
+    dbtrace ("    Adding font to system font table...");
+    start = statsStart (session);
+    done = session->backend.addFont (&session->backend, full.data);
+    statsRecordFile (session, REGFONT_PHASE_REGISTER, start, filename);
+    if (done == 0) {
+      msgprintf (session, stderr,
+          "ERROR: Adding %s to system font table failed\n",
+          filename);
+      retval = REGFONT_FONT_TABLE_FAILED;
+      goto cleanup;
+    }
+    journalFont (session, remove, full.data);
+    regfont_atomic_add (&session->added, 1);
+    msgprintf (session, stdout, "Successfully added font: %s\n", filename);
+  }
+
+  regfont_atomic_add (&session->pending, 1);
+
+cleanup:
+  arenaRelease (&regfont_path_arena, mark);
+  return retval;
+}
+
+/* One font at a time, as the server and --batch take them.  With
+ * --dedup an added font with the contents of one already seen is
+ * skipped, as processFonts skips it, until finishDuplicates, and
+ * REGFONT_SKIPPED_DUPLICATE returned.  A font
+ * that is removed is forgotten, so a later copy of it is added. */
+static int changeFont (regfont_session *session, int remove,
+    char *filename) {
+  regfont_fingerprint fingerprint;
+  int retval;
+
+  dbtrace ("Trying to %s font: %s", remove ? "remove" : "add", filename);
+  fingerprint.valid = 0;
+  retval = checkFontFile (session, filename, NULL);
+  if (retval == REGFONT_OK && session->options.dedup)
+    fingerprintFont (filename, &fingerprint);
+  if (!remove && duplicateOf (session, filename, &fingerprint)) {
+    session->skipped++;
+    return REGFONT_SKIPPED_DUPLICATE;
+  }
+  if (retval == REGFONT_OK)
+    retval = registerFont (session, remove, filename);
+  if (retval == REGFONT_OK && remove)
+    forgetDuplicate (session, filename, &fingerprint);
+  if (retval != REGFONT_OK)
+    session->failed++;
+  return retval;
+}
+
+int addFont (regfont_session *session, char *filename) {
+  return changeFont (session, 0, filename);
+}
+
+int removeFont (regfont_session *session, char *filename) {
+  return changeFont (session, -1, filename);
+}
+
+/* Fonts are checked in parallel, a batch at a time, while the previous
+ * batch is reported in order and, for backends that need it,
+ * registered one at a time. */
+#define REGFONT_JOBS_PER_THREAD 16
+
+/* With --prefetch, batches are at least this large, so that each keeps
+ * the storage queue busy */
+#define REGFONT_PREFETCH_BATCH 256
+
+typedef struct {
+  char *filename;
+  size_t offset;
+  regfont_spec_info spec;
+  int status;
+  int registered;
+  regfont_fingerprint fingerprint;
+  regfont_output output;
+} regfont_job;
+
+typedef struct {
+  regfont_session *session;
+  regfont_job *jobs;
+  size_t count;
+  size_t first;
+  int remove;
+  char *names;
+  size_t names_len;
+  size_t names_size;
+  char *paths;
+  size_t paths_size;
+  regfont_prefetch_request *requests;
+} regfont_batch;
+
+static void checkJob (void *arg, size_t i) {
+  regfont_batch *batch = arg;
+  regfont_session *session = batch->session;
+  regfont_job *job = &batch->jobs[i];
+
+  regfont_capture = &job->output;
+
+  dbtrace ("Trying to %s font: %s", batch->remove ? "remove" : "add",
+      job->filename);
+  job->status = checkFontFile (session, job->filename, &job->spec);
+  job->registered = 0;
+  job->fingerprint.valid = 0;
+
+  /* Duplicates are decided in order, so that the first copy wins */
+  if (job->status == REGFONT_OK && session->options.dedup)
+    fingerprintFont (job->filename, &job->fingerprint);
+  else if (job->status == REGFONT_OK && !session->backend.serialized) {
+    job->status = registerFont (session, batch->remove, job->filename);
+    job->registered = -1;
+  }
+
+  regfont_capture = NULL;
+}
+
+/* What is known of a font to begin with is what its source knows */
+static void startSpec (regfont_spec_info *spec, regfont_source *fonts,
+    const char *filename) {
+  spec->file[0].hasheader = spec->file[1].hasheader = 0;
+  spec->file[0].known = !strchr (filename, '|') &&
+    sourceInfo (fonts, &spec->file[0].info) == 0;
+  spec->file[1].known = 0;
+}
+
+/* Copy up to chunk fonts from the source into the batch, which owns
+ * the copies until it is filled again */
+static size_t fillBatch (regfont_batch *batch, regfont_source *fonts,
+    size_t chunk) {
+  char *filename;
+  size_t i;
+
+  batch->count = 0;
+  batch->names_len = 0;
+
+  while (batch->count < chunk && (filename = fonts->next (fonts)) != NULL) {
+    size_t len = strlen (filename) + 1;
+
+    if (batch->names_len + len > batch->names_size) {
+      size_t size = batch->names_size ? batch->names_size : 4096;
+      char *names;
+
+      while (batch->names_len + len > size)
+        size *= 2;
+      names = realloc (batch->names, size);
+      if (!names) {
+        fprintf (stderr, "ERROR: Out of memory\n");
+        break;
+      }
+      batch->names = names;
+      batch->names_size = size;
+    }
+
+    memcpy (batch->names + batch->names_len, filename, len);
+    startSpec (&batch->jobs[batch->count].spec, fonts, filename);
+    batch->jobs[batch->count++].offset = batch->names_len;
+    batch->names_len += len;
+  }
+
+  for (i = 0; i < batch->count; i++)
+    batch->jobs[i].filename = batch->names + batch->jobs[i].offset;
+
+  return batch->count;
+}
+
+/* Queue the files of a batch for the prefetcher.  Headers are read only
+ * with -s, and only of files the check would sniff.  Specifications
+ * with more than one '|' are left for checkFontFile to reject. */
+static void prefetchBatch (regfont_prefetcher *prefetcher,
+    regfont_batch *batch) {
+  size_t i, n = 0;
+
+  if (batch->names_len > batch->paths_size) {
+    char *paths = realloc (batch->paths, batch->names_size);
+
+    if (!paths)
+      return;
+    batch->paths = paths;
+    batch->paths_size = batch->names_size;
+  }
+  memcpy (batch->paths, batch->names, batch->names_len);
+
+  for (i = 0; i < batch->count; i++) {
+    regfont_job *job = &batch->jobs[i];
+    char *path = batch->paths + job->offset;
+    char *pipe_pos = strchr (path, '|');
+    int part;
+
+    if (pipe_pos && strchr (pipe_pos + 1, '|'))
+      continue;
+    if (pipe_pos)
+      *pipe_pos = '\0';
+
+    for (part = 0; part < (pipe_pos ? 2 : 1); part++) {
+      regfont_prefetch_request *request = &batch->requests[n++];
+      const char *extension;
+      regfont_font_type type;
+
+      request->path = part == 0 ? path : pipe_pos + 1;
+      request->file = &job->spec.file[part];
+      extension = PathFindExtension (request->path);
+      type = classifyExtension (*extension ? extension + 1 : extension);
+      request->header = batch->session->options.strict && type ==
+        (!pipe_pos ? REGFONT_ANY : part == 0 ? REGFONT_PFM : REGFONT_PFB);
+    }
+  }
+
+  prefetchFiles (prefetcher, batch->requests, n);
+}
+
+/* Record the outcome of the index'th font of a call */
+static void noteResult (regfont_session *session, int *results, size_t index,
+    int status) {
+  if (results)
+    results[index] = status;
+  if (status != REGFONT_OK)
+    session->failed++;
+}
+
+static void finishBatch (regfont_batch *batch, int *results) {
+  regfont_session *session = batch->session;
+  size_t i;
+
+  for (i = 0; i < batch->count; i++) {
+    regfont_job *job = &batch->jobs[i];
+
+    replayOutput (session, &job->output);
+    if (job->status == REGFONT_OK && !job->registered) {
+      if (session->options.dedup &&
+          duplicateOf (session, job->filename, &job->fingerprint))
+        session->skipped++;
+      else
+        job->status = registerFont (session, batch->remove, job->filename);
+    }
+    noteResult (session, results, batch->first + i, job->status);
+  }
+  fflush (stdout);
+}
+
+/* results, if given, gets the error code of each font in the order they
+ * came.  The threads, and the prefetcher, are kept for later calls. */
+void processFonts (regfont_session *session, int remove,
+    regfont_source *fonts, int *results) {
+  regfont_batch batches[2], *current, *next;
+  regfont_prefetcher *prefetcher = NULL;
+  char *filename;
+  size_t chunk, done = 0, i;
+  int jobs = session->jobs;
+  unsigned long queries = regfont_stat_count ();
+
+  /* Prefetching overlaps a single checking thread with the reads too */
+  if (!session->pool && (jobs > 1 || session->options.prefetch))
+    session->pool = regfont_pool_create (jobs);
+
+  if (!session->pool) {
+    while ((filename = fonts->next (fonts)) != NULL) {
+      regfont_fingerprint fingerprint;
+      regfont_spec_info spec;
+      int status;
+
+      dbtrace ("Trying to %s font: %s", remove ? "remove" : "add",
+          filename);
+      startSpec (&spec, fonts, filename);
+      status = checkFontFile (session, filename, &spec);
+      if (status == REGFONT_OK && session->options.dedup &&
+          fingerprintFont (filename, &fingerprint) == 0 &&
+          duplicateOf (session, filename, &fingerprint))
+        session->skipped++;
+      else if (status == REGFONT_OK)
+        status = registerFont (session, remove, filename);
+      noteResult (session, results, done++, status);
+    }
+    dbprintf ("Made %lu file metadata queries",
+        regfont_stat_count () - queries);
+    return;
+  }
+
+  dbprintf ("Checking fonts with %d threads", jobs);
+  chunk = (size_t) jobs * REGFONT_JOBS_PER_THREAD;
+  if (session->options.prefetch) {
+    if (!session->prefetcher)
+      session->prefetcher = prefetchCreate (jobs);
+    prefetcher = session->prefetcher;
+    if (prefetcher && chunk < REGFONT_PREFETCH_BATCH)
+      chunk = REGFONT_PREFETCH_BATCH;
+  }
+  memset (batches, 0, sizeof (batches));
+  for (i = 0; i < 2; i++) {
+    batches[i].session = session;
+    batches[i].jobs = calloc (chunk, sizeof (regfont_job));
+    batches[i].requests = calloc (chunk * 2,
+        sizeof (regfont_prefetch_request));
+    batches[i].remove = remove;
+  }
+  if (!batches[0].jobs || !batches[1].jobs || !batches[0].requests ||
+      !batches[1].requests) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    goto cleanup;
+  }
+
+  current = &batches[0];
+  next = &batches[1];
+
+  if (fillBatch (current, fonts, chunk) > 0) {
+    if (prefetcher)
+      prefetchBatch (prefetcher, current);
+    regfont_pool_start (session->pool, checkJob, current, current->count);
+  }
+
+  /* The next batch is read, and prefetched, while this one is checked */
+  while (current->count > 0) {
+    regfont_batch *swap;
+
+    next->first = current->first + current->count;
+    if (fillBatch (next, fonts, chunk) > 0 && prefetcher)
+      prefetchBatch (prefetcher, next);
+
+    regfont_pool_wait (session->pool);
+
+    if (next->count > 0)
+      regfont_pool_start (session->pool, checkJob, next, next->count);
+
+    finishBatch (current, results);
+    current->count = 0;
+
+    swap = current;
+    current = next;
+    next = swap;
+  }
+
+cleanup:
+  for (i = 0; i < 2; i++) {
+    size_t j;
+    for (j = 0; batches[i].jobs && j < chunk; j++)
+      free (batches[i].jobs[j].output.data);
+    free (batches[i].jobs);
+    free (batches[i].names);
+    free (batches[i].paths);
+    free (batches[i].requests);
+  }
+  dbprintf ("Made %lu file metadata queries", regfont_stat_count () - queries);
+}
+
+void addFonts (regfont_session *session, regfont_source *fonts) {
+  unsigned long long start = statsStart (session);
+
+  dbprintf ("Adding fonts: Starting");
+  processFonts (session, 0, fonts, NULL);
+  finishDuplicates (session);
+  dbprintf ("Adding fonts: Finished");
+
+  broadcastFontChange (session);
+  statsRecord (session, REGFONT_PHASE_ADD_FONTS, start);
+}
+
+void removeFonts (regfont_session *session, regfont_source *fonts) {
+  unsigned long long start = statsStart (session);
+
+  dbprintf ("Removing fonts: Starting");
+  processFonts (session, -1, fonts, NULL);
+  finishDuplicates (session);
+  dbprintf ("Removing fonts: Finished");
+
+  broadcastFontChange (session);
+  statsRecord (session, REGFONT_PHASE_REMOVE_FONTS, start);
+}
+
+const char *regfont_broadcast_names[] = {"send", "post", "timeout", "none"};
+
+/* Every change made so far is covered, broadcast or not */
+void broadcastFontChange (regfont_session *session) {
+  regfont_broadcast_strategy strategy = session->options.broadcast;
+  regfont_broadcast_result result = {0, 0, 0};
+  unsigned long long start, phase;
+
+  regfont_atomic_store (&session->pending, 0);
+  if (strategy == REGFONT_BROADCAST_NONE) {
+    dbprintf ("Skipping font change broadcast message");
+    return;
+  }
+
+  dbprintf ("Sending font change broadcast message");
+  phase = statsStart (session);
+  start = regfont_now_us ();
+  session->backend.broadcast (&session->backend, strategy,
+      session->options.broadcast_timeout, &result);
+  session->broadcasts++;
+  result.elapsed = regfont_now_us () - start;
+  statsRecord (session, REGFONT_PHASE_BROADCAST, phase);
+  dbprintf ("Font change broadcast message sent");
+
+  if (result.recipients)
+    msgprintf (session, stdout, "Font change broadcast (%s): %.3f ms, "
+        "%lu recipients, %lu timed out\n",
+        regfont_broadcast_names[strategy], result.elapsed / 1000.0,
+        result.recipients, result.timed_out);
+  else
+    msgprintf (session, stdout, "Font change broadcast (%s): %.3f ms\n",
+        regfont_broadcast_names[strategy], result.elapsed / 1000.0);
+}
+
+/* The library interface */
+
+void regfont_default_options (regfont_options *options) {
+  memset (options, 0, sizeof (regfont_options));
+  options->broadcast = REGFONT_BROADCAST_SEND;
+  options->broadcast_timeout = REGFONT_DEFAULT_BROADCAST_TIMEOUT;
+}
+
+static regfont_session *openSession (const regfont_options *options) {
+  regfont_session *session = calloc (1, sizeof (regfont_session));
+
+  if (!session) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+
+  session->options = *options;
+  session->options.backend = NULL;
+  session->options.cache = NULL;
+  session->options.journal = NULL;
+  session->options.trace = NULL;
+  session->jobs = options->jobs > 0 ? options->jobs : regfont_cpu_count ();
+  if (options->verify)
+    chooseChecksumKernel ();
+  regfont_mutex_init (&session->verified.lock);
+
+  if (options->stats && !(session->timings = openStats ()))
+    goto fail;
+  if (options->trace && !(session->tracer = openTrace (options->trace)))
+    goto fail;
+  if (selectBackend (&session->backend, options->backend ?
+        options->backend : REGFONT_DEFAULT_BACKEND) != 0)
+    goto fail;
+  session->backend.session = session;
+  if (options->cache && openCache (session, options->cache) != 0) {
+    finishBackend (&session->backend);
+    goto fail;
+  }
+
+  /* A journal that cannot be opened is reported but not fatal */
+  if (options->journal)
+    openJournal (session, options->journal);
+  return session;
+
+fail:
+  if (session->tracer)
+    closeTrace (session->tracer);
+  if (session->timings)
+    closeStats (session);
+  regfont_mutex_destroy (&session->verified.lock);
+  free (session);
+  return NULL;
+}
+
+/* Each call logs at the level of its session, as do the threads it
+ * starts, and leaves the caller's thread as it found it */
+regfont_session *regfont_session_open (const regfont_options *options) {
+  int level = regfont_debugging;
+  regfont_session *session;
+
+  startLog (options->log_level);
+  session = openSession (options);
+  regfont_debugging = level;
+  return session;
+}
+
+/* Duplicates are told apart within each call, as within each run of
+ * regfont.  Sources hand out the names they are given without changing
+ * them. */
+static int processArray (regfont_session *session, int remove,
+    const char *const *fonts, size_t n, int *results) {
+  unsigned long failed = session->failed;
+  regfont_source *source = argvSource (n, (char **) fonts);
+
+  if (!source)
+    return -1;
+  processFonts (session, remove, source, results);
+  closeSource (source);
+  finishDuplicates (session);
+  return (int) (session->failed - failed);
+}
+
+int regfont_session_add (regfont_session *session, const char *const *fonts,
+    size_t n, int *results) {
+  int level = regfont_debugging, failed;
+
+  regfont_debugging = session->options.log_level;
+  dbprintf ("Adding %lu fonts to session", (unsigned long) n);
+  failed = processArray (session, 0, fonts, n, results);
+  regfont_debugging = level;
+  return failed;
+}
+
+int regfont_session_remove (regfont_session *session,
+    const char *const *fonts, size_t n, int *results) {
+  int level = regfont_debugging, failed;
+
+  regfont_debugging = session->options.log_level;
+  dbprintf ("Removing %lu fonts from session", (unsigned long) n);
+  failed = processArray (session, -1, fonts, n, results);
+  regfont_debugging = level;
+  return failed;
+}
+
+static void flushSession (regfont_session *session) {
+  if (regfont_atomic_load (&session->pending) > 0)
+    broadcastFontChange (session);
+  else
+    dbprintf ("No font changes to broadcast");
+}
+
+void regfont_session_flush (regfont_session *session) {
+  int level = regfont_debugging;
+
+  regfont_debugging = session->options.log_level;
+  flushSession (session);
+  regfont_debugging = level;
+}
+
+void regfont_session_stats (regfont_session *session,
+    regfont_totals *stats) {
+  stats->added = (unsigned long) regfont_atomic_load (&session->added);
+  stats->removed = (unsigned long) regfont_atomic_load (&session->removed);
+  stats->failed = session->failed;
+  stats->skipped = session->skipped;
+  stats->broadcasts = session->broadcasts;
+  stats->pending = (unsigned long) regfont_atomic_load (&session->pending);
+}
+
+/* The totals are reported once the session's threads are done */
+void regfont_session_close (regfont_session *session) {
+  int level = regfont_debugging;
+
+  if (!session)
+    return;
+
+  regfont_debugging = session->options.log_level;
+  flushSession (session);
+  closeJournal (session);
+  closeCache (session);
+  finishBackend (&session->backend);
+  if (session->pool)
+    regfont_pool_destroy (session->pool);
+  prefetchDestroy (session->prefetcher);
+  if (session->options.verify)
+    printVerify (session);
+  regfont_mutex_destroy (&session->verified.lock);
+  if (session->timings)
+    closeStats (session);
+  if (session->tracer)
+    closeTrace (session->tracer);
+  free (session);
+  regfont_debugging = level;
+}
+
+const char *regfont_error_string (int error) {
+  return errorString (error);
+}
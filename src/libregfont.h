@@ -0,0 +1,142 @@
+/* libregfont.h
+ * Font registration for programs that embed regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A session holds a font table backend, and the validation cache,
+ * session journal and duplicate table it was opened with, for as long
+ * as the program keeps it open.  Fonts are added and removed in
+ * batches, and the font change broadcast is sent only when the program
+ * flushes the session, or closes it with changes not yet broadcast.
+ * Each session may be used by one thread at a time, and any number of
+ * sessions may be used at once.  Progress and errors are written to
+ * stdout and stderr, as regfont writes them, unless the session is
+ * given a callback for them. */
+
+#ifndef LIBREGFONT_H
+#define LIBREGFONT_H
+
+#include <stddef.h>
+
+/* Only these functions are exported when the library is built with
+ * hidden visibility */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define REGFONT_API __attribute__ ((visibility ("default")))
+#else
+#define REGFONT_API
+#endif
+
+enum REGFONT_ERRORS {
+  REGFONT_OK,
+  REGFONT_INVALID_FONT_PATH,
+  REGFONT_FONT_NOT_FOUND,
+  REGFONT_FULL_FONT_PATH_TOO_LONG,
+  REGFONT_FONT_IS_DIRECTORY,
+  REGFONT_NOT_FONT_FILE,
+  REGFONT_NOT_POSTSCRIPT,
+  REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY,
+  REGFONT_MISMATCHED_POSTSCRIPT_FILES,
+  REGFONT_FONT_TABLE_FAILED,
+  REGFONT_BAD_REQUEST,
+  REGFONT_CONTENT_MISMATCH,
+  REGFONT_CORRUPT_FONT,
+  REGFONT_SKIPPED_DUPLICATE
+};
+
+typedef enum REGFONT_BROADCAST_STRATEGIES {
+  REGFONT_BROADCAST_SEND,
+  REGFONT_BROADCAST_POST,
+  REGFONT_BROADCAST_TIMEOUT,
+  REGFONT_BROADCAST_NONE
+} regfont_broadcast_strategy;
+
+#define REGFONT_DEFAULT_BROADCAST_TIMEOUT 1000
+
+/* Takes a session's progress, and what is wrong with each font, in
+ * place of stdout and stderr.  text is a whole line, newline included;
+ * error is set for what regfont writes to stderr.  It is called only
+ * on the thread that called into the session. */
+typedef void (*regfont_message_fn) (void *context, int error,
+    const char *text);
+
+/* What a session does, as the command line options of the same names
+ * set it.  Strings are only read by regfont_session_open.  log_level
+ * is the session's debug logging to stderr: 0 for none, 1 for
+ * progress, 2 to also trace each font.  The phase timings of stats and
+ * the totals of verify are printed, and the trace file written, when
+ * the session closes.  Messages go to stdout and stderr unless message
+ * is set. */
+typedef struct {
+  const char *backend;
+  int strict;
+  int verify;
+  int dedup;
+  int jobs;
+  int prefetch;
+  const char *cache;
+  const char *journal;
+  regfont_broadcast_strategy broadcast;
+  unsigned long broadcast_timeout;
+  int log_level;
+  int stats;
+  const char *trace;
+  regfont_message_fn message;
+  void *message_context;
+} regfont_options;
+
+/* pending is the number of changes not yet broadcast */
+typedef struct {
+  unsigned long added;
+  unsigned long removed;
+  unsigned long failed;
+  unsigned long skipped;
+  unsigned long broadcasts;
+  unsigned long pending;
+} regfont_totals;
+
+typedef struct regfont_session regfont_session;
+
+/* The platform's font table, with neither cache nor journal, checking
+ * with a thread per CPU and sending the broadcast */
+REGFONT_API void regfont_default_options (regfont_options *options);
+
+/* Returns NULL, after saying why, if the backend, cache or trace file
+ * cannot be opened */
+REGFONT_API regfont_session *regfont_session_open (
+    const regfont_options *options);
+
+/* Check and register, or unregister, n font specifications in the
+ * order given.  results, if given, gets the error code of each.
+ * Returns the number that failed, or -1 if out of memory. */
+REGFONT_API int regfont_session_add (regfont_session *session,
+    const char *const *fonts, size_t n, int *results);
+REGFONT_API int regfont_session_remove (regfont_session *session,
+    const char *const *fonts, size_t n, int *results);
+
+/* Broadcast the changes made since the last broadcast, if any */
+REGFONT_API void regfont_session_flush (regfont_session *session);
+
+REGFONT_API void regfont_session_stats (regfont_session *session,
+    regfont_totals *stats);
+
+/* Flushes the session, then saves the cache and closes the journal.
+ * Fonts stay registered. */
+REGFONT_API void regfont_session_close (regfont_session *session);
+
+REGFONT_API const char *regfont_error_string (int error);
+
+#endif
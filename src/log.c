@@ -0,0 +1,190 @@
+/* log.c
+ * Asynchronous debug logging for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Records are formatted by the thread that logs them into a bounded
+ * ring of slots, and written to stderr by a writer thread, which
+ * flushes only when it has caught up.  Each slot carries a sequence
+ * number that says whether it is free for the producer claiming
+ * position pos (seq == pos) or holds the record for it (seq == pos + 1),
+ * so producers claim slots with a single compare and swap and never
+ * take a lock.  A producer that finds the ring full yields until the
+ * writer frees a slot, so no record is lost. */
+#define LOG_SLOTS 1024
+#define LOG_RECORD 1024
+
+/* How long the writer sleeps when the ring is empty */
+#define LOG_IDLE_US 1000
+
+typedef struct {
+  regfont_atomic seq;
+  char text[LOG_RECORD];
+} log_slot;
+
+static log_slot *regfont_log_slots = NULL;
+static regfont_atomic regfont_log_head = 0;
+static long regfont_log_tail = 0;
+static regfont_atomic regfont_log_stop = 0;
+static regfont_atomic regfont_log_threads = 0;
+static regfont_thread regfont_log_writer;
+static REGFONT_THREAD_LOCAL long regfont_log_thread = 0;
+static regfont_once regfont_log_once = REGFONT_ONCE_INIT;
+
+/* Write every record that is ready.  Returns how many there were. */
+static unsigned long drainLog (void) {
+  unsigned long count = 0;
+
+  for (;;) {
+    log_slot *slot = &regfont_log_slots[regfont_log_tail & (LOG_SLOTS - 1)];
+
+    if (regfont_atomic_load (&slot->seq) != regfont_log_tail + 1)
+      break;
+    fputs (slot->text, stderr);
+    regfont_atomic_store (&slot->seq, regfont_log_tail + LOG_SLOTS);
+    regfont_log_tail++;
+    count++;
+  }
+  if (count > 0)
+    fflush (stderr);
+  return count;
+}
+
+static void logWriter (void *arg) {
+  (void) arg;
+
+  while (!regfont_atomic_load (&regfont_log_stop)) {
+    if (drainLog () == 0)
+      regfont_sleep_us (LOG_IDLE_US);
+  }
+}
+
+static void stopLog (void) {
+  if (!regfont_log_slots)
+    return;
+  regfont_atomic_store (&regfont_log_stop, 1);
+  regfont_thread_join (regfont_log_writer);
+  drainLog ();
+  free (regfont_log_slots);
+  regfont_log_slots = NULL;
+}
+
+static void startWriter (void) {
+  long i;
+
+  regfont_log_slots = malloc (LOG_SLOTS * sizeof (log_slot));
+  if (!regfont_log_slots)
+    return;
+  for (i = 0; i < LOG_SLOTS; i++)
+    regfont_log_slots[i].seq = i;
+
+  if (regfont_thread_create (&regfont_log_writer, logWriter, NULL) != 0) {
+    free (regfont_log_slots);
+    regfont_log_slots = NULL;
+    return;
+  }
+  atexit (stopLog);
+}
+
+/* Log records up to level on the current thread, and those it starts.
+ * The writer is started the first time any thread asks for records;
+ * those logged before that, or if it cannot be started, are written
+ * directly. */
+void startLog (int level) {
+  regfont_debugging = level;
+  if (level > 0)
+    regfont_call_once (&regfont_log_once, startWriter);
+}
+
+/* Records from threads other than the first to log say which thread
+ * they came from */
+static int logPrefix (char *text, size_t size, int level) {
+  const char *name = level >= REGFONT_LOG_TRACE ? "TRACE" : "DEBUG";
+  long thread = regfont_log_thread;
+
+  if (thread == 0) {
+    long n;
+
+    do {
+      n = regfont_atomic_load (&regfont_log_threads);
+    } while (!regfont_atomic_cas (&regfont_log_threads, n, n + 1));
+    thread = regfont_log_thread = n + 1;
+  }
+
+  if (thread == 1)
+    return snprintf (text, size, "%s: ", name);
+  return snprintf (text, size, "%s[%ld]: ", name, thread);
+}
+
+static void logRecord (char *text, size_t size, int level, const char *fmt,
+    va_list ap) {
+  int len = logPrefix (text, size, level);
+
+  if (len < 0 || (size_t) len >= size - 1)
+    len = 0;
+  len += vsnprintf (text + len, size - (size_t) len - 1, fmt, ap) > 0 ?
+    (int) strlen (text + len) : 0;
+  text[len++] = '\n';
+  text[len] = '\0';
+}
+
+void logPrintf (int level, const char *fmt, ...) {
+  log_slot *slot;
+  va_list ap;
+  long pos;
+
+  va_start (ap, fmt);
+  if (!regfont_log_slots || regfont_atomic_load (&regfont_log_stop)) {
+    char text[LOG_RECORD];
+
+    logRecord (text, sizeof (text), level, fmt, ap);
+    fputs (text, stderr);
+    fflush (stderr);
+    va_end (ap);
+    return;
+  }
+
+  for (;;) {
+    long seq;
+
+    pos = regfont_atomic_load (&regfont_log_head);
+    slot = &regfont_log_slots[pos & (LOG_SLOTS - 1)];
+    seq = regfont_atomic_load (&slot->seq);
+    if (seq == pos) {
+      if (regfont_atomic_cas (&regfont_log_head, pos, pos + 1))
+        break;
+    } else if ((long) ((unsigned long) seq - (unsigned long) pos) < 0) {
+      regfont_yield ();
+    }
+  }
+
+  logRecord (slot->text, sizeof (slot->text), level, fmt, ap);
+  regfont_atomic_store (&slot->seq, pos + 1);
+  va_end (ap);
+}
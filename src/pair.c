@@ -0,0 +1,355 @@
+/* pair.c
+ * Automatic pairing of PostScript font files for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Loose .pfm and .pfb files are held back from the stream and grouped
+ * in a hash table by their base name, folded to lower case, while
+ * everything else passes straight through.  Once the stream ends, each
+ * .pfm is paired with the .pfb of the same name in the same directory,
+ * or failing that with the only .pfb of that name left anywhere, and
+ * the pairs follow the other fonts as "pfm|pfb" specifications.  Files
+ * left without a partner are reported. */
+
+typedef struct pair_file {
+  struct pair_file *next;
+  char *path;
+  size_t dirlen;
+} pair_file;
+
+typedef struct {
+  unsigned long long hash;
+  char *name;
+  pair_file *pfms;
+  pair_file *pfbs;
+} pair_group;
+
+typedef struct {
+  regfont_source *fonts;
+  pair_group *groups;
+  size_t ngroups;
+  size_t sizegroups;
+  size_t *slots;
+  size_t nslots;
+  pair_file *pairs;
+  pair_file **tail;
+  char *current;
+  unsigned long npairs;
+  unsigned long orphans;
+  int passed;
+  int done;
+} pair_state;
+
+/* The base name without its extension, folded to lower case */
+static char *foldedName (const char *path, size_t *dirlen) {
+  const char *name = path + strlen (path), *dot = PathFindExtension (path);
+  char *folded;
+  size_t i;
+
+  while (name > path && name[-1] != '/' && name[-1] != '\\')
+    name--;
+  *dirlen = (size_t) (name - path);
+
+  folded = malloc ((size_t) (dot - name) + 1);
+  if (!folded)
+    return NULL;
+  for (i = 0; name + i < dot; i++) {
+    char c = name[i];
+    folded[i] = c >= 'A' && c <= 'Z' ? (char) (c | 0x20) : c;
+  }
+  folded[i] = '\0';
+  return folded;
+}
+
+/* Returns the group for name, adding it if it is new.  name is taken
+ * over. */
+static pair_group *findGroup (pair_state *state, char *name) {
+  unsigned long long hash = hashContents ((const unsigned char *) name,
+      strlen (name), 0);
+  size_t i;
+
+  if ((state->ngroups + 1) * 2 > state->nslots) {
+    size_t nslots = state->nslots ? state->nslots * 2 : 1024;
+    size_t *slots = malloc (nslots * sizeof (size_t));
+
+    if (!slots)
+      return NULL;
+    for (i = 0; i < nslots; i++)
+      slots[i] = (size_t) -1;
+    for (i = 0; i < state->ngroups; i++) {
+      size_t j = (size_t) state->groups[i].hash & (nslots - 1);
+
+      while (slots[j] != (size_t) -1)
+        j = (j + 1) & (nslots - 1);
+      slots[j] = i;
+    }
+    free (state->slots);
+    state->slots = slots;
+    state->nslots = nslots;
+  }
+
+  for (i = (size_t) hash & (state->nslots - 1);
+      state->slots[i] != (size_t) -1; i = (i + 1) & (state->nslots - 1)) {
+    pair_group *group = &state->groups[state->slots[i]];
+
+    if (group->hash == hash && strcmp (group->name, name) == 0) {
+      free (name);
+      return group;
+    }
+  }
+
+  if (state->ngroups == state->sizegroups) {
+    size_t size = state->sizegroups ? state->sizegroups * 2 : 256;
+    pair_group *groups = realloc (state->groups, size * sizeof (pair_group));
+
+    if (!groups)
+      return NULL;
+    state->groups = groups;
+    state->sizegroups = size;
+  }
+  state->slots[i] = state->ngroups;
+  state->groups[state->ngroups].hash = hash;
+  state->groups[state->ngroups].name = name;
+  state->groups[state->ngroups].pfms = NULL;
+  state->groups[state->ngroups].pfbs = NULL;
+  return &state->groups[state->ngroups++];
+}
+
+/* Returns -1 if out of memory */
+static int holdFile (pair_state *state, const char *path, int pfb) {
+  pair_file *file = malloc (sizeof (pair_file)), **list;
+  pair_group *group;
+  char *name;
+
+  if (!file)
+    return -1;
+  name = foldedName (path, &file->dirlen);
+  file->path = strdup (path);
+  group = name ? findGroup (state, name) : NULL;
+  if (!group || !file->path) {
+    if (!group)
+      free (name);
+    free (file->path);
+    free (file);
+    return -1;
+  }
+
+  /* Keep each list in the order the files came */
+  for (list = pfb ? &group->pfbs : &group->pfms; *list;
+      list = &(*list)->next)
+    ;
+  file->next = NULL;
+  *list = file;
+  return 0;
+}
+
+static pair_file *takeFile (pair_file **list, pair_file *file) {
+  for ( ; *list != file; list = &(*list)->next)
+    ;
+  *list = file->next;
+  return file;
+}
+
+static void freeFile (pair_file *file) {
+  free (file->path);
+  free (file);
+}
+
+static int sameDirectory (const pair_file *a, const pair_file *b) {
+  return a->dirlen == b->dirlen &&
+#ifdef _WIN32
+    _strnicmp (a->path, b->path, a->dirlen) == 0;
+#else
+    strncmp (a->path, b->path, a->dirlen) == 0;
+#endif
+}
+
+/* Queue "pfm|pfb" for the consumer */
+static void addPair (pair_state *state, pair_file *pfm, pair_file *pfb) {
+  size_t pfmlen = strlen (pfm->path), pfblen = strlen (pfb->path);
+  pair_file *pair = malloc (sizeof (pair_file));
+
+  if (pair)
+    pair->path = malloc (pfmlen + pfblen + 2);
+  if (!pair || !pair->path) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    free (pair);
+  } else {
+    memcpy (pair->path, pfm->path, pfmlen);
+    pair->path[pfmlen] = '|';
+    memcpy (pair->path + pfmlen + 1, pfb->path, pfblen + 1);
+    pair->next = NULL;
+    *state->tail = pair;
+    state->tail = &pair->next;
+    state->npairs++;
+  }
+  freeFile (pfm);
+  freeFile (pfb);
+}
+
+static void pairGroup (pair_state *state, pair_group *group) {
+  pair_file *pfm, *pfb, *next;
+
+  for (pfm = group->pfms; pfm; pfm = next) {
+    next = pfm->next;
+    for (pfb = group->pfbs; pfb && !sameDirectory (pfm, pfb);
+        pfb = pfb->next)
+      ;
+    if (pfb)
+      addPair (state, takeFile (&group->pfms, pfm),
+          takeFile (&group->pfbs, pfb));
+  }
+
+  /* Archives that keep metrics and outlines in separate directories */
+  if (group->pfms && !group->pfms->next && group->pfbs &&
+      !group->pfbs->next) {
+    addPair (state, group->pfms, group->pfbs);
+    group->pfms = group->pfbs = NULL;
+  }
+
+  for ( ; group->pfms; group->pfms = next) {
+    next = group->pfms->next;
+    fprintf (stderr, "ERROR: No matching .pfb found for %s\n",
+        group->pfms->path);
+    state->orphans++;
+    freeFile (group->pfms);
+  }
+  for ( ; group->pfbs; group->pfbs = next) {
+    next = group->pfbs->next;
+    fprintf (stderr, "ERROR: No matching .pfm found for %s\n",
+        group->pfbs->path);
+    state->orphans++;
+    freeFile (group->pfbs);
+  }
+}
+
+static char *pairNext (regfont_source *source) {
+  pair_state *state = source->data;
+  pair_file *pair;
+  char *spec;
+
+  free (state->current);
+  state->current = NULL;
+  state->passed = 0;
+
+  while (!state->done && (spec = state->fonts->next (state->fonts)) != NULL) {
+    const char *extension;
+    regfont_font_type type;
+
+    extension = PathFindExtension (spec);
+    type = classifyExtension (*extension ? extension + 1 : extension);
+    if (strchr (spec, '|') || (type != REGFONT_PFM && type != REGFONT_PFB)) {
+      state->passed = -1;
+      return spec;
+    }
+    if (holdFile (state, spec, type == REGFONT_PFB) != 0)
+      fprintf (stderr, "ERROR: Out of memory\n");
+  }
+
+  if (!state->done) {
+    size_t i;
+
+    state->done = 1;
+    for (i = 0; i < state->ngroups; i++)
+      pairGroup (state, &state->groups[i]);
+    dbprintf ("Paired %lu PostScript fonts, %lu files left without a "
+        "partner", state->npairs, state->orphans);
+  }
+
+  pair = state->pairs;
+  if (!pair)
+    return NULL;
+  state->pairs = pair->next;
+  state->current = pair->path;
+  free (pair);
+  return state->current;
+}
+
+/* Fonts passed straight through keep what their source knew of them */
+static int pairInfo (regfont_source *source, regfont_stat_info *info) {
+  pair_state *state = source->data;
+
+  return state->passed ? sourceInfo (state->fonts, info) : -1;
+}
+
+static void pairClose (regfont_source *source) {
+  pair_state *state = source->data;
+  size_t i;
+
+  if (state->npairs > 0 || state->orphans > 0)
+    printf ("PostScript pairing: %lu pairs, %lu orphans\n", state->npairs,
+        state->orphans);
+
+  for (i = 0; i < state->ngroups; i++) {
+    pair_file *file, *next;
+
+    for (file = state->groups[i].pfms; file; file = next) {
+      next = file->next;
+      freeFile (file);
+    }
+    for (file = state->groups[i].pfbs; file; file = next) {
+      next = file->next;
+      freeFile (file);
+    }
+    free (state->groups[i].name);
+  }
+  while (state->pairs) {
+    pair_file *next = state->pairs->next;
+
+    freeFile (state->pairs);
+    state->pairs = next;
+  }
+  free (state->current);
+  free (state->groups);
+  free (state->slots);
+  closeSource (state->fonts);
+  free (state);
+}
+
+/* Takes ownership of fonts */
+regfont_source *pairSource (regfont_source *fonts) {
+  pair_state *state = calloc (1, sizeof (pair_state));
+  regfont_source *source;
+
+  if (!state) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    closeSource (fonts);
+    return NULL;
+  }
+  state->fonts = fonts;
+  state->tail = &state->pairs;
+
+  source = newSource (pairNext, pairClose, state);
+  if (!source) {
+    closeSource (fonts);
+    free (state);
+  } else {
+    source->info = pairInfo;
+  }
+  return source;
+}
@@ -0,0 +1,243 @@
+/* path.c
+ * Path handling for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "regfont.h"
+
+/* Paths are only ever made while a font is checked, and all of them are
+ * done with when the check ends, so they are bumped out of an arena
+ * that each thread resets after every check rather than allocated and
+ * freed one by one.  The names given by the user are never copied: the
+ * halves of "pfm|pfb" are views into the specification itself. */
+
+struct regfont_arena_block {
+  regfont_arena_block *next;
+};
+
+REGFONT_THREAD_LOCAL regfont_arena regfont_path_arena;
+
+regfont_view viewOf (const char *string) {
+  regfont_view view;
+
+  view.data = string;
+  view.len = strlen (string);
+  return view;
+}
+
+static int isSeparator (char c) {
+#ifdef _WIN32
+  return c == '\\' || c == '/' || c == ':';
+#else
+  return c == '/';
+#endif
+}
+
+/* The file name, without its directory or extension, as PathStripPath
+ * and PathRemoveExtension would leave it */
+regfont_view viewStem (regfont_view path) {
+  const char *end = path.data + path.len, *name = end, *dot = NULL;
+  regfont_view stem;
+
+  while (name > path.data && !isSeparator (name[-1])) {
+    name--;
+    if (*name == '.' && !dot)
+      dot = name;
+  }
+
+  stem.data = name;
+  stem.len = (size_t) ((dot ? dot : end) - name);
+  return stem;
+}
+
+/* Returns NULL if out of memory */
+char *arenaAlloc (regfont_arena *arena, size_t size) {
+  regfont_arena_block *block;
+
+  if (size <= REGFONT_ARENA_SIZE - arena->used) {
+    char *p = arena->first + arena->used;
+
+    arena->used += size;
+    return p;
+  }
+
+  /* Too big for what is left of the first block, so it gets its own */
+  block = malloc (sizeof (regfont_arena_block) + size);
+  if (!block)
+    return NULL;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  return (char *) (block + 1);
+}
+
+regfont_arena_mark arenaMark (const regfont_arena *arena) {
+  regfont_arena_mark mark;
+
+  mark.used = arena->used;
+  mark.blocks = arena->blocks;
+  return mark;
+}
+
+/* Free everything allocated since mark was taken */
+void arenaRelease (regfont_arena *arena, regfont_arena_mark mark) {
+  while (arena->blocks != mark.blocks) {
+    regfont_arena_block *next = arena->blocks->next;
+
+    free (arena->blocks);
+    arena->blocks = next;
+  }
+  arena->used = mark.used;
+}
+
+#ifdef _WIN32
+
+/* Room for the \\?\UNC\ that long paths need */
+#define REGFONT_LONG_PREFIX 8
+
+/* Make name absolute, as a terminated string in arena.  Returns
+ * REGFONT_OK, REGFONT_INVALID_FONT_PATH or
+ * REGFONT_FULL_FONT_PATH_TOO_LONG. */
+int fullPath (regfont_arena *arena, regfont_view name, regfont_view *full) {
+  char *term, *buffer, *start;
+  unsigned long needed, len;
+
+  term = arenaAlloc (arena, name.len + 1);
+  if (!term || name.len == 0)
+    return REGFONT_INVALID_FONT_PATH;
+  memcpy (term, name.data, name.len);
+  term[name.len] = '\0';
+
+  needed = GetFullPathName (term, 0, NULL, NULL);
+  if (needed == 0)
+    return REGFONT_INVALID_FONT_PATH;
+  if (needed + REGFONT_LONG_PREFIX > REGFONT_PATH_LIMIT)
+    return REGFONT_FULL_FONT_PATH_TOO_LONG;
+
+  buffer = arenaAlloc (arena, needed + REGFONT_LONG_PREFIX);
+  if (!buffer)
+    return REGFONT_INVALID_FONT_PATH;
+  start = buffer + REGFONT_LONG_PREFIX;
+  len = GetFullPathName (term, needed, start, NULL);
+  if (len == 0 || len >= needed)
+    return REGFONT_INVALID_FONT_PATH;
+
+  /* Beyond MAX_PATH, file calls only take paths that skip parsing */
+  if (len >= MAX_PATH && strncmp (start, "\\\\?\\", 4) != 0) {
+    if (strncmp (start, "\\\\", 2) == 0) {
+      start -= REGFONT_LONG_PREFIX - 2;
+      len += REGFONT_LONG_PREFIX - 2;
+      memcpy (start, "\\\\?\\UNC\\", REGFONT_LONG_PREFIX);
+    } else {
+      start -= 4;
+      len += 4;
+      memcpy (start, "\\\\?\\", 4);
+    }
+  }
+
+  full->data = start;
+  full->len = len;
+  return REGFONT_OK;
+}
+
+#else
+
+/* Make name absolute, as a terminated string in arena.  Returns
+ * REGFONT_OK, REGFONT_INVALID_FONT_PATH or
+ * REGFONT_FULL_FONT_PATH_TOO_LONG. */
+int fullPath (regfont_arena *arena, regfont_view name, regfont_view *full) {
+  size_t cwdlen = 0, size;
+  char *buffer;
+
+  if (name.len == 0)
+    return REGFONT_INVALID_FONT_PATH;
+
+  if (name.data[0] == '/') {
+    buffer = arenaAlloc (arena, name.len + 1);
+    if (!buffer)
+      return REGFONT_INVALID_FONT_PATH;
+  } else {
+    /* The name goes straight after the working directory */
+    for (size = 256; ; size *= 2) {
+      buffer = arenaAlloc (arena, size + 1 + name.len + 1);
+      if (!buffer)
+        return REGFONT_INVALID_FONT_PATH;
+      if (getcwd (buffer, size))
+        break;
+      if (errno != ERANGE)
+        return REGFONT_INVALID_FONT_PATH;
+    }
+    cwdlen = strlen (buffer);
+    if (cwdlen > 0 && buffer[cwdlen - 1] != '/')
+      buffer[cwdlen++] = '/';
+  }
+
+  memcpy (buffer + cwdlen, name.data, name.len);
+  buffer[cwdlen + name.len] = '\0';
+  full->data = buffer;
+  full->len = cwdlen + name.len;
+
+  /* The kernel takes no longer path */
+  return full->len < PATH_MAX ? REGFONT_OK : REGFONT_FULL_FONT_PATH_TOO_LONG;
+}
+
+#endif
+
+/* Make each part of a font specification absolute, keeping the
+ * "font.pfm|font.pfb" form intact.  This is the name the font table and
+ * the journal get, so that a font beyond MAX_PATH is registered by the
+ * only name that reaches it.  Returns as fullPath does. */
+int fullSpecPath (regfont_arena *arena, const char *filename,
+    regfont_view *full) {
+  const char *pipe_pos = strchr (filename, '|');
+  regfont_view pfm, pfb;
+  char *joined;
+  int retval;
+
+  if (!pipe_pos)
+    return fullPath (arena, viewOf (filename), full);
+
+  pfm.data = filename;
+  pfm.len = (size_t) (pipe_pos - filename);
+  retval = fullPath (arena, pfm, &pfm);
+  if (retval == REGFONT_OK)
+    retval = fullPath (arena, viewOf (pipe_pos + 1), &pfb);
+  if (retval != REGFONT_OK)
+    return retval;
+
+  joined = arenaAlloc (arena, pfm.len + pfb.len + 2);
+  if (!joined)
+    return REGFONT_INVALID_FONT_PATH;
+  memcpy (joined, pfm.data, pfm.len);
+  joined[pfm.len] = '|';
+  memcpy (joined + pfm.len + 1, pfb.data, pfb.len + 1);
+  full->data = joined;
+  full->len = pfm.len + 1 + pfb.len;
+  return REGFONT_OK;
+}
@@ -0,0 +1,487 @@
+/* prefetch.c
+ * Batched file metadata and header reads for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* The files of a whole batch are queried, and with -s opened and their
+ * headers read, before its fonts are checked, while the checking threads
+ * are still busy with the batch before.  On Linux the requests for
+ * hundreds of files go to the kernel at once through io_uring, so the
+ * storage queue is kept full by one thread; anywhere else, or where
+ * io_uring is missing or forbidden, a pool of threads makes the same
+ * calls one at a time each.  What is learnt is left in each file's
+ * regfont_file_info, and anything that could not be learnt is left for
+ * the check to find out, with its usual error messages. */
+
+#if defined (HAVE_LINUX_IO_URING_H) && defined (HAVE_STATX)
+#define REGFONT_IO_URING 1
+#endif
+
+#ifdef REGFONT_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Submission queue entries; completions have twice as many */
+#define PREFETCH_ENTRIES 256
+
+/* Each request is the file's index shifted up, and the operation */
+#define PREFETCH_STATX 0
+#define PREFETCH_OPEN 1
+#define PREFETCH_READ 2
+#define PREFETCH_CLOSE 3
+
+typedef struct {
+  int fd;
+  unsigned int entries;
+  unsigned int inflight;
+  unsigned int unsent;
+  unsigned int queued;
+  unsigned int *sqhead;
+  unsigned int *sqtail;
+  unsigned int *sqmask;
+  unsigned int *sqarray;
+  unsigned int *cqhead;
+  unsigned int *cqtail;
+  unsigned int *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqring;
+  void *cqring;
+  size_t sqsize;
+  size_t cqsize;
+} prefetch_ring;
+#endif
+
+struct regfont_prefetcher {
+  regfont_pool *pool;
+  int threads;
+  regfont_prefetch_request *requests;
+#ifdef REGFONT_IO_URING
+  prefetch_ring *ring;
+  struct statx *statx;
+  int *fds;
+  size_t size;
+#endif
+};
+
+/* Threads that only wait on storage cost little, so the fallback keeps
+ * at least this many files in flight however few fonts are checked at
+ * once */
+#define PREFETCH_MIN_THREADS 8
+
+/* Fallback: each file queried and read by one of a pool of threads */
+
+static void prefetchFile (void *arg, size_t i) {
+  regfont_prefetcher *prefetcher = arg;
+  regfont_prefetch_request *request = &prefetcher->requests[i];
+  regfont_file_info *file = request->file;
+  long size;
+
+  if (!file->known)
+    file->known = regfont_stat (request->path, &file->info) == 0;
+  if (!request->header || (file->known && file->info.directory))
+    return;
+
+  size = regfont_read_file (request->path, 0, file->header,
+      REGFONT_SNIFF_SIZE);
+  if (size >= 0) {
+    file->headerlen = (size_t) size;
+    file->hasheader = -1;
+  }
+}
+
+#ifdef REGFONT_IO_URING
+
+/* There is no io_uring in the C library, so the ring is set up and
+ * driven by hand, as liburing would */
+static void closeRing (prefetch_ring *ring) {
+  if (ring->sqes)
+    munmap (ring->sqes, ring->entries * sizeof (struct io_uring_sqe));
+  if (ring->cqring && ring->cqring != ring->sqring)
+    munmap (ring->cqring, ring->cqsize);
+  if (ring->sqring)
+    munmap (ring->sqring, ring->sqsize);
+  close (ring->fd);
+  free (ring);
+}
+
+/* Returns NULL if the kernel cannot run statx, openat, read and close
+ * through a ring */
+static prefetch_ring *openRing (void) {
+  static const unsigned char ops[] = {IORING_OP_STATX, IORING_OP_OPENAT,
+    IORING_OP_READ, IORING_OP_CLOSE};
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  prefetch_ring *ring;
+  unsigned char *sq, *cq;
+  size_t i;
+  int fd, usable;
+
+  memset (&params, 0, sizeof (params));
+  fd = (int) syscall (__NR_io_uring_setup, PREFETCH_ENTRIES, &params);
+  if (fd < 0) {
+    dbprintf ("io_uring is not available: %s", strerror (errno));
+    return NULL;
+  }
+
+  probe = calloc (1, sizeof (struct io_uring_probe) +
+      256 * sizeof (struct io_uring_probe_op));
+  usable = probe && syscall (__NR_io_uring_register, fd,
+      IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (i = 0; usable && i < sizeof (ops); i++) {
+    usable = ops[i] <= probe->last_op &&
+      (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free (probe);
+  if (!usable) {
+    dbprintf ("io_uring cannot query and read files on this kernel");
+    close (fd);
+    return NULL;
+  }
+
+  ring = calloc (1, sizeof (prefetch_ring));
+  if (!ring) {
+    close (fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+  ring->sqsize = params.sq_off.array + params.sq_entries *
+    sizeof (unsigned int);
+  ring->cqsize = params.cq_off.cqes + params.cq_entries *
+    sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqsize > ring->sqsize)
+      ring->sqsize = ring->cqsize;
+    ring->cqsize = ring->sqsize;
+  }
+
+  ring->sqring = mmap (NULL, ring->sqsize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sqring == MAP_FAILED) {
+    ring->sqring = NULL;
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqring = ring->sqring;
+  } else {
+    ring->cqring = mmap (NULL, ring->cqsize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cqring == MAP_FAILED) {
+      ring->cqring = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  sq = ring->sqring;
+  cq = ring->cqring;
+  ring->sqhead = (unsigned int *) (sq + params.sq_off.head);
+  ring->sqtail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sqmask = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned int *) (sq + params.sq_off.array);
+  ring->cqhead = (unsigned int *) (cq + params.cq_off.head);
+  ring->cqtail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cqmask = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+
+fail:
+  dbprintf ("Could not map io_uring queues: %s", strerror (errno));
+  closeRing (ring);
+  return NULL;
+}
+
+/* Entries are queued, then published to the kernel, which may not take
+ * them all at once, then in flight until they complete.  There are
+ * never more than the queue holds, so completions cannot overflow. */
+static unsigned int ringFree (const prefetch_ring *ring) {
+  return ring->entries - ring->inflight - ring->unsent - ring->queued;
+}
+
+/* The next free submission entry, cleared.  The caller checks there is
+ * one. */
+static struct io_uring_sqe *ringEntry (prefetch_ring *ring) {
+  unsigned int tail = *ring->sqtail + ring->queued, index;
+  struct io_uring_sqe *sqe;
+
+  index = tail & *ring->sqmask;
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  ring->sqarray[index] = index;
+  ring->queued++;
+  return sqe;
+}
+
+/* Hand the queued entries to the kernel and, if wait is set, block
+ * until at least one completes.  Returns -1 if the ring has failed. */
+static int ringSubmit (prefetch_ring *ring, int wait) {
+  long submitted;
+
+  __atomic_store_n (ring->sqtail, *ring->sqtail + ring->queued,
+      __ATOMIC_RELEASE);
+  ring->unsent += ring->queued;
+  ring->queued = 0;
+
+  for (;;) {
+    submitted = syscall (__NR_io_uring_enter, ring->fd, ring->unsent,
+        wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted >= 0)
+      break;
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      dbprintf ("io_uring failed: %s", strerror (errno));
+      return -1;
+    }
+  }
+  ring->unsent -= (unsigned int) submitted;
+  ring->inflight += (unsigned int) submitted;
+  return 0;
+}
+
+static void ringComplete (regfont_prefetcher *prefetcher,
+    unsigned long long data, int res) {
+  size_t i = (size_t) (data >> 2);
+  regfont_file_info *file = prefetcher->requests[i].file;
+  struct statx *st = &prefetcher->statx[i];
+
+  switch (data & 3) {
+  case PREFETCH_STATX:
+    if (res == 0) {
+      file->info.size = (unsigned long long) st->stx_size;
+      file->info.mtime = (long long) st->stx_mtime.tv_sec * 1000000000LL +
+        st->stx_mtime.tv_nsec;
+      file->info.directory = S_ISDIR (st->stx_mode);
+      file->known = -1;
+    }
+    break;
+  case PREFETCH_OPEN:
+    prefetcher->fds[i] = res;
+    break;
+  case PREFETCH_READ:
+    if (res >= 0) {
+      file->headerlen = (size_t) res;
+      file->hasheader = -1;
+    }
+    break;
+  case PREFETCH_CLOSE:
+    /* A short or failed read cancels the close linked to it */
+    if (res == -ECANCELED)
+      close (prefetcher->fds[i]);
+    break;
+  }
+}
+
+static void ringReap (regfont_prefetcher *prefetcher) {
+  prefetch_ring *ring = prefetcher->ring;
+  unsigned int head = *ring->cqhead;
+
+  while (head != __atomic_load_n (ring->cqtail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+
+    ringComplete (prefetcher, cqe->user_data, cqe->res);
+    ring->inflight--;
+    head++;
+  }
+  __atomic_store_n (ring->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/* Queue the operations of pass for every file, as many at a time as the
+ * ring holds, and wait for them all.  The first pass queries and opens
+ * files, the second reads and closes those that opened.  Returns -1 if
+ * the ring has failed. */
+static int ringPass (regfont_prefetcher *prefetcher, size_t n, int pass) {
+  prefetch_ring *ring = prefetcher->ring;
+  size_t i = 0;
+
+  for (;;) {
+    for ( ; i < n; i++) {
+      regfont_prefetch_request *request = &prefetcher->requests[i];
+      struct io_uring_sqe *sqe, *link;
+      unsigned long long data = (unsigned long long) i << 2;
+
+      /* Both operations of a file go in together or not at all */
+      if (ringFree (ring) < 2)
+        break;
+
+      if (pass == 0) {
+        if (!request->file->known) {
+          sqe = ringEntry (ring);
+          sqe->opcode = IORING_OP_STATX;
+          sqe->fd = AT_FDCWD;
+          sqe->addr = (unsigned long long) (uintptr_t) request->path;
+          sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+          sqe->off = (unsigned long long) (uintptr_t) &prefetcher->statx[i];
+          sqe->user_data = data | PREFETCH_STATX;
+          regfont_atomic_add (&regfont_stat_calls, 1);
+        }
+        prefetcher->fds[i] = -1;
+        if (request->header) {
+          /* A FIFO must not stall the batch */
+          sqe = ringEntry (ring);
+          sqe->opcode = IORING_OP_OPENAT;
+          sqe->fd = AT_FDCWD;
+          sqe->addr = (unsigned long long) (uintptr_t) request->path;
+          sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+          sqe->user_data = data | PREFETCH_OPEN;
+        }
+      } else if (prefetcher->fds[i] >= 0) {
+        sqe = ringEntry (ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = prefetcher->fds[i];
+        sqe->addr = (unsigned long long) (uintptr_t) request->file->header;
+        sqe->len = REGFONT_SNIFF_SIZE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = data | PREFETCH_READ;
+        link = ringEntry (ring);
+        link->opcode = IORING_OP_CLOSE;
+        link->fd = prefetcher->fds[i];
+        link->user_data = data | PREFETCH_CLOSE;
+      }
+    }
+
+    if (ring->queued + ring->unsent + ring->inflight == 0)
+      return 0;
+    if (ringSubmit (ring, ring->inflight + ring->unsent > 0 ||
+          ring->queued > 0) != 0)
+      return -1;
+    ringReap (prefetcher);
+  }
+}
+
+static int ringPrefetch (regfont_prefetcher *prefetcher, size_t n) {
+  if (n > prefetcher->size) {
+    struct statx *st = realloc (prefetcher->statx, n * sizeof (struct statx));
+    int *fds;
+
+    if (st)
+      prefetcher->statx = st;
+    fds = st ? realloc (prefetcher->fds, n * sizeof (int)) : NULL;
+    if (!fds)
+      return -1;
+    prefetcher->fds = fds;
+    prefetcher->size = n;
+  }
+
+  if (ringPass (prefetcher, n, 0) != 0 || ringPass (prefetcher, n, 1) != 0)
+    return -1;
+  return 0;
+}
+
+#endif
+
+/* threads is the size of the pool to fall back on */
+regfont_prefetcher *prefetchCreate (int threads) {
+  regfont_prefetcher *prefetcher = calloc (1, sizeof (regfont_prefetcher));
+
+  if (!prefetcher) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  prefetcher->threads = threads > PREFETCH_MIN_THREADS ? threads :
+    PREFETCH_MIN_THREADS;
+#ifdef REGFONT_IO_URING
+  prefetcher->ring = openRing ();
+  if (prefetcher->ring) {
+    dbprintf ("Prefetching through io_uring, %u requests at a time",
+        prefetcher->ring->entries);
+    return prefetcher;
+  }
+#endif
+  prefetcher->pool = regfont_pool_create (prefetcher->threads);
+  if (!prefetcher->pool) {
+    fprintf (stderr, "ERROR: Could not start prefetching threads\n");
+    free (prefetcher);
+    return NULL;
+  }
+  dbprintf ("Prefetching with %d threads", prefetcher->threads);
+  return prefetcher;
+}
+
+const char *prefetchEngine (const regfont_prefetcher *prefetcher) {
+#ifdef REGFONT_IO_URING
+  if (prefetcher->ring)
+    return "io_uring";
+#endif
+  return "threads";
+}
+
+/* Fill in what can be learnt of n files, and read the first
+ * REGFONT_SNIFF_SIZE bytes of those whose header is asked for */
+void prefetchFiles (regfont_prefetcher *prefetcher,
+    regfont_prefetch_request *requests, size_t n) {
+  if (n == 0)
+    return;
+  prefetcher->requests = requests;
+
+#ifdef REGFONT_IO_URING
+  if (prefetcher->ring) {
+    if (ringPrefetch (prefetcher, n) == 0)
+      return;
+    /* Whatever the ring did not finish is left to the checks, and later
+     * batches go to threads */
+    closeRing (prefetcher->ring);
+    prefetcher->ring = NULL;
+    prefetcher->pool = regfont_pool_create (prefetcher->threads);
+    return;
+  }
+#endif
+  if (!prefetcher->pool)
+    return;
+  regfont_pool_start (prefetcher->pool, prefetchFile, prefetcher, n);
+  regfont_pool_wait (prefetcher->pool);
+}
+
+void prefetchDestroy (regfont_prefetcher *prefetcher) {
+  if (!prefetcher)
+    return;
+#ifdef REGFONT_IO_URING
+  if (prefetcher->ring)
+    closeRing (prefetcher->ring);
+  free (prefetcher->statx);
+  free (prefetcher->fds);
+#endif
+  if (prefetcher->pool)
+    regfont_pool_destroy (prefetcher->pool);
+  free (prefetcher);
+}
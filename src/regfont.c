@@ -20,283 +20,148 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-#include <windows.h>
-#include <shlwapi.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include "regfont.h"
+
 #ifdef __MINGW64_VERSION_MAJOR
 /* Turn on wildcard expansion for the mingw-w64 compiler */
 int _dowildcard = -1;
 #endif
 
-int regfont_debugging = 0;
-
-enum REGFONT_TASKS {
+/* What the session is opened with; the rest only concern the command
+ * line */
+regfont_options regfont_settings;
+const char *regfont_socket = NULL;
+unsigned long regfont_window = REGFONT_DEFAULT_WINDOW;
+int regfont_local = 0;
+char **regfont_directories = NULL;
+int regfont_ndirectories = 0;
+char *regfont_manifest = NULL;
+const char *regfont_index_path = NULL;
+const char *regfont_family = NULL;
+int regfont_undo_session = 0;
+const char *regfont_journal_path = NULL;
+const char *regfont_sync_manifest = NULL;
+int regfont_dry_run = 0;
+int regfont_pair = 0;
+
+/* Where the journal and socket are when not given, found once the
+ * options are known */
+char *regfont_default_journal = NULL;
+char *regfont_default_socket = NULL;
+
+typedef enum REGFONT_TASKS {
   REGFONT_TASK_ADD,
   REGFONT_TASK_REMOVE,
   REGFONT_TASK_HELP,
-  REGFONT_TASK_VERSION
+  REGFONT_TASK_VERSION,
+  REGFONT_TASK_BACKENDS,
+  REGFONT_TASK_SERVER,
+  REGFONT_TASK_INDEX,
+  REGFONT_TASK_SYNC,
+  REGFONT_TASK_INFO,
+  REGFONT_TASK_BATCH
 } regfont_task;
 
-typedef enum REGFONT_FONT_TYPES {
-  REGFONT_ANY,
-  REGFONT_PFB,
-  REGFONT_PFM
-} regfont_font_type;
-
-enum REGFONT_ERRORS {
-  REGFONT_OK,
-  REGFONT_INVALID_FONT_PATH,
-  REGFONT_FONT_NOT_FOUND,
-  REGFONT_FULL_FONT_PATH_TOO_LONG,
-  REGFONT_FONT_IS_DIRECTORY,
-  REGFONT_NOT_FONT_FILE,
-  REGFONT_NOT_POSTSCRIPT,
-  REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY,
-  REGFONT_MISMATCHED_POSTSCRIPT_FILES
-};
-
-void dbprintf (const char *fmt, ...) {
-  if (regfont_debugging) {
-    va_list ap;
-    va_start (ap, fmt);
-    fprintf (stderr, "DEBUG: ");
-    vfprintf (stderr, fmt, ap);
-    fprintf (stderr, "\n");
-    fflush (stderr);
-    va_end (ap);
-  }
+/* The level is regfont's own and its session's */
+void setLogLevel (int level) {
+  startLog (level);
+  regfont_settings.log_level = level;
 }
 
-int checkFile (char *filename, regfont_font_type type) {
-  char fullfilename[MAX_PATH] = "";
-  char *fileextension;
-  int retval = 0;
-
-  dbprintf ("    Checking file...");
-
-  dbprintf ("    Getting full path...");
-  retval = GetFullPathName (filename, MAX_PATH, fullfilename, NULL);
-  dbprintf ("    Full path: %s", fullfilename);
-
-  if (retval > MAX_PATH) {
-    fprintf (stderr, "ERROR: Full path for font too long: %s\n", filename);
-    return REGFONT_FULL_FONT_PATH_TOO_LONG;
-  } else if (retval == 0) {
-    fprintf (stderr, "ERROR: Could not get full path for font: %s\n", filename);
-    return REGFONT_INVALID_FONT_PATH;
-  }
-
-  dbprintf ("    Checking if file exists...");
-  if (!PathFileExists (fullfilename)) {
-    fprintf (stderr, "ERROR: Font not found: %s\n", filename);
-    return REGFONT_FONT_NOT_FOUND;
-  }
-  dbprintf ("    File %s found", filename);
+/* spec is send, post, none or timeout[:MS] */
+int parseBroadcast (const char *spec) {
+  int i;
+  size_t len = strcspn (spec, ":");
 
-  dbprintf ("    Checking if file is a directory...");
-  if (PathIsDirectory (fullfilename)) {
-    fprintf (stderr, "ERROR: Font is directory: %s\n", filename);
-    return REGFONT_FONT_IS_DIRECTORY;
-  }
-  dbprintf ("    File is not a directory");
-
-  dbprintf ("    Getting file extension...");
-  fileextension = PathFindExtension (fullfilename);
-  dbprintf ("    File extension found: %s", fileextension);
-
-  if (strlen (fileextension) > 0)
-    fileextension++;
-
-  dbprintf ("    Checking if file is a font...");
-  switch (type) {
-    case REGFONT_PFM:
-      if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "pfm", -1) != CSTR_EQUAL) {
-        if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "pfb", -1) == CSTR_EQUAL) {
-          fprintf (stderr, "ERROR: PostScript font specified incorrectly\n");
-          fprintf (stderr, "ERROR:     Use \"font.pfm|font.pfb\".\n");
-        } else {
-          fprintf (stderr, "ERROR: Not a PostScript font file: %s\n", filename);
-          fprintf (stderr, "ERROR:     Extension of first file must be pfm\n");
-        }
-        return REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY;
-      }
-      break;
-    case REGFONT_PFB:
-      if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "pfb", -1) != CSTR_EQUAL) {
-        if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "pfm", -1) == CSTR_EQUAL) {
-          fprintf (stderr, "ERROR: PostScript font specified incorrectly\n");
-          fprintf (stderr, "ERROR:     Use \"font.pfm|font.pfb\".\n");
-        } else {
-          fprintf (stderr, "ERROR: Not a PostScript font file: %s\n", filename);
-          fprintf (stderr, "ERROR:     Extension of second file must be pfb\n");
-        }
-        return REGFONT_POSTSCRIPT_FONT_SPECIFIED_INCORRECTLY;
-      }
-      break;
-    case REGFONT_ANY:
-    default:
-      if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "fon", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "fnt", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "ttf", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "ttc", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "fot", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "otf", -1) != CSTR_EQUAL &&
-          CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            fileextension, -1, "mmm", -1) != CSTR_EQUAL) {
-        fprintf (stderr, "ERROR: Not a font file: %s\n", filename);
-        fprintf (stderr, "ERROR:     Extension of file must be one of:\n");
-        fprintf (stderr, "ERROR:     fon, fnt, ttf, ttc, fot, otf, mmm\n");
-        return REGFONT_NOT_FONT_FILE;
-      }
+  for (i = 0; i <= REGFONT_BROADCAST_NONE; i++) {
+    if (strlen (regfont_broadcast_names[i]) == len &&
+        strncmp (regfont_broadcast_names[i], spec, len) == 0)
       break;
   }
 
-  dbprintf ("    File is a font");
-  dbprintf ("    Completed checking file");
-
-  return REGFONT_OK;
-}
-
-int checkPostScriptFile (char *filename) {
-  char *pipe_pos;
-  char pfb_filename[MAX_PATH];
-  char pfm_filename[MAX_PATH];
-  int retval;
-
-  dbprintf ("    Checking for PostScript font...");
-
-  pipe_pos = strchr (filename, '|');
-  if (!pipe_pos) {
-    dbprintf ("    Not a PostScript font (no '|' character found)");
-    return REGFONT_NOT_POSTSCRIPT;
-  }
-  dbprintf ("    PostScript font found ('|' character found)");
-
-  pipe_pos++;
-
-  dbprintf ("    Extracting pfm file...");
-  memset (pfm_filename, 0, sizeof (pfm_filename));
-  strncpy (pfm_filename, filename, pipe_pos - filename - 1);
-  dbprintf ("    pfm file: %s", pfm_filename);
-
-  dbprintf ("    Extracting pfb file...");
-  memset (pfb_filename, 0, sizeof (pfb_filename));
-  strncpy (pfb_filename, pipe_pos, strlen(pipe_pos));
-  dbprintf ("    pfb file: %s", pfb_filename);
-
-  retval = checkFile (pfm_filename, REGFONT_PFM);
-  if (retval != REGFONT_OK) {
-    dbprintf ("    PostScript font check complete");
-    return retval;
-  }
-
-  retval = checkFile (pfb_filename, REGFONT_PFB);
-  if (retval != REGFONT_OK) {
-    dbprintf ("    PostScript font check complete");
-    return retval;
-  }
-
-  dbprintf ("    Checking if pfm matches pfb...");
-  PathStripPath (pfm_filename);
-  PathRemoveExtension (pfm_filename);
-  PathStripPath (pfb_filename);
-  PathRemoveExtension (pfb_filename);
-  if (CompareString (LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-            pfm_filename, -1, pfb_filename, -1) != CSTR_EQUAL) {
-    fprintf (stderr, "ERROR: PostScript font specified incorrectly\n");
-    fprintf (stderr, "ERROR:     pfm and pfb filenames must match (%s != %s)\n",
-        pfm_filename, pfb_filename);
-    dbprintf ("    PostScript font check complete");
-    return REGFONT_MISMATCHED_POSTSCRIPT_FILES;
-  }
-  dbprintf ("    pfm file matches pfb file");
-
-  dbprintf ("    PostScript font check complete");
-  return retval;
-}
-
-int checkFontFile (char *filename) {
-  int retval;
-
-  dbprintf ("    Checking font...");
-
-  retval = checkPostScriptFile (filename);
-
-  if (retval == REGFONT_NOT_POSTSCRIPT)
-    retval = checkFile (filename, REGFONT_ANY);
-
-  dbprintf ("    Font check complete");
-  return retval;
-}
-
-void addFonts (int n, char **files) {
-  int i = 0;
-
-  dbprintf ("Adding fonts: Starting");
-  for ( ; i < n; i++) {
-    dbprintf ("Trying to add font: %s", files[i]);
-    if (checkFontFile (files[i]) == REGFONT_OK) {
-      dbprintf ("    Adding font to system font table...");
-      if (AddFontResource (files[i]) == 0)
-        fprintf (stderr, "ERROR: Adding %s to system font table failed\n",
-            files[i]);
-      else
-        printf ("Successfully added font: %s\n", files[i]);
-    }
+  if (i > REGFONT_BROADCAST_NONE ||
+      (spec[len] == ':' && i != REGFONT_BROADCAST_TIMEOUT)) {
+    fprintf (stderr, "ERROR: Unknown broadcast strategy: %s\n", spec);
+    return -1;
   }
-  dbprintf ("Adding fonts: Finished");
-
-  dbprintf ("Sending font broadcast change message");
-  SendMessage (HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
-  dbprintf ("Font change broadcast message sent");
-}
 
-void removeFonts (int n, char **files) {
-  int i = 0;
-
-  dbprintf ("Removing fonts: Starting");
-  for ( ; i < n; i++) {
-    dbprintf ("Trying to remove font: %s", files[i]);
-    if (checkFontFile (files[i]) == REGFONT_OK) {
-      dbprintf ("    Removing font from system font table...");
-      if (RemoveFontResource (files[i]) == 0)
-        fprintf (stderr, "ERROR: Removing %s from system font table failed\n",
-            files[i]);
-      else
-        printf ("Successfully removed font: %s\n", files[i]);
-    }
-  }
-  dbprintf ("Removing fonts: Finished");
+  regfont_settings.broadcast = (regfont_broadcast_strategy) i;
+  if (spec[len] == ':')
+    regfont_settings.broadcast_timeout = strtoul (spec + len + 1, NULL, 10);
 
-  dbprintf ("Sending font change broadcast message");
-  SendMessage (HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
-  dbprintf ("Font change broadcast message sent");
+  return 0;
 }
 
 void printUsage () {
   dbprintf ("Printing usage");
-  printf ("Usage: regfont [-a|-r|-h|-v|-d] font1 font2...\n");
+  printf ("Usage: regfont [-a|-r|-h|-v|-d|-s] [-j N] [--backend NAME[:PARAMS]] "
+      "font1 font2...\n");
   printf ("\t-a, --add\tAdd specified fonts\n");
   printf ("\t-r, --remove\tRemove specified fonts\n");
+  printf ("\t--info\t\tPrint the format and faces of fonts without "
+      "registering them\n");
   printf ("\t-h, --help\tThis help message\n");
   printf ("\t-v, --version\tPrint version information\n");
   printf ("\t-d, --debug\tTurn on debugging information\n");
+  printf ("\t--log-level\tdebug, or trace to also log each step for each "
+      "font (-d)\n");
+  printf ("\t-s, --strict\tAlso check that file contents match the "
+      "extension\n");
+  printf ("\t--verify\tAlso check the table checksums of TrueType and "
+      "OpenType\n\t\t\tfonts\n");
+  printf ("\t--recursive\tAlso take fonts from a directory tree (may be "
+      "repeated)\n");
+  printf ("\t--pair\t\tPair loose .pfm and .pfb files by name into "
+      "PostScript fonts\n");
+  printf ("\t--from\t\tAlso take fonts from a list file, one per line or "
+      "NUL\n\t\t\tterminated (- for standard input)\n");
+  printf ("\t--cache\t\tRemember font checks in a cache file, keyed by "
+      "path, size\n\t\t\tand modification time\n");
+  printf ("\t--session\tWith -r, remove every font added since the journal "
+      "was last\n\t\t\tcleared, without checking them\n");
+  printf ("\t--journal\tSession journal (default: %s)\n",
+      regfont_default_journal);
+  printf ("\t--sync\t\tAdd and remove only what it takes for the session "
+      "to hold\n\t\t\tthe fonts in a list file (- for standard input)\n");
+  printf ("\t--dry-run\tWith --sync, print the changes and their cost "
+      "without\n\t\t\tmaking them\n");
+  printf ("\t--dedup\t\tRegister only the first of fonts with the same "
+      "contents\n");
+  printf ("\t--index\t\tFont family index file\n");
+  printf ("\t--family\tAlso take every font of a family from the index\n");
+  printf ("\t--update-index\tIndex the fonts under the given directories, "
+      "and those\n\t\t\talready indexed\n");
+  printf ("\t--stats\t\tPrint the time spent in each phase, with per font "
+      "latencies,\n\t\t\tat exit\n");
+  printf ("\t--trace\t\tWrite a Chrome trace of each font and phase to a "
+      "file at exit\n");
+  printf ("\t-j, --jobs\tNumber of threads checking fonts (default: "
+      "number of CPUs)\n");
+  printf ("\t--prefetch\tQuery and, with -s, read the files of each batch "
+      "together\n\t\t\tahead of checking them\n");
+  printf ("\t--backend\tFont table backend to use (default: %s)\n",
+      REGFONT_DEFAULT_BACKEND);
+  printf ("\t--backends\tList available font table backends\n");
+  printf ("\t--server\tRun as a resident server for other regfont "
+      "processes\n");
+  printf ("\t--socket\tServer socket (default: %s)\n",
+      regfont_default_socket);
+  printf ("\t--window\tServer font change broadcast window in ms "
+      "(default: %d)\n", REGFONT_DEFAULT_WINDOW);
+  printf ("\t--local\t\tDo not hand fonts to a running server\n");
+  printf ("\t--batch\t\tTake add, remove, flush and stats commands from "
+      "standard\n\t\t\tinput, answering each on standard output\n");
+  printf ("\t--broadcast\tFont change broadcast strategy: send, post, "
+      "none or\n\t\t\ttimeout[:MS] per window (default: send, %d ms)\n",
+      REGFONT_DEFAULT_BROADCAST_TIMEOUT);
   dbprintf ("Printing usage: Finished");
 }
 
@@ -307,10 +172,24 @@ void printVersion () {
   dbprintf ("Printing version: Finished");
 }
 
-void processOptions (int argc, char **argv) {
+void addDirectory (char *dir) {
+  char **directories = realloc (regfont_directories,
+      (size_t) (regfont_ndirectories + 1) * sizeof (char *));
+
+  if (!directories) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return;
+  }
+  directories[regfont_ndirectories++] = dir;
+  regfont_directories = directories;
+}
+
+regfont_task processOptions (int argc, char **argv) {
+  regfont_task task = REGFONT_TASK_HELP;
   int opt, i;
 
-  regfont_task = REGFONT_TASK_HELP;
+  regfont_default_options (&regfont_settings);
+  regfont_settings.backend = REGFONT_DEFAULT_BACKEND;
 
   while (1) {
     int option_index = 0;
@@ -320,10 +199,38 @@ void processOptions (int argc, char **argv) {
       {"help", 0, 0, 0},
       {"version", 0, 0, 0},
       {"debug", 0, 0, 0},
+      {"backend", 1, 0, 0},
+      {"backends", 0, 0, 0},
+      {"server", 0, 0, 0},
+      {"socket", 1, 0, 0},
+      {"window", 1, 0, 0},
+      {"local", 0, 0, 0},
+      {"broadcast", 1, 0, 0},
+      {"jobs", 1, 0, 0},
+      {"strict", 0, 0, 0},
+      {"recursive", 1, 0, 0},
+      {"from", 1, 0, 0},
+      {"cache", 1, 0, 0},
+      {"index", 1, 0, 0},
+      {"family", 1, 0, 0},
+      {"update-index", 0, 0, 0},
+      {"dedup", 0, 0, 0},
+      {"session", 0, 0, 0},
+      {"journal", 1, 0, 0},
+      {"sync", 1, 0, 0},
+      {"dry-run", 0, 0, 0},
+      {"stats", 0, 0, 0},
+      {"trace", 1, 0, 0},
+      {"log-level", 1, 0, 0},
+      {"verify", 0, 0, 0},
+      {"info", 0, 0, 0},
+      {"pair", 0, 0, 0},
+      {"prefetch", 0, 0, 0},
+      {"batch", 0, 0, 0},
       {0, 0, 0, 0}
     };
 
-    opt = getopt_long (argc, argv, "arhvd", long_options, &option_index);
+    opt = getopt_long (argc, argv, "arhvdj:s", long_options, &option_index);
 
     if (opt == -1)
       break;
@@ -332,51 +239,149 @@ void processOptions (int argc, char **argv) {
     case 0:
       switch (option_index) {
       case 0: /* add */
-        regfont_task = REGFONT_TASK_ADD;
+        task = REGFONT_TASK_ADD;
         break;
       case 1: /* remove */
-        regfont_task = REGFONT_TASK_REMOVE;
+        task = REGFONT_TASK_REMOVE;
         break;
       case 2: /* help */
-        regfont_task = REGFONT_TASK_HELP;
+        task = REGFONT_TASK_HELP;
         break;
       case 3: /* version */
-        regfont_task = REGFONT_TASK_VERSION;
+        task = REGFONT_TASK_VERSION;
         break;
       case 4: /* debug */
-        regfont_debugging = -1;
+        setLogLevel (REGFONT_LOG_TRACE);
         dbprintf ("Processing options: Turning on debugging");
         break;
+      case 5: /* backend */
+        regfont_settings.backend = optarg;
+        break;
+      case 6: /* backends */
+        task = REGFONT_TASK_BACKENDS;
+        break;
+      case 7: /* server */
+        task = REGFONT_TASK_SERVER;
+        break;
+      case 8: /* socket */
+        regfont_socket = optarg;
+        break;
+      case 9: /* window */
+        regfont_window = strtoul (optarg, NULL, 10);
+        break;
+      case 10: /* local */
+        regfont_local = -1;
+        break;
+      case 11: /* broadcast */
+        if (parseBroadcast (optarg) != 0)
+          task = REGFONT_TASK_HELP;
+        break;
+      case 12: /* jobs */
+        regfont_settings.jobs = atoi (optarg);
+        break;
+      case 13: /* strict */
+        regfont_settings.strict = -1;
+        break;
+      case 14: /* recursive */
+        addDirectory (optarg);
+        break;
+      case 15: /* from */
+        regfont_manifest = optarg;
+        break;
+      case 16: /* cache */
+        regfont_settings.cache = optarg;
+        break;
+      case 17: /* index */
+        regfont_index_path = optarg;
+        break;
+      case 18: /* family */
+        regfont_family = optarg;
+        break;
+      case 19: /* update-index */
+        task = REGFONT_TASK_INDEX;
+        break;
+      case 20: /* dedup */
+        regfont_settings.dedup = -1;
+        break;
+      case 21: /* session */
+        regfont_undo_session = -1;
+        break;
+      case 22: /* journal */
+        regfont_journal_path = optarg;
+        break;
+      case 23: /* sync */
+        task = REGFONT_TASK_SYNC;
+        regfont_sync_manifest = optarg;
+        break;
+      case 24: /* dry-run */
+        regfont_dry_run = -1;
+        break;
+      case 25: /* stats */
+        regfont_settings.stats = -1;
+        break;
+      case 26: /* trace */
+        regfont_settings.trace = optarg;
+        break;
+      case 27: /* log-level */
+        if (strcmp (optarg, "debug") == 0) {
+          setLogLevel (REGFONT_LOG_DEBUG);
+        } else if (strcmp (optarg, "trace") == 0) {
+          setLogLevel (REGFONT_LOG_TRACE);
+        } else {
+          fprintf (stderr, "ERROR: Unknown log level: %s\n", optarg);
+          task = REGFONT_TASK_HELP;
+        }
+        break;
+      case 28: /* verify */
+        regfont_settings.verify = -1;
+        break;
+      case 29: /* info */
+        task = REGFONT_TASK_INFO;
+        break;
+      case 30: /* pair */
+        regfont_pair = -1;
+        break;
+      case 31: /* prefetch */
+        regfont_settings.prefetch = -1;
+        break;
+      case 32: /* batch */
+        task = REGFONT_TASK_BATCH;
+        break;
       }
       break;
     case 'a':
-      regfont_task = REGFONT_TASK_ADD;
+      task = REGFONT_TASK_ADD;
       break;
     case 'r':
-      regfont_task = REGFONT_TASK_REMOVE;
+      task = REGFONT_TASK_REMOVE;
       break;
     case 'h':
-      regfont_task = REGFONT_TASK_HELP;
+      task = REGFONT_TASK_HELP;
       break;
     case 'v':
-      regfont_task = REGFONT_TASK_VERSION;
+      task = REGFONT_TASK_VERSION;
       break;
     case 'd':
-      regfont_debugging = -1;
+      setLogLevel (REGFONT_LOG_TRACE);
       dbprintf ("Processing options: Turning on debugging");
       break;
+    case 'j':
+      regfont_settings.jobs = atoi (optarg);
+      break;
+    case 's':
+      regfont_settings.strict = -1;
+      break;
     default:
       break;
     }
   }
 
   if (regfont_debugging) {
-    fprintf (stderr, "DEBUG: Processing options: Commandline arguments found:\n");
+    dbprintf ("Processing options: Commandline arguments found:");
     for (i = 0; i < argc; i++) {
-      fprintf (stderr, "DEBUG:     %s\n", argv[i]);
+      dbprintf ("    %s", argv[i]);
     }
-    fflush (stderr);
-    switch (regfont_task) {
+    switch (task) {
       case REGFONT_TASK_ADD:
         dbprintf ("Processing options: Task selected: Add fonts");
         break;
@@ -389,51 +394,268 @@ void processOptions (int argc, char **argv) {
       case REGFONT_TASK_VERSION:
         dbprintf ("Processing options: Task selected: Print version");
         break;
+      case REGFONT_TASK_BACKENDS:
+        dbprintf ("Processing options: Task selected: List backends");
+        break;
+      case REGFONT_TASK_SERVER:
+        dbprintf ("Processing options: Task selected: Run server");
+        break;
+      case REGFONT_TASK_INDEX:
+        dbprintf ("Processing options: Task selected: Update font index");
+        break;
+      case REGFONT_TASK_SYNC:
+        dbprintf ("Processing options: Task selected: Sync fonts");
+        break;
+      case REGFONT_TASK_INFO:
+        dbprintf ("Processing options: Task selected: Describe fonts");
+        break;
+      case REGFONT_TASK_BATCH:
+        dbprintf ("Processing options: Task selected: Run batch commands");
+        break;
       default:
         dbprintf ("Processing options: No task selected");
         break;
     }
     if (optind < argc) {
-      fprintf (stderr, "DEBUG: Processing options: Font files to process:\n");
+      dbprintf ("Processing options: Font files to process:");
       i = optind;
       while (i < argc) {
-        fprintf (stderr, "DEBUG:     %s\n", argv[i++]);
+        dbprintf ("    %s", argv[i++]);
       }
-      fflush (stderr);
     }
   }
 
   dbprintf("Processing options: Finished");
+  return task;
+}
+
+int fontsSpecified (int argc) {
+  return argc - optind > 0 || regfont_manifest || regfont_ndirectories > 0 ||
+    regfont_family;
+}
+
+/* Everything named on the command line, then the --from list, then
+ * everything under the --recursive directories, then the --family
+ * fonts.  With --pair, the PostScript fonts paired from all of them
+ * come last. */
+regfont_source *openFonts (int argc, char **argv) {
+  regfont_source *sources[4], *fonts;
+  int i, n = 0;
+
+  if (argc - optind > 0)
+    sources[n++] = argvSource ((size_t) (argc - optind), &argv[optind]);
+  if (regfont_manifest)
+    sources[n++] = manifestSource (regfont_manifest);
+  if (regfont_ndirectories > 0)
+    sources[n++] = walkSource (regfont_ndirectories, regfont_directories,
+        regfont_settings.jobs > 0 ? regfont_settings.jobs :
+        regfont_cpu_count (),
+        regfont_pair ? REGFONT_WALK_PFM | REGFONT_WALK_PFB : 0);
+  if (regfont_family) {
+    if (regfont_index_path)
+      sources[n++] = familySource (regfont_index_path, regfont_family);
+    else {
+      fprintf (stderr, "ERROR: --family needs a font index (--index)\n");
+      sources[n++] = NULL;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (!sources[i]) {
+      for (i = 0; i < n; i++)
+        closeSource (sources[i]);
+      return NULL;
+    }
+  }
+
+  if (n == 0)
+    return NULL;
+  fonts = n == 1 ? sources[0] : chainSources (sources, n);
+  return fonts && regfont_pair ? pairSource (fonts) : fonts;
+}
+
+/* Hand the fonts to a resident server if there is one that runs with
+ * the same options.  Falling back to working in process when none is
+ * listening is only allowed for the default socket. */
+int useServer (int argc, char **argv, int remove) {
+  const char *socketpath = regfont_socket ? regfont_socket :
+    regfont_default_socket;
+  char *options;
+  regfont_source *fonts;
+  int retval;
+
+  if (regfont_local || !fontsSpecified (argc))
+    return 0;
+  options = describeOptions (&regfont_settings);
+  if (!options)
+    return 0;
+
+  fonts = openFonts (argc, argv);
+  if (!fonts) {
+    free (options);
+    return -1;
+  }
+  retval = runClient (socketpath, remove, fonts, options);
+  closeSource (fonts);
+  free (options);
+  if (retval == 0)
+    return 1;
+  if (retval == -2)
+    return 0;
+
+  if (regfont_socket) {
+    fprintf (stderr, "ERROR: Could not connect to regfont server on %s\n",
+        regfont_socket);
+    return -1;
+  }
+
+  return 0;
+}
+
+void freeDefaults (void) {
+  free (regfont_default_journal);
+  free (regfont_default_socket);
 }
 
 int main (int argc, char **argv) {
-  processOptions (argc, argv);
+  regfont_session *session;
+  regfont_source *fonts;
+  FILE *replies;
+  char *options;
+  regfont_task task;
+  int retval = 0;
 
-  switch (regfont_task) {
+  regfont_default_journal = defaultJournalPath ();
+  regfont_default_socket = defaultSocketPath ();
+  atexit (freeDefaults);
+  if (!regfont_default_journal || !regfont_default_socket) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return 1;
+  }
+
+  task = processOptions (argc, argv);
+  if (!regfont_journal_path)
+    regfont_journal_path = regfont_default_journal;
+
+  /* Undoing a session must not journal its own removals.  A server is
+   * only used if it journals to the same place. */
+  if (!regfont_undo_session)
+    regfont_settings.journal = regfont_journal_path;
+
+  if (task == REGFONT_TASK_ADD ||
+      (task == REGFONT_TASK_REMOVE && !regfont_undo_session)) {
+    retval = useServer (argc, argv, task == REGFONT_TASK_REMOVE);
+    if (retval != 0)
+      return retval < 0 ? 1 : 0;
+  }
+
+  /* A dry run only reads the journal */
+  if (task == REGFONT_TASK_SYNC && regfont_dry_run)
+    return syncFonts (NULL, regfont_sync_manifest, regfont_journal_path,
+        -1) != 0;
+
+  switch (task) {
+  case REGFONT_TASK_HELP:
+    printUsage ();
+    return 0;
+  case REGFONT_TASK_VERSION:
+    printVersion ();
+    return 0;
+  case REGFONT_TASK_BACKENDS:
+    printBackends ();
+    return 0;
+  case REGFONT_TASK_INDEX:
+    if (!regfont_index_path) {
+      fprintf (stderr, "ERROR: No font index specified to update!\n");
+      printUsage ();
+      return 0;
+    }
+    return updateIndex (regfont_index_path, argc - optind, &argv[optind],
+        regfont_settings.jobs > 0 ? regfont_settings.jobs :
+        regfont_cpu_count ()) != 0;
+  case REGFONT_TASK_INFO:
+    if (!fontsSpecified (argc)) {
+      fprintf (stderr, "ERROR: No font files specified to describe!\n");
+      printUsage ();
+      return 0;
+    }
+    fonts = openFonts (argc, argv);
+    if (!fonts)
+      return 1;
+    retval = printFontInfo (fonts);
+    closeSource (fonts);
+    return retval != 0;
+  default:
+    break;
+  }
+
+  session = regfont_session_open (&regfont_settings);
+  if (!session)
+    return 1;
+
+  switch (task) {
   case REGFONT_TASK_ADD:
-    if (argc - optind > 0) {
-      addFonts (argc - optind, &argv[optind]);
-    } else {
+    if (!fontsSpecified (argc)) {
       fprintf (stderr, "ERROR: No font files specified to add!\n");
       printUsage ();
+      break;
     }
+    fonts = openFonts (argc, argv);
+    if (!fonts) {
+      retval = 1;
+      break;
+    }
+    addFonts (session, fonts);
+    closeSource (fonts);
     break;
   case REGFONT_TASK_REMOVE:
-    if (argc - optind > 0) {
-      removeFonts (argc - optind, &argv[optind]);
-    } else {
+    if (regfont_undo_session) {
+      retval = removeSession (session, regfont_journal_path) != 0;
+      break;
+    }
+    if (!fontsSpecified (argc)) {
       fprintf (stderr, "ERROR: No font files specified to remove!\n");
       printUsage ();
+      break;
     }
+    fonts = openFonts (argc, argv);
+    if (!fonts) {
+      retval = 1;
+      break;
+    }
+    removeFonts (session, fonts);
+    closeSource (fonts);
     break;
-  case REGFONT_TASK_HELP:
-    printUsage ();
+  case REGFONT_TASK_SERVER:
+    options = describeOptions (&regfont_settings);
+    if (!options) {
+      fprintf (stderr, "ERROR: Could not describe server options\n");
+      retval = 1;
+      break;
+    }
+    runServer (session, regfont_socket ? regfont_socket :
+        regfont_default_socket, regfont_window, options);
+    free (options);
     break;
-  case REGFONT_TASK_VERSION:
-    printVersion ();
+  case REGFONT_TASK_SYNC:
+    retval = syncFonts (session, regfont_sync_manifest, regfont_journal_path,
+        0) != 0;
+    break;
+  case REGFONT_TASK_BATCH:
+    /* Standard output is kept for replies alone */
+    replies = regfont_take_stdout ();
+    if (!replies) {
+      fprintf (stderr, "ERROR: Could not set aside standard output\n");
+      retval = 1;
+      break;
+    }
+    retval = runBatch (session, stdin, replies) != 0;
+    fclose (replies);
+    break;
+  default:
     break;
   }
 
-  return 0;
+  regfont_session_close (session);
+  return retval;
 }
-
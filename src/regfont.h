@@ -0,0 +1,553 @@
+/* regfont.h
+ * Shared declarations for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGFONT_H
+#define REGFONT_H
+
+#include <stdio.h>
+
+#include "compat.h"
+#include "libregfont.h"
+
+/* Functions shared between the library's files link as regfont_NAME,
+ * so that they cannot clash with those of a program using it;
+ * everything else is static to its file */
+#define addFont regfont_addFont
+#define addFonts regfont_addFonts
+#define arenaAlloc regfont_arenaAlloc
+#define arenaMark regfont_arenaMark
+#define arenaRelease regfont_arenaRelease
+#define argvSource regfont_argvSource
+#define asciiCaseEqual regfont_asciiCaseEqual
+#define broadcastFontChange regfont_broadcastFontChange
+#define cacheLookup regfont_cacheLookup
+#define cacheStore regfont_cacheStore
+#define chainSources regfont_chainSources
+#define checkCollection regfont_checkCollection
+#define checkFile regfont_checkFile
+#define checkPostScriptFile regfont_checkPostScriptFile
+#define checksumKernelName regfont_checksumKernelName
+#define chooseChecksumKernel regfont_chooseChecksumKernel
+#define classifyExtension regfont_classifyExtension
+#define closeCache regfont_closeCache
+#define closeFaces regfont_closeFaces
+#define closeJournal regfont_closeJournal
+#define closeSource regfont_closeSource
+#define closeStats regfont_closeStats
+#define closeTrace regfont_closeTrace
+#define defaultJournalPath regfont_defaultJournalPath
+#define defaultSocketPath regfont_defaultSocketPath
+#define describeOptions regfont_describeOptions
+#define duplicateOf regfont_duplicateOf
+#define errorString regfont_errorString
+#define extensionAllowsFormat regfont_extensionAllowsFormat
+#define faceNames regfont_faceNames
+#define faceProblem regfont_faceProblem
+#define familySource regfont_familySource
+#define fingerprintFont regfont_fingerprintFont
+#define finishBackend regfont_finishBackend
+#define finishDuplicates regfont_finishDuplicates
+#define forgetDuplicate regfont_forgetDuplicate
+#define formatName regfont_formatName
+#define formatReply regfont_formatReply
+#define fullPath regfont_fullPath
+#define fullSpecPath regfont_fullSpecPath
+#define hashContents regfont_hashContents
+#define journalFont regfont_journalFont
+#define logPrintf regfont_logPrintf
+#define manifestSource regfont_manifestSource
+#define msgprintf regfont_msgprintf
+#define newSource regfont_newSource
+#define openCache regfont_openCache
+#define openFaces regfont_openFaces
+#define openJournal regfont_openJournal
+#define openStats regfont_openStats
+#define openTrace regfont_openTrace
+#define pairSource regfont_pairSource
+#define pfmFaceNames regfont_pfmFaceNames
+#define prefetchCreate regfont_prefetchCreate
+#define prefetchDestroy regfont_prefetchDestroy
+#define prefetchEngine regfont_prefetchEngine
+#define prefetchFiles regfont_prefetchFiles
+#define printBackends regfont_printBackends
+#define printFontInfo regfont_printFontInfo
+#define printVerify regfont_printVerify
+#define processFonts regfont_processFonts
+#define readBE16 regfont_readBE16
+#define readBE32 regfont_readBE32
+#define readLE32 regfont_readLE32
+#define registerFont regfont_registerFont
+#define removeFont regfont_removeFont
+#define removeFonts regfont_removeFonts
+#define removeSession regfont_removeSession
+#define runBatch regfont_runBatch
+#define runClient regfont_runClient
+#define runServer regfont_runServer
+#define selectBackend regfont_selectBackend
+#define sessionFonts regfont_sessionFonts
+#define sfntChecksum regfont_sfntChecksum
+#define sfntChecksumScalar regfont_sfntChecksumScalar
+#define sfntFaceNames regfont_sfntFaceNames
+#define sniffFontFile regfont_sniffFontFile
+#define sniffFontHeader regfont_sniffFontHeader
+#define sourceInfo regfont_sourceInfo
+#define startLog regfont_startLog
+#define statsRecord regfont_statsRecord
+#define statsRecordFile regfont_statsRecordFile
+#define statsStart regfont_statsStart
+#define syncFonts regfont_syncFonts
+#define traceEvent regfont_traceEvent
+#define updateIndex regfont_updateIndex
+#define verifyFontFile regfont_verifyFontFile
+#define viewOf regfont_viewOf
+#define viewStem regfont_viewStem
+#define walkSource regfont_walkSource
+
+typedef enum REGFONT_FONT_TYPES {
+  REGFONT_ANY,
+  REGFONT_PFB,
+  REGFONT_PFM,
+  REGFONT_NOT_FONT
+} regfont_font_type;
+
+/* Font file formats, as told by their contents */
+typedef enum REGFONT_FORMATS {
+  REGFONT_FORMAT_UNKNOWN,
+  REGFONT_FORMAT_TRUETYPE,
+  REGFONT_FORMAT_OPENTYPE,
+  REGFONT_FORMAT_COLLECTION,
+  REGFONT_FORMAT_FON,
+  REGFONT_FORMAT_FNT,
+  REGFONT_FORMAT_PFB,
+  REGFONT_FORMAT_PFM
+} regfont_format;
+
+/* A string that need not be terminated, such as either half of a
+ * "pfm|pfb" specification */
+typedef struct {
+  const char *data;
+  size_t len;
+} regfont_view;
+
+regfont_view viewOf (const char *string);
+regfont_view viewStem (regfont_view path);
+
+/* The longest full path a font may have: even \\?\ paths go no
+ * further on Windows */
+#ifdef _WIN32
+#define REGFONT_PATH_LIMIT 32767
+#else
+#define REGFONT_PATH_LIMIT PATH_MAX
+#endif
+
+/* Bump allocator for the paths made while checking a font, released
+ * back to a mark when the check is done.  A check whose paths fit in
+ * the first block, which is part of the arena, allocates nothing;
+ * longer paths get blocks of their own. */
+#define REGFONT_ARENA_SIZE 4096
+
+typedef struct regfont_arena_block regfont_arena_block;
+
+typedef struct {
+  size_t used;
+  regfont_arena_block *blocks;
+  char first[REGFONT_ARENA_SIZE];
+} regfont_arena;
+
+typedef struct {
+  size_t used;
+  regfont_arena_block *blocks;
+} regfont_arena_mark;
+
+extern REGFONT_THREAD_LOCAL regfont_arena regfont_path_arena;
+
+char *arenaAlloc (regfont_arena *arena, size_t size);
+regfont_arena_mark arenaMark (const regfont_arena *arena);
+void arenaRelease (regfont_arena *arena, regfont_arena_mark mark);
+int fullPath (regfont_arena *arena, regfont_view name, regfont_view *full);
+int fullSpecPath (regfont_arena *arena, const char *filename,
+    regfont_view *full);
+
+const char *formatName (regfont_format format);
+unsigned int readBE16 (const unsigned char *p);
+unsigned long readBE32 (const unsigned char *p);
+unsigned long readLE32 (const unsigned char *p);
+/* Enough of the file for every signature except the NE header of a
+ * .fon, which usually sits just past the MZ stub */
+#define REGFONT_SNIFF_SIZE 256
+
+regfont_format sniffFontHeader (const unsigned char *header, size_t size,
+    const char *path);
+regfont_format sniffFontFile (const char *filename);
+regfont_font_type classifyExtension (const char *extension);
+int extensionAllowsFormat (const char *extension, regfont_format format);
+int asciiCaseEqual (regfont_view a, regfont_view b);
+
+/* Debug logging.  Records above REGFONT_LOG_LEVEL are compiled out,
+ * leaving their arguments unevaluated, and the rest cost a single test
+ * unless their level is turned on at run time.  dbtrace is for the
+ * steps taken for each font. */
+#define REGFONT_LOG_DEBUG 1
+#define REGFONT_LOG_TRACE 2
+
+#ifndef REGFONT_LOG_LEVEL
+#define REGFONT_LOG_LEVEL REGFONT_LOG_TRACE
+#endif
+
+#if REGFONT_LOG_LEVEL >= REGFONT_LOG_DEBUG
+#define dbprintf(...) (regfont_debugging >= REGFONT_LOG_DEBUG ? \
+    logPrintf (REGFONT_LOG_DEBUG, __VA_ARGS__) : (void) 0)
+#else
+#define dbprintf(...) ((void) (0 && (logPrintf (REGFONT_LOG_DEBUG, \
+    __VA_ARGS__), 0)))
+#endif
+
+#if REGFONT_LOG_LEVEL >= REGFONT_LOG_TRACE
+#define dbtrace(...) (regfont_debugging >= REGFONT_LOG_TRACE ? \
+    logPrintf (REGFONT_LOG_TRACE, __VA_ARGS__) : (void) 0)
+#else
+#define dbtrace(...) ((void) (0 && (logPrintf (REGFONT_LOG_TRACE, \
+    __VA_ARGS__), 0)))
+#endif
+
+void startLog (int level);
+void logPrintf (int level, const char *fmt, ...);
+
+/* Progress and per font errors, a line at a time, written to stream or
+ * handed to the session's message callback.  session may be NULL. */
+void msgprintf (regfont_session *session, FILE *stream, const char *fmt,
+    ...);
+
+/* Output written by msgprintf while a capture is active on the current
+ * thread is held back, so that work done in parallel can be reported in
+ * order.  Debug logging is not captured. */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+} regfont_output;
+
+const char *errorString (int error);
+
+/* A stream of font specifications.  next returns NULL at the end; the
+ * string it returns stays valid until the following call. */
+typedef struct regfont_source regfont_source;
+
+/* info, if set, fills in what the source already knows of the file of
+ * the font next returned last, as a directory scan does, and returns -1
+ * if it knows nothing */
+struct regfont_source {
+  char *(*next) (regfont_source *source);
+  void (*close) (regfont_source *source);
+  int (*info) (regfont_source *source, regfont_stat_info *info);
+  void *data;
+};
+
+regfont_source *argvSource (size_t n, char **files);
+regfont_source *manifestSource (const char *name);
+regfont_source *newSource (char *(*next) (regfont_source *),
+    void (*close) (regfont_source *), void *data);
+regfont_source *walkSource (int n, char **dirs, int threads, int postscript);
+regfont_source *pairSource (regfont_source *fonts);
+
+/* What walkSource takes besides fonts that can be registered alone */
+#define REGFONT_WALK_PFM 1
+#define REGFONT_WALK_PFB 2
+regfont_source *chainSources (regfont_source **sources, int n);
+int sourceInfo (regfont_source *source, regfont_stat_info *info);
+void closeSource (regfont_source *source);
+
+/* Font family index */
+int updateIndex (const char *path, int n, char **dirs, int threads);
+regfont_source *familySource (const char *path, const char *family);
+
+/* Longest family or style name kept, in bytes of UTF-8 */
+#define REGFONT_NAME_SIZE 128
+
+int sfntFaceNames (const unsigned char *data, size_t size,
+    size_t offset, char *family, char *style);
+int pfmFaceNames (const unsigned char *data, size_t size, char *family,
+    char *style);
+
+/* The faces of a TrueType, OpenType or collection font, read only as
+ * they are asked about.  Other formats have no faces. */
+typedef struct {
+  regfont_map map;
+  regfont_format format;
+  unsigned long nfaces;
+  const char *problem;
+} regfont_faces;
+
+int openFaces (regfont_faces *faces, const char *path);
+void closeFaces (regfont_faces *faces);
+const char *faceProblem (const regfont_faces *faces, unsigned long face,
+    unsigned int *ntables);
+int faceNames (const regfont_faces *faces, unsigned long face, char *family,
+    char *style);
+int checkCollection (regfont_session *session, const char *fullfilename,
+    regfont_view name);
+int printFontInfo (regfont_source *fonts);
+
+/* Validation cache.  key is a hash of the full path, or of both full
+ * paths of a PostScript font, and is never 0 for a used slot.  extra
+ * folds the size and time of the .pfb half of a PostScript font. */
+typedef struct {
+  unsigned long long key;
+  unsigned long long size;
+  long long mtime;
+  unsigned long long extra;
+  unsigned short status;
+  unsigned char format;
+  unsigned char flags;
+  unsigned int reserved;
+} regfont_cache_entry;
+
+typedef struct regfont_cache regfont_cache;
+
+/* What is known of a file before it is checked: its metadata if known
+ * is set, and its first headerlen bytes if hasheader is */
+typedef struct {
+  int known;
+  regfont_stat_info info;
+  int hasheader;
+  size_t headerlen;
+  unsigned char header[REGFONT_SNIFF_SIZE];
+} regfont_file_info;
+
+/* What is known of the files of a font specification, the .pfm and .pfb
+ * of a PostScript font or the one file of any other, so that the cache
+ * and the checks query each file once between them */
+typedef struct {
+  regfont_file_info file[2];
+} regfont_spec_info;
+
+int openCache (regfont_session *session, const char *path);
+int cacheLookup (regfont_session *session, const char *filename,
+    regfont_cache_entry *key, int *status, regfont_spec_info *spec);
+void cacheStore (regfont_session *session, regfont_cache_entry *key,
+    int status, regfont_format format);
+void closeCache (regfont_session *session);
+
+/* Duplicate detection */
+typedef struct {
+  unsigned long long hash;
+  unsigned long long size;
+  int valid;
+} regfont_fingerprint;
+
+typedef struct regfont_duplicates regfont_duplicates;
+
+unsigned long long hashContents (const unsigned char *data, size_t len,
+    unsigned long long seed);
+int fingerprintFont (const char *filename, regfont_fingerprint *fp);
+const char *duplicateOf (regfont_session *session, const char *filename,
+    const regfont_fingerprint *fp);
+void forgetDuplicate (regfont_session *session, const char *filename,
+    const regfont_fingerprint *fp);
+void finishDuplicates (regfont_session *session);
+
+/* Session journal.  delta is the number of times path is registered. */
+typedef struct {
+  char *path;
+  int delta;
+  size_t order;
+} regfont_journal_entry;
+
+char *defaultJournalPath (void);
+int openJournal (regfont_session *session, const char *path);
+void journalFont (regfont_session *session, int remove, const char *path);
+void closeJournal (regfont_session *session);
+regfont_journal_entry *sessionFonts (const char *path, size_t *count);
+int removeSession (regfont_session *session, const char *path);
+
+/* Phase timing.  statsStart returns 0 unless the session was opened
+ * with stats or a trace file, and statsRecord then does nothing. */
+typedef struct regfont_timings regfont_timings;
+typedef struct regfont_tracer regfont_tracer;
+
+typedef enum REGFONT_PHASES {
+  REGFONT_PHASE_PATH,
+  REGFONT_PHASE_STAT,
+  REGFONT_PHASE_EXTENSION,
+  REGFONT_PHASE_CONTENTS,
+  REGFONT_PHASE_VERIFY,
+  REGFONT_PHASE_POSTSCRIPT,
+  REGFONT_PHASE_CACHE,
+  REGFONT_PHASE_CHECK,
+  REGFONT_PHASE_REGISTER,
+  REGFONT_PHASE_BROADCAST,
+  REGFONT_PHASE_ADD_FONTS,
+  REGFONT_PHASE_REMOVE_FONTS,
+  REGFONT_PHASE_COUNT
+} regfont_phase;
+
+extern const char *regfont_phase_names[REGFONT_PHASE_COUNT];
+
+regfont_timings *openStats (void);
+unsigned long long statsStart (regfont_session *session);
+void statsRecord (regfont_session *session, regfont_phase phase,
+    unsigned long long start);
+void statsRecordFile (regfont_session *session, regfont_phase phase,
+    unsigned long long start, const char *filename);
+void closeStats (regfont_session *session);
+
+/* Trace events, written as Chrome trace JSON when the session closes */
+regfont_tracer *openTrace (const char *path);
+void traceEvent (regfont_tracer *tracer, regfont_phase phase,
+    unsigned long long start, unsigned long long end,
+    const char *filename);
+void closeTrace (regfont_tracer *tracer);
+
+/* What verification has checked in a session, kept in case it was
+ * opened with verify */
+typedef struct {
+  regfont_mutex lock;
+  unsigned long fonts;
+  unsigned long tables;
+  unsigned long long bytes;
+  unsigned long long ns;
+} regfont_verify_totals;
+
+/* sfnt checksum verification.  sfntChecksum uses the fastest kernel
+ * this processor has once chooseChecksumKernel has run, which any
+ * thread may call; the scalar one is there to compare against.
+ * verifyFontFile adds to the session's totals, which printVerify
+ * prints. */
+void chooseChecksumKernel (void);
+unsigned long sfntChecksum (const unsigned char *data, size_t len);
+unsigned long sfntChecksumScalar (const unsigned char *data, size_t len);
+const char *checksumKernelName (void);
+int verifyFontFile (regfont_session *session, const char *fullfilename,
+    regfont_view name);
+void printVerify (regfont_session *session);
+
+/* Batched file metadata and header reads ahead of the checks, through
+ * io_uring where the kernel has it and a pool of threads elsewhere */
+typedef struct regfont_prefetcher regfont_prefetcher;
+
+typedef struct {
+  const char *path;
+  regfont_file_info *file;
+  int header;
+} regfont_prefetch_request;
+
+regfont_prefetcher *prefetchCreate (int threads);
+const char *prefetchEngine (const regfont_prefetcher *prefetcher);
+void prefetchFiles (regfont_prefetcher *prefetcher,
+    regfont_prefetch_request *requests, size_t n);
+void prefetchDestroy (regfont_prefetcher *prefetcher);
+
+/* Declarative sync.  A dry run needs no session. */
+int syncFonts (regfont_session *session, const char *manifest,
+    const char *journal, int dryrun);
+
+int checkFile (regfont_session *session, regfont_view name,
+    regfont_font_type type, regfont_format *detected,
+    const regfont_file_info *file);
+int checkPostScriptFile (regfont_session *session, const char *filename,
+    regfont_format *detected, regfont_spec_info *spec);
+int registerFont (regfont_session *session, int remove, char *filename);
+int addFont (regfont_session *session, char *filename);
+int removeFont (regfont_session *session, char *filename);
+void processFonts (regfont_session *session, int remove,
+    regfont_source *fonts, int *results);
+void addFonts (regfont_session *session, regfont_source *fonts);
+void removeFonts (regfont_session *session, regfont_source *fonts);
+void broadcastFontChange (regfont_session *session);
+
+extern const char *regfont_broadcast_names[];
+
+/* What a font change broadcast cost.  recipients is zero when the
+ * strategy does not reveal it. */
+typedef struct {
+  unsigned long recipients;
+  unsigned long timed_out;
+  unsigned long long elapsed;
+} regfont_broadcast_result;
+
+/* A font table backend.  addFont and removeFont follow the
+ * AddFontResource convention of returning non-zero on success.  The
+ * broadcast timeout is per recipient, in milliseconds.  session is the
+ * one the backend was selected for, to report to. */
+typedef struct regfont_backend regfont_backend;
+
+struct regfont_backend {
+  const char *name;
+  const char *description;
+  int serialized;
+  int (*init) (regfont_backend *backend, const char *params);
+  int (*addFont) (regfont_backend *backend, const char *filename);
+  int (*removeFont) (regfont_backend *backend, const char *filename);
+  void (*broadcast) (regfont_backend *backend,
+      regfont_broadcast_strategy strategy, unsigned long timeout,
+      regfont_broadcast_result *result);
+  void (*finish) (regfont_backend *backend);
+  void *data;
+  regfont_session *session;
+};
+
+#ifdef _WIN32
+#define REGFONT_DEFAULT_BACKEND "gdi"
+#else
+#define REGFONT_DEFAULT_BACKEND "sim"
+#endif
+
+int selectBackend (regfont_backend *backend, const char *spec);
+void finishBackend (regfont_backend *backend);
+void printBackends (void);
+
+/* Everything a run keeps besides the process-wide diagnostics.  The
+ * counts that worker threads update are atomic. */
+struct regfont_session {
+  regfont_options options;
+  int jobs;
+  regfont_backend backend;
+  regfont_cache *cache;
+  FILE *journal;
+  regfont_mutex journal_lock;
+  regfont_duplicates *duplicates;
+  regfont_pool *pool;
+  regfont_prefetcher *prefetcher;
+  regfont_timings *timings;
+  regfont_tracer *tracer;
+  regfont_verify_totals verified;
+  regfont_atomic added;
+  regfont_atomic removed;
+  regfont_atomic pending;
+  unsigned long failed;
+  unsigned long skipped;
+  unsigned long broadcasts;
+};
+
+/* Resident server mode and its thin client */
+#define REGFONT_DEFAULT_WINDOW 1000
+
+char *defaultSocketPath (void);
+int runServer (regfont_session *session, const char *socketpath,
+    unsigned long window, const char *options);
+int runClient (const char *socketpath, int remove, regfont_source *fonts,
+    const char *options);
+char *describeOptions (const regfont_options *options);
+int formatReply (char **reply, size_t *size, int error, const char *command,
+    const char *path);
+
+/* The server's commands, read from a stream */
+int runBatch (regfont_session *session, FILE *in, FILE *out);
+
+#endif
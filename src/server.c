@@ -0,0 +1,662 @@
+/* server.c
+ * Resident regfont server that batches requests and coalesces font
+ * change broadcasts, and the thin client that talks to it.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The protocol is line based.  A client sends one command per line:
+ *
+ *     options OPTIONS
+ *     add PATH
+ *     remove PATH
+ *     flush
+ *     shutdown
+ *
+ * and the server answers each with a single line:
+ *
+ *     ok|error COMMAND CODE PATH
+ *
+ * A client first sends the options that decide what becomes of a font,
+ * and works in process instead if the server answers that its own
+ * differ, giving them in place of the path.  A font skipped as a
+ * duplicate is answered ok, with its own code.  Paths must be absolute,
+ * because the server does not share the client's working directory.
+ * Fonts are added and removed as commands arrive, but the font change
+ * broadcast is deferred until the batching window after the first
+ * change closes, so any number of clients in that window cost a single
+ * broadcast. */
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+#ifdef _WIN32
+typedef SOCKET regfont_socket;
+#define REGFONT_BAD_SOCKET INVALID_SOCKET
+#define closeSocket closesocket
+#else
+typedef int regfont_socket;
+#define REGFONT_BAD_SOCKET -1
+#define closeSocket close
+#endif
+
+#define REGFONT_CLIENT_TIMEOUT 5
+
+/* Lines are read into buffer, and written from out, each grown to fit
+ * the longest line so far */
+typedef struct {
+  regfont_socket sock;
+  char *buffer;
+  size_t size;
+  size_t start;
+  size_t end;
+  char *out;
+  size_t outsize;
+} regfont_connection;
+
+static volatile int regfont_server_stopping = 0;
+
+#ifndef _WIN32
+static void stopServer (int sig) {
+  (void) sig;
+  regfont_server_stopping = 1;
+}
+#endif
+
+static int initSockets (void) {
+#ifdef _WIN32
+  WSADATA wsadata;
+
+  if (WSAStartup (MAKEWORD (2, 2), &wsadata) != 0) {
+    fprintf (stderr, "ERROR: Could not initialise Windows sockets\n");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/* Returns a path for the caller to free, or NULL if out of memory */
+char *defaultSocketPath (void) {
+  const char *dir;
+  char *path;
+  size_t size;
+
+#ifdef _WIN32
+  dir = getenv ("TEMP");
+  if (!dir)
+    dir = ".";
+  size = strlen (dir) + sizeof ("\\regfont.sock");
+  path = malloc (size);
+  if (path)
+    _snprintf (path, size, "%s\\regfont.sock", dir);
+#else
+  dir = getenv ("XDG_RUNTIME_DIR");
+  if (dir && !*dir)
+    dir = NULL;
+  /* Room for the longest user id */
+  size = (dir ? strlen (dir) : 0) + sizeof ("/tmp/regfont-.sock") + 20;
+  path = malloc (size);
+  if (path && dir)
+    snprintf (path, size, "%s/regfont.sock", dir);
+  else if (path)
+    snprintf (path, size, "/tmp/regfont-%lu.sock",
+        (unsigned long) getuid ());
+#endif
+
+  return path;
+}
+
+static int socketAddress (const char *socketpath, struct sockaddr_un *address) {
+  memset (address, 0, sizeof (*address));
+  address->sun_family = AF_UNIX;
+  if (strlen (socketpath) >= sizeof (address->sun_path)) {
+    fprintf (stderr, "ERROR: Socket path too long: %s\n", socketpath);
+    return -1;
+  }
+  strcpy (address->sun_path, socketpath);
+  return 0;
+}
+
+static regfont_socket connectSocket (const char *socketpath) {
+  struct sockaddr_un address;
+  regfont_socket sock;
+
+  if (socketAddress (socketpath, &address) != 0)
+    return REGFONT_BAD_SOCKET;
+
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sock == REGFONT_BAD_SOCKET)
+    return REGFONT_BAD_SOCKET;
+
+  if (connect (sock, (struct sockaddr *) &address, sizeof (address)) != 0) {
+    closeSocket (sock);
+    return REGFONT_BAD_SOCKET;
+  }
+
+  return sock;
+}
+
+/* Only a server run by the same user is trusted with font paths.  The
+ * Windows socket lives in the user's own TEMP directory. */
+static int checkPeer (regfont_socket sock, const char *socketpath) {
+#ifndef _WIN32
+  uid_t uid;
+#if defined(HAVE_GETPEEREID)
+  gid_t gid;
+
+  if (getpeereid (sock, &uid, &gid) != 0)
+    return -1;
+#elif defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+
+  if (getsockopt (sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return -1;
+  uid = cred.uid;
+#else
+  struct stat st;
+
+  if (lstat (socketpath, &st) != 0 || !S_ISSOCK (st.st_mode))
+    return -1;
+  uid = st.st_uid;
+#endif
+  if (uid != getuid ()) {
+    fprintf (stderr, "ERROR: regfont server on %s belongs to another user\n",
+        socketpath);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+static int sendAll (regfont_socket sock, const char *data, size_t len) {
+  while (len > 0) {
+    int sent = send (sock, data, (int) len, 0);
+    if (sent <= 0)
+      return -1;
+    data += sent;
+    len -= (size_t) sent;
+  }
+  return 0;
+}
+
+static void openConnection (regfont_connection *conn,
+    regfont_socket sock) {
+  memset (conn, 0, sizeof (*conn));
+  conn->sock = sock;
+}
+
+/* Frees the buffers, but leaves the socket open */
+static void freeConnection (regfont_connection *conn) {
+  free (conn->buffer);
+  free (conn->out);
+  conn->buffer = conn->out = NULL;
+}
+
+/* Read one line, without its terminator.  Returns NULL at end of
+ * stream, on error or if out of memory. */
+static char *readLine (regfont_connection *conn) {
+  char *newline;
+  int received;
+
+  while (1) {
+    newline = conn->end > conn->start ? memchr (conn->buffer +
+        conn->start, '\n', conn->end - conn->start) : NULL;
+    if (newline) {
+      char *line = conn->buffer + conn->start;
+      *newline = '\0';
+      if (newline > line && newline[-1] == '\r')
+        newline[-1] = '\0';
+      conn->start = (size_t) (newline - conn->buffer) + 1;
+      return line;
+    }
+
+    if (conn->start > 0) {
+      memmove (conn->buffer, conn->buffer + conn->start,
+          conn->end - conn->start);
+      conn->end -= conn->start;
+      conn->start = 0;
+    }
+    if (conn->end == conn->size) {
+      size_t size = conn->size ? 2 * conn->size : 4096;
+      char *buffer = realloc (conn->buffer, size);
+
+      if (!buffer) {
+        fprintf (stderr, "ERROR: Out of memory\n");
+        return NULL;
+      }
+      conn->buffer = buffer;
+      conn->size = size;
+    }
+
+    received = recv (conn->sock, conn->buffer + conn->end,
+        (int) (conn->size - conn->end), 0);
+    if (received <= 0)
+      return NULL;
+    conn->end += (size_t) received;
+  }
+}
+
+/* Format a reply line in *reply, growing it to fit.  Returns the length
+ * of the line, or -1 if out of memory.  A skipped font is not an
+ * error. */
+int formatReply (char **reply, size_t *size, int error, const char *command,
+    const char *path) {
+  const char *status = error == REGFONT_OK ||
+    error == REGFONT_SKIPPED_DUPLICATE ? "ok" : "error";
+  int len;
+
+  if (!path || !*path)
+    path = "-";
+  while ((len = snprintf (*reply, *size, "%s %s %d %s\n", status, command,
+          error, path)) >= 0 && (size_t) len >= *size) {
+    char *grown = realloc (*reply, (size_t) len + 1);
+
+    if (!grown)
+      return -1;
+    *reply = grown;
+    *size = (size_t) len + 1;
+  }
+  return len;
+}
+
+static int sendReply (regfont_connection *conn, int error,
+    const char *command, const char *path) {
+  int len = formatReply (&conn->out, &conn->outsize, error, command, path);
+
+  if (len < 0)
+    return -1;
+  return sendAll (conn->sock, conn->out, (size_t) len);
+}
+
+/* Send "command argument" as a line */
+static int sendRequest (regfont_connection *conn, const char *command,
+    const char *argument) {
+  size_t cmdlen = strlen (command), arglen = strlen (argument);
+  size_t len = cmdlen + arglen + 2;
+
+  if (conn->outsize < len) {
+    char *grown = realloc (conn->out, len);
+
+    if (!grown)
+      return -1;
+    conn->out = grown;
+    conn->outsize = len;
+  }
+  memcpy (conn->out, command, cmdlen);
+  conn->out[cmdlen] = ' ';
+  memcpy (conn->out + cmdlen + 1, argument, arglen);
+  conn->out[len - 1] = '\n';
+  return sendAll (conn->sock, conn->out, len);
+}
+
+/* Serve one client until it disconnects.  Returns non-zero if the
+ * font table changed. */
+static int serveClient (regfont_session *session, regfont_socket sock,
+    const char *options, int *dirty) {
+  regfont_connection conn;
+  char *line;
+  int changed = 0;
+#ifdef _WIN32
+  DWORD timeout = REGFONT_CLIENT_TIMEOUT * 1000;
+#else
+  struct timeval timeout = {REGFONT_CLIENT_TIMEOUT, 0};
+#endif
+
+  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout,
+      sizeof (timeout));
+
+  openConnection (&conn, sock);
+
+  while ((line = readLine (&conn)) != NULL) {
+    int error;
+
+    dbtrace ("Server: Request: %s", line);
+    if (strncmp (line, "options ", 8) == 0) {
+      error = strcmp (line + 8, options) == 0 ? REGFONT_OK :
+        REGFONT_BAD_REQUEST;
+      if (sendReply (&conn, error, "options", options) != 0)
+        break;
+    } else if (strncmp (line, "add ", 4) == 0) {
+      error = addFont (session, line + 4);
+      if (error == REGFONT_OK)
+        changed = 1;
+      if (sendReply (&conn, error, "add", line + 4) != 0)
+        break;
+    } else if (strncmp (line, "remove ", 7) == 0) {
+      error = removeFont (session, line + 7);
+      if (error == REGFONT_OK)
+        changed = 1;
+      if (sendReply (&conn, error, "remove", line + 7) != 0)
+        break;
+    } else if (strcmp (line, "flush") == 0) {
+      if (*dirty || changed) {
+        broadcastFontChange (session);
+        *dirty = changed = 0;
+      }
+      if (sendReply (&conn, REGFONT_OK, "flush", NULL) != 0)
+        break;
+    } else if (strcmp (line, "shutdown") == 0) {
+      regfont_server_stopping = 1;
+      sendReply (&conn, REGFONT_OK, "shutdown", NULL);
+      break;
+    } else {
+      if (sendReply (&conn, REGFONT_BAD_REQUEST, "unknown", line) != 0)
+        break;
+    }
+  }
+
+  freeConnection (&conn);
+  return changed;
+}
+
+int runServer (regfont_session *session, const char *socketpath,
+    unsigned long window, const char *options) {
+  struct sockaddr_un address;
+  regfont_socket listener, client;
+  unsigned long long deadline = 0;
+  int dirty = 0;
+#ifndef _WIN32
+  struct sigaction action;
+  mode_t oldmask;
+#endif
+
+  if (initSockets () != 0 || socketAddress (socketpath, &address) != 0)
+    return 1;
+
+  /* Refuse to take over from a live server, but clean up after a dead
+   * one */
+  client = connectSocket (socketpath);
+  if (client != REGFONT_BAD_SOCKET) {
+    closeSocket (client);
+    fprintf (stderr, "ERROR: A regfont server is already listening on %s\n",
+        socketpath);
+    return 1;
+  }
+#ifdef _WIN32
+  DeleteFile (socketpath);
+#else
+  unlink (socketpath);
+#endif
+
+  listener = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listener == REGFONT_BAD_SOCKET) {
+    fprintf (stderr, "ERROR: Could not create server socket\n");
+    return 1;
+  }
+
+#ifndef _WIN32
+  oldmask = umask (077);
+#endif
+  if (bind (listener, (struct sockaddr *) &address, sizeof (address)) != 0 ||
+      listen (listener, 64) != 0) {
+    fprintf (stderr, "ERROR: Could not listen on %s\n", socketpath);
+    closeSocket (listener);
+    return 1;
+  }
+#ifndef _WIN32
+  umask (oldmask);
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = stopServer;
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+#endif
+
+  msgprintf (session, stdout, "Listening on %s (broadcast window %lu ms)\n",
+      socketpath, window);
+  fflush (stdout);
+
+  while (!regfont_server_stopping) {
+    fd_set readable;
+    struct timeval timeout, *wait = NULL;
+    int ready;
+
+    if (dirty) {
+      unsigned long long now = regfont_now_us ();
+      unsigned long long remaining = deadline > now ? deadline - now : 0;
+      timeout.tv_sec = (long) (remaining / 1000000ULL);
+      timeout.tv_usec = (long) (remaining % 1000000ULL);
+      wait = &timeout;
+    }
+
+    FD_ZERO (&readable);
+    FD_SET (listener, &readable);
+    ready = select ((int) listener + 1, &readable, NULL, NULL, wait);
+
+    if (ready < 0) {
+#ifndef _WIN32
+      if (errno == EINTR)
+        continue;
+#endif
+      fprintf (stderr, "ERROR: Waiting for clients failed\n");
+      break;
+    }
+
+    if (ready == 0) {
+      dbprintf ("Server: Broadcast window closed");
+      broadcastFontChange (session);
+      dirty = 0;
+      continue;
+    }
+
+    client = accept (listener, NULL, NULL);
+    if (client == REGFONT_BAD_SOCKET)
+      continue;
+
+    dbprintf ("Server: Client connected");
+    if (serveClient (session, client, options, &dirty) && !dirty) {
+      dirty = 1;
+      deadline = regfont_now_us () + (unsigned long long) window * 1000ULL;
+    }
+    /* Each client's fonts are told apart as a run of regfont's are */
+    finishDuplicates (session);
+    closeSocket (client);
+    dbprintf ("Server: Client disconnected");
+    fflush (stdout);
+  }
+
+  if (dirty)
+    broadcastFontChange (session);
+
+  closeSocket (listener);
+#ifdef _WIN32
+  DeleteFile (socketpath);
+  WSACleanup ();
+#else
+  unlink (socketpath);
+#endif
+
+  msgprintf (session, stdout, "Server stopped\n");
+  return 0;
+}
+
+/* Full path of an optional file named in the options, or "-" */
+static const char *optionPath (regfont_arena *arena, const char *name) {
+  regfont_view full;
+
+  if (!name)
+    return "-";
+  if (fullPath (arena, viewOf (name), &full) != REGFONT_OK)
+    return NULL;
+  return full.data;
+}
+
+/* The options that decide what becomes of a font, and what else a run
+ * leaves behind, as a client and server compare them.  Returns a string
+ * for the caller to free, or NULL if a path cannot be resolved or out
+ * of memory. */
+char *describeOptions (const regfont_options *options) {
+  regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+  const char *cache, *journal, *trace;
+  char *buffer = NULL, *grown;
+  size_t size = 0;
+  int len;
+
+  cache = optionPath (&regfont_path_arena, options->cache);
+  journal = optionPath (&regfont_path_arena, options->journal);
+  trace = optionPath (&regfont_path_arena, options->trace);
+  if (!cache || !journal || !trace)
+    goto cleanup;
+  while ((len = snprintf (buffer, size,
+              "strict=%d verify=%d dedup=%d jobs=%d prefetch=%d backend=%s "
+          "cache=%s journal=%s broadcast=%s:%lu stats=%d trace=%s",
+          options->strict != 0, options->verify != 0, options->dedup != 0,
+          options->jobs > 0 ? options->jobs : regfont_cpu_count (),
+          options->prefetch != 0,
+          options->backend ? options->backend : REGFONT_DEFAULT_BACKEND,
+          cache, journal, regfont_broadcast_names[options->broadcast],
+          options->broadcast_timeout, options->stats != 0, trace)) >= 0 &&
+      (size_t) len >= size) {
+    grown = realloc (buffer, (size_t) len + 1);
+    if (!grown)
+      break;
+    buffer = grown;
+    size = (size_t) len + 1;
+  }
+  if (len < 0 || (size_t) len >= size) {
+    free (buffer);
+    buffer = NULL;
+  }
+
+cleanup:
+  arenaRelease (&regfont_path_arena, mark);
+  return buffer;
+}
+
+/* Hand the fonts to a running server.  Returns -1 without doing
+ * anything if no server is listening, or -2 if it runs with other
+ * options, so the caller can fall back to working in process. */
+int runClient (const char *socketpath, int remove, regfont_source *fonts,
+    const char *options) {
+  regfont_connection conn;
+  const char *command = remove ? "remove" : "add";
+  char *filename, *reply = NULL;
+  unsigned long skipped = 0;
+
+  if (initSockets () != 0)
+    return -1;
+
+  openConnection (&conn, connectSocket (socketpath));
+  if (conn.sock != REGFONT_BAD_SOCKET &&
+      checkPeer (conn.sock, socketpath) != 0) {
+    closeSocket (conn.sock);
+    conn.sock = REGFONT_BAD_SOCKET;
+  }
+  if (conn.sock == REGFONT_BAD_SOCKET) {
+    dbprintf ("No regfont server listening on %s", socketpath);
+#ifdef _WIN32
+    WSACleanup ();
+#endif
+    return -1;
+  }
+  dbprintf ("Connected to regfont server on %s", socketpath);
+
+#ifndef _WIN32
+  signal (SIGPIPE, SIG_IGN);
+#endif
+
+  if (sendRequest (&conn, "options", options) != 0 ||
+      (reply = readLine (&conn)) == NULL || strncmp (reply, "ok ", 3) != 0) {
+    fprintf (stderr, "regfont server on %s runs with other options; "
+        "working in process\n", socketpath);
+    dbprintf ("Server replied: %s", reply ? reply : "(nothing)");
+    freeConnection (&conn);
+    closeSocket (conn.sock);
+#ifdef _WIN32
+    WSACleanup ();
+#endif
+    return -2;
+  }
+
+  while ((filename = fonts->next (fonts)) != NULL) {
+    regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+    regfont_view path;
+    char *code, *path_reply;
+
+    if (fullSpecPath (&regfont_path_arena, filename, &path) != REGFONT_OK) {
+      fprintf (stderr, "ERROR: Could not get full path for font: %s\n",
+          filename);
+      arenaRelease (&regfont_path_arena, mark);
+      continue;
+    }
+
+    dbtrace ("Sending request: %s %s", command, path.data);
+    if (sendRequest (&conn, command, path.data) != 0 ||
+        (reply = readLine (&conn)) == NULL) {
+      arenaRelease (&regfont_path_arena, mark);
+      fprintf (stderr, "ERROR: Lost connection to regfont server\n");
+      break;
+    }
+    arenaRelease (&regfont_path_arena, mark);
+    dbtrace ("Server replied: %s", reply);
+
+    /* ok|error COMMAND CODE PATH */
+    code = strchr (reply, ' ');
+    code = code ? strchr (code + 1, ' ') : NULL;
+    path_reply = code ? strchr (code + 1, ' ') : NULL;
+    if (!path_reply) {
+      fprintf (stderr, "ERROR: Invalid reply from regfont server: %s\n",
+          reply);
+      continue;
+    }
+
+    if (atoi (code) == REGFONT_SKIPPED_DUPLICATE) {
+      printf ("Skipped duplicate font: %s\n", filename);
+      skipped++;
+    } else if (strncmp (reply, "ok ", 3) == 0)
+      printf ("Successfully %s font: %s\n", remove ? "removed" : "added",
+          filename);
+    else
+      fprintf (stderr, "ERROR: %s %s failed: %s\n",
+          remove ? "Removing" : "Adding", filename, errorString (atoi (code)));
+  }
+
+  if (skipped > 0)
+    printf ("Skipped %lu duplicate fonts\n", skipped);
+  freeConnection (&conn);
+  closeSocket (conn.sock);
+#ifdef _WIN32
+  WSACleanup ();
+#endif
+  return 0;
+}
@@ -0,0 +1,762 @@
+/* source.c
+ * Streams of font specifications for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+#ifdef _WIN32
+#define REGFONT_PATH_SEPARATOR '\\'
+#else
+#define REGFONT_PATH_SEPARATOR '/'
+#endif
+
+/* Walkers stall once this many listed fonts wait for the consumer, so
+ * memory stays bounded however large the tree, save for the largest
+ * directory in it. */
+#define REGFONT_WALK_QUEUE 1024
+
+regfont_source *newSource (char *(*next) (regfont_source *),
+    void (*close) (regfont_source *), void *data) {
+  regfont_source *source = malloc (sizeof (regfont_source));
+
+  if (!source) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  source->next = next;
+  source->close = close;
+  source->info = NULL;
+  source->data = data;
+  return source;
+}
+
+int sourceInfo (regfont_source *source, regfont_stat_info *info) {
+  return source->info ? source->info (source, info) : -1;
+}
+
+void closeSource (regfont_source *source) {
+  if (!source)
+    return;
+  if (source->close)
+    source->close (source);
+  free (source);
+}
+
+/* Fonts named on the command line */
+
+typedef struct {
+  char **files;
+  size_t n;
+  size_t i;
+} argv_state;
+
+static char *argvNext (regfont_source *source) {
+  argv_state *state = source->data;
+
+  return state->i < state->n ? state->files[state->i++] : NULL;
+}
+
+static void argvClose (regfont_source *source) {
+  free (source->data);
+}
+
+regfont_source *argvSource (size_t n, char **files) {
+  argv_state *state = malloc (sizeof (argv_state));
+  regfont_source *source;
+
+  if (!state) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  state->files = files;
+  state->n = n;
+  state->i = 0;
+
+  source = newSource (argvNext, argvClose, state);
+  if (!source)
+    free (state);
+  return source;
+}
+
+/* A manifest of fonts, one specification per line or NUL terminated,
+ * read a block at a time so that only the current entry is held */
+
+#define REGFONT_MANIFEST_BLOCK 65536
+
+typedef struct {
+  FILE *file;
+  const char *name;
+  unsigned char block[REGFONT_MANIFEST_BLOCK];
+  size_t pos;
+  size_t len;
+  char *entry;
+  size_t size;
+  unsigned long line;
+} manifest_state;
+
+static char *manifestNext (regfont_source *source) {
+  manifest_state *state = source->data;
+  size_t len;
+  int c;
+
+  while (1) {
+    len = 0;
+    c = EOF;
+
+    while (1) {
+      if (state->pos == state->len) {
+        state->len = fread (state->block, 1, sizeof (state->block),
+            state->file);
+        state->pos = 0;
+        if (state->len == 0) {
+          c = EOF;
+          break;
+        }
+      }
+      c = state->block[state->pos++];
+      if (c == '\n' || c == '\0')
+        break;
+
+      if (len + 1 >= state->size) {
+        size_t size = state->size ? state->size * 2 : 256;
+        char *entry = realloc (state->entry, size);
+
+        if (!entry) {
+          fprintf (stderr, "ERROR: Out of memory\n");
+          return NULL;
+        }
+        state->entry = entry;
+        state->size = size;
+      }
+      state->entry[len++] = (char) c;
+    }
+
+    if (c == EOF && ferror (state->file)) {
+      fprintf (stderr, "ERROR: Could not read font list %s\n", state->name);
+      return NULL;
+    }
+    if (c == EOF && len == 0)
+      return NULL;
+
+    state->line++;
+    if (len > 0 && state->entry[len - 1] == '\r')
+      len--;
+    if (len == 0)
+      continue;
+
+    state->entry[len] = '\0';
+    return state->entry;
+  }
+}
+
+static void manifestClose (regfont_source *source) {
+  manifest_state *state = source->data;
+
+  dbprintf ("Read %lu lines from %s", state->line, state->name);
+  if (state->file != stdin)
+    fclose (state->file);
+  free (state->entry);
+  free (state);
+}
+
+/* A name of - reads standard input */
+regfont_source *manifestSource (const char *name) {
+  manifest_state *state = calloc (1, sizeof (manifest_state));
+  regfont_source *source;
+
+  if (!state) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+
+  if (strcmp (name, "-") == 0) {
+    state->file = stdin;
+    state->name = "standard input";
+  } else {
+    state->file = fopen (name, "rb");
+    state->name = name;
+  }
+  if (!state->file) {
+    fprintf (stderr, "ERROR: Could not open font list %s\n", name);
+    free (state);
+    return NULL;
+  }
+
+  source = newSource (manifestNext, manifestClose, state);
+  if (!source) {
+    if (state->file != stdin)
+      fclose (state->file);
+    free (state);
+  }
+  return source;
+}
+
+/* Several sources, one after another */
+
+typedef struct {
+  regfont_source **sources;
+  int n;
+  int i;
+} chain_state;
+
+static char *chainNext (regfont_source *source) {
+  chain_state *state = source->data;
+  char *filename;
+
+  for ( ; state->i < state->n; state->i++) {
+    filename = state->sources[state->i]->next (state->sources[state->i]);
+    if (filename)
+      return filename;
+  }
+  return NULL;
+}
+
+static int chainInfo (regfont_source *source, regfont_stat_info *info) {
+  chain_state *state = source->data;
+
+  return state->i < state->n ? sourceInfo (state->sources[state->i], info) :
+    -1;
+}
+
+static void chainClose (regfont_source *source) {
+  chain_state *state = source->data;
+  int i;
+
+  for (i = 0; i < state->n; i++)
+    closeSource (state->sources[i]);
+  free (state->sources);
+  free (state);
+}
+
+/* Takes ownership of the sources */
+regfont_source *chainSources (regfont_source **sources, int n) {
+  chain_state *state = malloc (sizeof (chain_state));
+  regfont_source *source;
+
+  if (state)
+    state->sources = malloc ((size_t) n * sizeof (regfont_source *));
+  if (!state || !state->sources) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    free (state);
+    return NULL;
+  }
+  memcpy (state->sources, sources, (size_t) n * sizeof (regfont_source *));
+  state->n = n;
+  state->i = 0;
+
+  source = newSource (chainNext, chainClose, state);
+  if (!source) {
+    free (state->sources);
+    free (state);
+  } else {
+    source->info = chainInfo;
+  }
+  return source;
+}
+
+/* Fonts found by walking directory trees with a pool of threads.  Each
+ * walker takes a directory from a shared stack, lists it, sorting its
+ * fonts and subdirectories by name, and queues the subdirectories for
+ * whichever walker is free.  The consumer takes fonts in the same depth
+ * first order whatever the number of walkers: the fonts of a
+ * directory, then each of its subdirectories in turn. */
+
+/* What the directory listing said of a font, if anything */
+typedef struct {
+  char *path;
+  int known;
+  regfont_stat_info info;
+} walk_font;
+
+#define REGFONT_DIR_WAITING 0
+#define REGFONT_DIR_LISTING 1
+#define REGFONT_DIR_LISTED 2
+
+/* A directory lives from when its parent is listed until the consumer
+ * has taken its fonts.  after is where the walk goes once the
+ * directory and everything under it is done. */
+typedef struct walk_dir {
+  struct walk_dir *prev;
+  struct walk_dir *next;
+  struct walk_dir *stacked;
+  struct walk_dir *children;
+  struct walk_dir *after;
+  int state;
+  walk_font *fonts;
+  size_t nfonts;
+  size_t taken;
+  char path[1];
+} walk_dir;
+
+/* One directory's entries, gathered by a walker without the lock */
+typedef struct {
+  walk_font *fonts;
+  size_t nfonts;
+  size_t fontsize;
+  char **dirs;
+  size_t ndirs;
+  size_t dirsize;
+} walk_listing;
+
+typedef struct {
+  regfont_mutex lock;
+  regfont_cond changed;
+  walk_dir *dirs;
+  walk_dir *stack;
+  walk_dir *cursor;
+  size_t waiting;
+  int busy;
+  int stopping;
+  walk_font current;
+  regfont_thread *threads;
+  int nthreads;
+  int postscript;
+  unsigned long directories;
+  unsigned long files;
+} walk_state;
+
+static char *joinPath (const char *dir, const char *name) {
+  size_t dirlen = strlen (dir), namelen = strlen (name);
+  char *path = malloc (dirlen + namelen + 2);
+
+  if (!path)
+    return NULL;
+  memcpy (path, dir, dirlen);
+  if (dirlen > 0 && dir[dirlen - 1] != REGFONT_PATH_SEPARATOR &&
+      dir[dirlen - 1] != '/')
+    path[dirlen++] = REGFONT_PATH_SEPARATOR;
+  memcpy (path + dirlen, name, namelen + 1);
+  return path;
+}
+
+/* Caller holds the lock */
+static walk_dir *newDirectory (walk_state *state, const char *path,
+    walk_dir *after) {
+  walk_dir *dir = calloc (1, sizeof (walk_dir) + strlen (path));
+
+  if (!dir)
+    return NULL;
+  strcpy (dir->path, path);
+  dir->after = after;
+  dir->next = state->dirs;
+  if (state->dirs)
+    state->dirs->prev = dir;
+  state->dirs = dir;
+  return dir;
+}
+
+/* Caller holds the lock */
+static void freeDirectory (walk_state *state, walk_dir *dir) {
+  size_t i;
+
+  for (i = dir->taken; i < dir->nfonts; i++)
+    free (dir->fonts[i].path);
+  free (dir->fonts);
+  if (dir->prev)
+    dir->prev->next = dir->next;
+  else
+    state->dirs = dir->next;
+  if (dir->next)
+    dir->next->prev = dir->prev;
+  free (dir);
+}
+
+/* Takes ownership of path.  info may be NULL. */
+static void listFont (walk_listing *listing, char *path,
+    const regfont_stat_info *info) {
+  walk_font *font;
+
+  if (listing->nfonts == listing->fontsize) {
+    size_t size = listing->fontsize ? 2 * listing->fontsize : 16;
+    walk_font *fonts = realloc (listing->fonts, size * sizeof (walk_font));
+
+    if (!fonts) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      free (path);
+      return;
+    }
+    listing->fonts = fonts;
+    listing->fontsize = size;
+  }
+  font = &listing->fonts[listing->nfonts++];
+  font->path = path;
+  font->known = info != NULL;
+  if (info)
+    font->info = *info;
+}
+
+/* Takes ownership of path */
+static void listDirectory (walk_listing *listing, char *path) {
+  if (listing->ndirs == listing->dirsize) {
+    size_t size = listing->dirsize ? 2 * listing->dirsize : 16;
+    char **dirs = realloc (listing->dirs, size * sizeof (char *));
+
+    if (!dirs) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      free (path);
+      return;
+    }
+    listing->dirs = dirs;
+    listing->dirsize = size;
+  }
+  listing->dirs[listing->ndirs++] = path;
+}
+
+static int compareWalkFonts (const void *a, const void *b) {
+  return strcmp (((const walk_font *) a)->path,
+      ((const walk_font *) b)->path);
+}
+
+static int compareWalkDirs (const void *a, const void *b) {
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+/* Only registrable fonts, and .pfm and .pfb files if asked for, are
+ * taken from a tree; anything else in it is skipped without complaint.
+ * info is what the listing said of a file, if it said enough. */
+static void walkEntry (walk_state *state, walk_listing *listing,
+    const char *dir, const char *name, int isdir,
+    const regfont_stat_info *info) {
+  const char *extension = PathFindExtension (name);
+  char *path;
+
+  if (*extension)
+    extension++;
+  if (!isdir) {
+    regfont_font_type type = classifyExtension (extension);
+    if (type != REGFONT_ANY &&
+        !(type == REGFONT_PFM && (state->postscript & REGFONT_WALK_PFM)) &&
+        !(type == REGFONT_PFB && (state->postscript & REGFONT_WALK_PFB)))
+      return;
+  }
+
+  path = joinPath (dir, name);
+  if (!path) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return;
+  }
+
+  if (isdir)
+    listDirectory (listing, path);
+  else
+    listFont (listing, path, info);
+}
+
+#ifdef _WIN32
+
+static void readDirectory (walk_state *state, walk_listing *listing,
+    const char *dir) {
+  WIN32_FIND_DATA data;
+  HANDLE find;
+  char *pattern = joinPath (dir, "*");
+
+  if (!pattern)
+    return;
+  find = FindFirstFile (pattern, &data);
+  free (pattern);
+  if (find == INVALID_HANDLE_VALUE) {
+    fprintf (stderr, "ERROR: Could not read directory: %s\n", dir);
+    return;
+  }
+
+  do {
+    int isdir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    regfont_stat_info info;
+
+    if (strcmp (data.cFileName, ".") == 0 ||
+        strcmp (data.cFileName, "..") == 0)
+      continue;
+    /* Do not follow junctions and directory symlinks, which can loop */
+    if (isdir && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+      continue;
+
+    /* The same as GetFileAttributesEx would say, so no font found here
+     * is queried again */
+    info.size = ((unsigned long long) data.nFileSizeHigh << 32) |
+      data.nFileSizeLow;
+    info.mtime = (long long) (((unsigned long long)
+          data.ftLastWriteTime.dwHighDateTime << 32) |
+        data.ftLastWriteTime.dwLowDateTime);
+    info.directory = isdir;
+    walkEntry (state, listing, dir, data.cFileName, isdir, &info);
+  } while (!state->stopping && FindNextFile (find, &data));
+
+  FindClose (find);
+}
+
+#else
+
+static void readDirectory (walk_state *state, walk_listing *listing,
+    const char *dir) {
+  struct dirent *entry;
+  DIR *handle = opendir (dir);
+
+  if (!handle) {
+    fprintf (stderr, "ERROR: Could not read directory: %s\n", dir);
+    return;
+  }
+
+  while (!state->stopping && (entry = readdir (handle)) != NULL) {
+    regfont_stat_info info, *known = NULL;
+    int isdir;
+
+    if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+      continue;
+
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR)
+      isdir = 1;
+    else if (entry->d_type == DT_REG)
+      isdir = 0;
+    else
+#endif
+    {
+      /* Symbolic links are followed to files, but never to directories,
+       * which can loop.  What is learnt of a file here is passed on, so
+       * it is not queried again. */
+      struct stat lst;
+      char *path = joinPath (dir, entry->d_name);
+
+      if (!path || regfont_stat (path, &info) != 0 ||
+          lstat (path, &lst) != 0) {
+        free (path);
+        continue;
+      }
+      free (path);
+      if (info.directory && S_ISLNK (lst.st_mode))
+        continue;
+      isdir = info.directory;
+      known = &info;
+    }
+
+    walkEntry (state, listing, dir, entry->d_name, isdir, known);
+  }
+
+  closedir (handle);
+}
+
+#endif
+
+/* Hand the sorted listing to the consumer, and its subdirectories to
+ * the walkers with the first of them on top.  Caller holds the lock. */
+static void publishListing (walk_state *state, walk_dir *dir,
+    walk_listing *listing) {
+  walk_dir *after = dir->after, *child;
+  size_t i;
+
+  if (listing->nfonts > 1)
+    qsort (listing->fonts, listing->nfonts, sizeof (walk_font),
+        compareWalkFonts);
+  if (listing->ndirs > 1)
+    qsort (listing->dirs, listing->ndirs, sizeof (char *), compareWalkDirs);
+
+  for (i = listing->ndirs; i-- > 0; ) {
+    child = newDirectory (state, listing->dirs[i], after);
+    free (listing->dirs[i]);
+    if (!child) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      continue;
+    }
+    child->stacked = state->stack;
+    state->stack = child;
+    after = child;
+  }
+  free (listing->dirs);
+
+  dir->children = after != dir->after ? after : NULL;
+  dir->fonts = listing->fonts;
+  dir->nfonts = listing->nfonts;
+  dir->state = REGFONT_DIR_LISTED;
+  state->waiting += listing->nfonts;
+  state->files += listing->nfonts;
+}
+
+/* Walkers stop listing ahead once REGFONT_WALK_QUEUE fonts wait for the
+ * consumer, save to list the directory it is waiting on */
+static void walker (void *param) {
+  walk_state *state = param;
+  walk_listing listing;
+  walk_dir *dir, **link;
+
+  regfont_mutex_lock (&state->lock);
+  while (1) {
+    while (!state->stopping && (state->stack ?
+          state->waiting >= REGFONT_WALK_QUEUE &&
+          state->cursor->state != REGFONT_DIR_WAITING : state->busy > 0))
+      regfont_cond_wait (&state->changed, &state->lock);
+    if (state->stopping || !state->stack)
+      break;
+
+    link = &state->stack;
+    if (state->waiting >= REGFONT_WALK_QUEUE)
+      while (*link != state->cursor)
+        link = &(*link)->stacked;
+    dir = *link;
+    *link = dir->stacked;
+    dir->state = REGFONT_DIR_LISTING;
+    state->busy++;
+    state->directories++;
+    regfont_mutex_unlock (&state->lock);
+
+    memset (&listing, 0, sizeof (listing));
+    readDirectory (state, &listing, dir->path);
+
+    regfont_mutex_lock (&state->lock);
+    publishListing (state, dir, &listing);
+    state->busy--;
+    regfont_cond_broadcast (&state->changed);
+  }
+  regfont_mutex_unlock (&state->lock);
+}
+
+static char *walkNext (regfont_source *source) {
+  walk_state *state = source->data;
+  walk_dir *dir;
+  char *path = NULL;
+
+  regfont_mutex_lock (&state->lock);
+  free (state->current.path);
+  state->current.path = NULL;
+
+  while ((dir = state->cursor) != NULL && !state->stopping) {
+    if (dir->state != REGFONT_DIR_LISTED) {
+      regfont_cond_wait (&state->changed, &state->lock);
+    } else if (dir->taken < dir->nfonts) {
+      state->current = dir->fonts[dir->taken++];
+      state->waiting--;
+      path = state->current.path;
+      regfont_cond_broadcast (&state->changed);
+      break;
+    } else {
+      state->cursor = dir->children ? dir->children : dir->after;
+      freeDirectory (state, dir);
+      regfont_cond_broadcast (&state->changed);
+    }
+  }
+  regfont_mutex_unlock (&state->lock);
+
+  return path;
+}
+
+static void stopWalking (walk_state *state) {
+  int i;
+
+  regfont_mutex_lock (&state->lock);
+  state->stopping = 1;
+  regfont_cond_broadcast (&state->changed);
+  regfont_mutex_unlock (&state->lock);
+
+  for (i = 0; i < state->nthreads; i++)
+    regfont_thread_join (state->threads[i]);
+
+  dbprintf ("Walked %lu directories, found %lu fonts", state->directories,
+      state->files);
+
+  while (state->dirs)
+    freeDirectory (state, state->dirs);
+  free (state->current.path);
+  free (state->threads);
+  regfont_cond_destroy (&state->changed);
+  regfont_mutex_destroy (&state->lock);
+  free (state);
+}
+
+/* Only the consumer reads current, so no lock is needed */
+static int walkInfo (regfont_source *source, regfont_stat_info *info) {
+  walk_state *state = source->data;
+
+  if (!state->current.path || !state->current.known)
+    return -1;
+  *info = state->current.info;
+  return 0;
+}
+
+static void walkClose (regfont_source *source) {
+  stopWalking (source->data);
+}
+
+regfont_source *walkSource (int n, char **dirs, int threads, int postscript) {
+  walk_state *state = calloc (1, sizeof (walk_state));
+  regfont_source *source;
+  walk_dir *dir, *last = NULL;
+  int i;
+
+  if (state)
+    state->threads = calloc ((size_t) threads, sizeof (regfont_thread));
+  if (!state || !state->threads) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    free (state);
+    return NULL;
+  }
+  regfont_mutex_init (&state->lock);
+  regfont_cond_init (&state->changed);
+  state->postscript = postscript;
+
+  /* Trees are walked in the order given */
+  for (i = 0; i < n; i++) {
+    if (!PathIsDirectory (dirs[i])) {
+      fprintf (stderr, "ERROR: Not a directory: %s\n", dirs[i]);
+      continue;
+    }
+    dbprintf ("Walking directory tree: %s", dirs[i]);
+    dir = newDirectory (state, dirs[i], NULL);
+    if (!dir) {
+      fprintf (stderr, "ERROR: Out of memory\n");
+      continue;
+    }
+    if (last)
+      last->after = dir;
+    else
+      state->cursor = dir;
+    last = dir;
+    dir->stacked = state->stack;
+    state->stack = dir;
+  }
+
+  for ( ; state->nthreads < threads; state->nthreads++) {
+    if (regfont_thread_create (&state->threads[state->nthreads], walker,
+          state) != 0)
+      break;
+  }
+  if (state->nthreads == 0) {
+    fprintf (stderr, "ERROR: Could not start directory walkers\n");
+    stopWalking (state);
+    return NULL;
+  }
+
+  source = newSource (walkNext, walkClose, state);
+  if (!source)
+    stopWalking (state);
+  else
+    source->info = walkInfo;
+  return source;
+}
@@ -0,0 +1,232 @@
+/* stats.c
+ * Per-phase timing statistics for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Each thread times into its own block, so recording takes no lock.
+ * Durations are kept in a log scale histogram with eight buckets to
+ * each power of two, which puts percentiles within 12.5% of the truth
+ * in a fixed amount of memory however many fonts are timed. */
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef struct {
+  unsigned long long calls;
+  unsigned long long total;
+  unsigned long long max;
+  unsigned long long buckets[STATS_BUCKETS];
+} stats_phase;
+
+typedef struct stats_block {
+  struct stats_block *next;
+  stats_phase phases[REGFONT_PHASE_COUNT];
+} stats_block;
+
+const char *regfont_phase_names[REGFONT_PHASE_COUNT] = {
+  "path", "stat", "extension", "contents", "verify",
+  "postscript", "cache", "check", "register", "broadcast", "add fonts", "remove fonts"
+};
+
+/* A thread's block belongs to the session whose serial it was made for,
+ * so a block left over from a session since closed is never touched */
+struct regfont_timings {
+  regfont_mutex lock;
+  long serial;
+  unsigned long queries;
+  stats_block *blocks;
+};
+
+static regfont_atomic regfont_stats_serial = 0;
+static REGFONT_THREAD_LOCAL stats_block *regfont_stats_local = NULL;
+static REGFONT_THREAD_LOCAL long regfont_stats_local_serial = 0;
+
+static unsigned int statsBucket (unsigned long long value) {
+  unsigned int octave = STATS_SUB_BITS;
+
+  if (value < STATS_SUB_BUCKETS)
+    return (unsigned int) value;
+  while (octave < 63 && (value >> (octave + 1)) != 0)
+    octave++;
+  return ((octave - STATS_SUB_BITS + 1) << STATS_SUB_BITS) |
+    (unsigned int) ((value >> (octave - STATS_SUB_BITS)) &
+        (STATS_SUB_BUCKETS - 1));
+}
+
+/* The middle of the range of values that fall in bucket */
+static double statsBucketValue (unsigned int bucket) {
+  unsigned int octave;
+  double low, width;
+
+  if (bucket < STATS_SUB_BUCKETS)
+    return (double) bucket;
+  octave = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  width = (double) (1ULL << (octave - STATS_SUB_BITS));
+  low = (double) (STATS_SUB_BUCKETS | (bucket & (STATS_SUB_BUCKETS - 1))) *
+    width;
+  return low + width / 2;
+}
+
+regfont_timings *openStats (void) {
+  regfont_timings *timings = calloc (1, sizeof (regfont_timings));
+
+  if (!timings) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  regfont_mutex_init (&timings->lock);
+  timings->serial = regfont_atomic_add (&regfont_stats_serial, 1);
+  timings->queries = regfont_stat_count ();
+  return timings;
+}
+
+/* Returns the time to pass to statsRecord, or 0 if nothing is timed */
+unsigned long long statsStart (regfont_session *session) {
+  return session->timings || session->tracer ? regfont_now_ns () : 0;
+}
+
+/* filename, if given, is the font the phase worked on */
+void statsRecordFile (regfont_session *session, regfont_phase phase,
+    unsigned long long start, const char *filename) {
+  regfont_timings *timings = session->timings;
+  stats_block *block = regfont_stats_local;
+  stats_phase *stats;
+  unsigned long long end, elapsed;
+
+  if (start == 0)
+    return;
+  end = regfont_now_ns ();
+  elapsed = end - start;
+
+  if (session->tracer)
+    traceEvent (session->tracer, phase, start, end, filename);
+  if (!timings)
+    return;
+
+  if (!block || regfont_stats_local_serial != timings->serial) {
+    block = calloc (1, sizeof (stats_block));
+    if (!block)
+      return;
+    regfont_mutex_lock (&timings->lock);
+    block->next = timings->blocks;
+    timings->blocks = block;
+    regfont_mutex_unlock (&timings->lock);
+    regfont_stats_local = block;
+    regfont_stats_local_serial = timings->serial;
+  }
+
+  stats = &block->phases[phase];
+  stats->calls++;
+  stats->total += elapsed;
+  if (elapsed > stats->max)
+    stats->max = elapsed;
+  stats->buckets[statsBucket (elapsed)]++;
+}
+
+void statsRecord (regfont_session *session, regfont_phase phase,
+    unsigned long long start) {
+  statsRecordFile (session, phase, start, NULL);
+}
+
+static double statsPercentile (const stats_phase *stats, double percent) {
+  unsigned long long rank, seen = 0;
+  unsigned int i;
+
+  rank = (unsigned long long) (stats->calls * percent / 100.0 + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    seen += stats->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  /* The top bucket is wide, and the largest value is known exactly */
+  return i < STATS_BUCKETS && statsBucketValue (i) < (double) stats->max ?
+    statsBucketValue (i) : (double) stats->max;
+}
+
+/* Merge the blocks of every thread and print a line for each phase that
+ * was timed.  check and register are timed once for each font, so
+ * their percentiles are per font latencies.  The session's threads
+ * must be done with it. */
+void closeStats (regfont_session *session) {
+  regfont_timings *timings = session->timings;
+  unsigned long queries = regfont_stat_count () - timings->queries;
+  stats_phase *phases;
+  stats_block *block;
+  int i, j;
+
+  phases = calloc (REGFONT_PHASE_COUNT, sizeof (stats_phase));
+
+  while ((block = timings->blocks) != NULL) {
+    timings->blocks = block->next;
+    for (i = 0; phases && i < REGFONT_PHASE_COUNT; i++) {
+      stats_phase *from = &block->phases[i], *to = &phases[i];
+
+      to->calls += from->calls;
+      to->total += from->total;
+      if (from->max > to->max)
+        to->max = from->max;
+      for (j = 0; j < STATS_BUCKETS; j++)
+        to->buckets[j] += from->buckets[j];
+    }
+    free (block);
+  }
+  regfont_mutex_destroy (&timings->lock);
+  free (timings);
+  session->timings = NULL;
+  if (!phases)
+    return;
+
+  for (i = 0, j = 0; i < REGFONT_PHASE_COUNT; i++) {
+    stats_phase *stats = &phases[i];
+
+    if (stats->calls == 0)
+      continue;
+    if (j++ == 0)
+      msgprintf (session, stdout, "%-13s %9s %12s %10s %10s %10s %10s\n",
+          "Phase", "Calls", "Total ms", "p50 us", "p90 us", "p99 us",
+          "Max us");
+    msgprintf (session, stdout,
+        "%-13s %9llu %12.3f %10.1f %10.1f %10.1f %10.1f\n",
+        regfont_phase_names[i], stats->calls, stats->total / 1e6,
+        statsPercentile (stats, 50) / 1e3, statsPercentile (stats, 90) / 1e3,
+        statsPercentile (stats, 99) / 1e3, stats->max / 1e3);
+  }
+
+  /* Every query is a round trip on a network share */
+  if (phases[REGFONT_PHASE_CHECK].calls > 0)
+    msgprintf (session, stdout, "File metadata queries: %lu, %.2f per font "
+        "checked\n", queries, (double) queries /
+        (double) phases[REGFONT_PHASE_CHECK].calls);
+  else
+    msgprintf (session, stdout, "File metadata queries: %lu\n", queries);
+  fflush (stdout);
+
+  free (phases);
+}
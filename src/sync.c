@@ -0,0 +1,242 @@
+/* sync.c
+ * Declarative font sync for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* The desired fonts and the fonts the session journal says are
+ * registered are both sorted by full path and merged, so only fonts in
+ * one list and not the other are touched. */
+
+static int comparePaths (const char *a, const char *b) {
+#ifdef _WIN32
+  return _stricmp (a, b);
+#else
+  return strcmp (a, b);
+#endif
+}
+
+static int compareSyncPaths (const void *a, const void *b) {
+  const regfont_journal_entry *ea = a, *eb = b;
+
+  return comparePaths (ea->path, eb->path);
+}
+
+static int compareSyncOrder (const void *a, const void *b) {
+  const regfont_journal_entry *ea = *(regfont_journal_entry * const *) a;
+  const regfont_journal_entry *eb = *(regfont_journal_entry * const *) b;
+
+  return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+static void freeEntries (regfont_journal_entry *entries, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    free (entries[i].path);
+  free (entries);
+}
+
+/* Read the full paths of the desired fonts, sorted with repeats
+ * dropped.  order keeps the position in the manifest. */
+static int readDesired (const char *manifest, regfont_journal_entry **desired,
+    size_t *count) {
+  regfont_source *fonts = manifestSource (manifest);
+  regfont_journal_entry *entries = NULL;
+  size_t n = 0, size = 0, i, kept;
+  char *filename;
+
+  *desired = NULL;
+  *count = 0;
+  if (!fonts)
+    return -1;
+
+  while ((filename = fonts->next (fonts)) != NULL) {
+    regfont_arena_mark mark = arenaMark (&regfont_path_arena);
+    regfont_view path;
+
+    if (n == size) {
+      size_t newsize = size ? size * 2 : 256;
+      regfont_journal_entry *grown = realloc (entries,
+          newsize * sizeof (regfont_journal_entry));
+
+      if (!grown)
+        break;
+      entries = grown;
+      size = newsize;
+    }
+
+    if (fullSpecPath (&regfont_path_arena, filename, &path) != REGFONT_OK) {
+      fprintf (stderr, "ERROR: Could not get full path for font: %s\n",
+          filename);
+      arenaRelease (&regfont_path_arena, mark);
+      continue;
+    }
+    entries[n].path = strdup (path.data);
+    arenaRelease (&regfont_path_arena, mark);
+    if (!entries[n].path)
+      break;
+    entries[n].delta = 1;
+    entries[n].order = n;
+    n++;
+  }
+  closeSource (fonts);
+
+  if (filename) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    freeEntries (entries, n);
+    return -1;
+  }
+
+  qsort (entries, n, sizeof (regfont_journal_entry), compareSyncPaths);
+  for (i = 0, kept = 0; i < n; i++) {
+    if (kept > 0 && comparePaths (entries[kept - 1].path,
+          entries[i].path) == 0)
+      free (entries[i].path);
+    else
+      entries[kept++] = entries[i];
+  }
+
+  *desired = entries;
+  *count = kept;
+  return 0;
+}
+
+int syncFonts (regfont_session *session, const char *manifest,
+    const char *journal, int dryrun) {
+  regfont_journal_entry *desired, *live, **adds = NULL, **removes = NULL;
+  char **addpaths = NULL;
+  size_t ndesired, nlive, nadds = 0, nremoves = 0, i, j;
+  unsigned long calls = 0, fullcalls = 0, removed = 0;
+  int retval = 0;
+
+  if (readDesired (manifest, &desired, &ndesired) != 0)
+    return -1;
+  live = sessionFonts (journal, &nlive);
+  qsort (live, nlive, sizeof (regfont_journal_entry), compareSyncPaths);
+
+  adds = malloc ((ndesired + 1) * sizeof (regfont_journal_entry *));
+  removes = malloc ((nlive + 1) * sizeof (regfont_journal_entry *));
+  addpaths = malloc ((ndesired + 1) * sizeof (char *));
+  if (!adds || !removes || !addpaths) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    retval = -1;
+    goto cleanup;
+  }
+
+  for (i = 0, j = 0; i < ndesired || j < nlive; ) {
+    int cmp = i == ndesired ? 1 : j == nlive ? -1 :
+      comparePaths (desired[i].path, live[j].path);
+
+    if (cmp < 0) {
+      adds[nadds++] = &desired[i++];
+    } else if (cmp > 0) {
+      removes[nremoves++] = &live[j];
+      calls += (unsigned long) live[j++].delta;
+    } else {
+      i++;
+      j++;
+    }
+  }
+  for (j = 0; j < nlive; j++)
+    fullcalls += (unsigned long) live[j].delta;
+  fullcalls += (unsigned long) ndesired;
+  calls += (unsigned long) nadds;
+
+  /* Add in the order of the manifest, and remove in the order the fonts
+   * were first added */
+  qsort (adds, nadds, sizeof (regfont_journal_entry *), compareSyncOrder);
+  qsort (removes, nremoves, sizeof (regfont_journal_entry *),
+      compareSyncOrder);
+
+  msgprintf (session, stdout,
+      "Sync plan: %lu to add, %lu to remove, %lu unchanged\n",
+      (unsigned long) nadds, (unsigned long) nremoves,
+      (unsigned long) (ndesired - nadds));
+
+  if (dryrun) {
+    for (i = 0; i < nremoves; i++)
+      msgprintf (session, stdout, "  remove %s\n", removes[i]->path);
+    for (i = 0; i < nadds; i++)
+      msgprintf (session, stdout, "  add %s\n", adds[i]->path);
+    msgprintf (session, stdout,
+        "Sync cost: %lu font table calls, %lu fonts to check and %s, "
+        "against %lu calls, %lu checks and 2 broadcasts to remove and "
+        "re-add everything\n", calls, (unsigned long) nadds,
+        calls > 0 ? "1 broadcast" : "no broadcast", fullcalls,
+        (unsigned long) ndesired);
+    goto cleanup;
+  }
+
+  if (calls == 0)
+    goto cleanup;
+
+  /* Fonts leaving the set may already be gone from disk, so they are
+   * removed as the session undo does, without being checked again */
+  dbprintf ("Sync: Removing fonts");
+  for (i = 0; i < nremoves; i++) {
+    int k;
+
+    for (k = 0; k < removes[i]->delta; k++) {
+      if (registerFont (session, -1, removes[i]->path) != REGFONT_OK)
+        break;
+      removed++;
+    }
+
+    /* A font the table refuses to remove is no longer registered, so it
+     * leaves the journal as it does when a session is undone */
+    for ( ; k < removes[i]->delta; k++)
+      journalFont (session, -1, removes[i]->path);
+  }
+
+  dbprintf ("Sync: Adding fonts");
+  if (nadds > 0) {
+    regfont_source *fonts;
+
+    for (i = 0; i < nadds; i++)
+      addpaths[i] = adds[i]->path;
+    fonts = argvSource (nadds, addpaths);
+    if (!fonts) {
+      retval = -1;
+      goto cleanup;
+    }
+    processFonts (session, 0, fonts, NULL);
+    closeSource (fonts);
+    finishDuplicates (session);
+  }
+
+  if (removed > 0 || nadds > 0)
+    broadcastFontChange (session);
+
+cleanup:
+  free (addpaths);
+  free (removes);
+  free (adds);
+  freeEntries (live, nlive);
+  freeEntries (desired, ndesired);
+  return retval;
+}
@@ -0,0 +1,200 @@
+/* trace.c
+ * Chrome trace event export for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* Each thread appends events to chunks of its own, with the names of
+ * the fonts they concern copied into the same chunk, so recording an
+ * event takes no lock and no allocation until a chunk fills.  Every
+ * phase is a complete ("X") event; the phases of a font nest inside its
+ * check or registration.  The file is written in one go when the
+ * session closes and can be loaded into chrome://tracing or Perfetto. */
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_CHUNK_TEXT (64 * TRACE_CHUNK_EVENTS)
+
+typedef struct {
+  unsigned long long start;
+  unsigned long long end;
+  unsigned int text;
+  unsigned char phase;
+  unsigned char hasfile;
+} trace_event;
+
+typedef struct trace_chunk {
+  struct trace_chunk *next;
+  unsigned int tid;
+  unsigned int nevents;
+  unsigned int textlen;
+  trace_event events[TRACE_CHUNK_EVENTS];
+  char text[TRACE_CHUNK_TEXT];
+} trace_chunk;
+
+/* As with the phase timings, a thread's chunk is only touched by the
+ * session whose serial it was made for */
+struct regfont_tracer {
+  FILE *file;
+  long serial;
+  unsigned long long origin;
+  trace_chunk *chunks;
+  unsigned int threads;
+  regfont_mutex lock;
+};
+
+static regfont_atomic regfont_trace_serial = 0;
+static REGFONT_THREAD_LOCAL trace_chunk *regfont_trace_local = NULL;
+static REGFONT_THREAD_LOCAL long regfont_trace_local_serial = 0;
+
+regfont_tracer *openTrace (const char *path) {
+  regfont_tracer *tracer = calloc (1, sizeof (regfont_tracer));
+
+  if (!tracer) {
+    fprintf (stderr, "ERROR: Out of memory\n");
+    return NULL;
+  }
+  tracer->file = fopen (path, "wb");
+  if (!tracer->file) {
+    fprintf (stderr, "ERROR: Could not open trace file %s\n", path);
+    free (tracer);
+    return NULL;
+  }
+  regfont_mutex_init (&tracer->lock);
+  tracer->serial = regfont_atomic_add (&regfont_trace_serial, 1);
+  tracer->origin = regfont_now_ns ();
+  dbprintf ("Tracing to %s", path);
+  return tracer;
+}
+
+/* A fresh chunk for the current thread, which keeps its thread id */
+static trace_chunk *newTraceChunk (regfont_tracer *tracer) {
+  trace_chunk *chunk = malloc (sizeof (trace_chunk)), *last;
+
+  if (!chunk)
+    return NULL;
+  chunk->nevents = 0;
+  chunk->textlen = 0;
+
+  last = regfont_trace_local_serial == tracer->serial ?
+    regfont_trace_local : NULL;
+  regfont_mutex_lock (&tracer->lock);
+  chunk->tid = last ? last->tid : ++tracer->threads;
+  chunk->next = tracer->chunks;
+  tracer->chunks = chunk;
+  regfont_mutex_unlock (&tracer->lock);
+
+  regfont_trace_local = chunk;
+  regfont_trace_local_serial = tracer->serial;
+  return chunk;
+}
+
+void traceEvent (regfont_tracer *tracer, regfont_phase phase,
+    unsigned long long start, unsigned long long end,
+    const char *filename) {
+  trace_chunk *chunk = regfont_trace_local;
+  size_t len = filename ? strlen (filename) + 1 : 0;
+  trace_event *event;
+
+  if (len > TRACE_CHUNK_TEXT)
+    len = 0;
+  if (!chunk || regfont_trace_local_serial != tracer->serial ||
+      chunk->nevents == TRACE_CHUNK_EVENTS ||
+      chunk->textlen + len > TRACE_CHUNK_TEXT) {
+    chunk = newTraceChunk (tracer);
+    if (!chunk)
+      return;
+  }
+
+  event = &chunk->events[chunk->nevents++];
+  event->start = start;
+  event->end = end;
+  event->phase = (unsigned char) phase;
+  event->hasfile = len > 0;
+  event->text = chunk->textlen;
+  if (len > 0) {
+    memcpy (chunk->text + chunk->textlen, filename, len);
+    chunk->textlen += (unsigned int) len;
+  }
+}
+
+static void writeJsonString (FILE *file, const char *string) {
+  const unsigned char *p;
+
+  fputc ('"', file);
+  for (p = (const unsigned char *) string; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf (file, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf (file, "\\u%04x", *p);
+    else
+      fputc (*p, file);
+  }
+  fputc ('"', file);
+}
+
+/* The session's threads must be done with it */
+void closeTrace (regfont_tracer *tracer) {
+  FILE *file = tracer->file;
+  trace_chunk *chunk;
+  unsigned int i;
+  int first = -1;
+
+  fprintf (file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (i = 1; i <= tracer->threads; i++) {
+    fprintf (file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+        "\"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"regfont %u\"}}",
+        first ? "" : ",\n", i, i);
+    first = 0;
+  }
+
+  while ((chunk = tracer->chunks) != NULL) {
+    tracer->chunks = chunk->next;
+    for (i = 0; i < chunk->nevents; i++) {
+      trace_event *event = &chunk->events[i];
+
+      fprintf (file, "%s{\"name\": \"%s\", \"cat\": \"regfont\", "
+          "\"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+          "\"dur\": %.3f", first ? "" : ",\n",
+          regfont_phase_names[event->phase], chunk->tid,
+          (event->start - tracer->origin) / 1000.0,
+          (event->end - event->start) / 1000.0);
+      if (event->hasfile) {
+        fprintf (file, ", \"args\": {\"file\": ");
+        writeJsonString (file, chunk->text + event->text);
+        fputc ('}', file);
+      }
+      fputc ('}', file);
+      first = 0;
+    }
+    free (chunk);
+  }
+
+  fprintf (file, "\n]}\n");
+  if (fclose (file) != 0)
+    fprintf (stderr, "ERROR: Could not write trace file\n");
+  regfont_mutex_destroy (&tracer->lock);
+  free (tracer);
+}
@@ -0,0 +1,385 @@
+/* verify.c
+ * sfnt table checksum verification for regfont.
+ * Copyright (c) 2010-2016  David Purton
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "regfont.h"
+
+/* An sfnt checksum is the sum, modulo 2^32, of a table read as big
+ * endian 32 bit words, with the last word padded with zeros.  Addition
+ * modulo 2^32 is what 32 bit vector lanes do anyway, so the vector
+ * kernels byte swap each lane, add it into one of several accumulators
+ * to keep the adds independent, and fold the lanes at the end.  The
+ * best kernel the compiler and the processor allow is picked once, when
+ * a session that verifies is opened: AVX2 is chosen at run time on x86,
+ * and SSE2 and NEON are always there on the targets that have them. */
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+  defined(_M_IX86)
+#define VERIFY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VERIFY_SSE2
+#endif
+#if defined(__AVX2__) || defined(_MSC_VER) || \
+  (defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)))
+#define VERIFY_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define VERIFY_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(VERIFY_AVX2) && defined(__GNUC__) && !defined(__AVX2__)
+#define VERIFY_TARGET_AVX2 __attribute__ ((target ("avx2")))
+#else
+#define VERIFY_TARGET_AVX2
+#endif
+
+/* Until a kernel is chosen the scalar one is used */
+static unsigned long (*regfont_checksum) (const unsigned char *data,
+    size_t len) = sfntChecksumScalar;
+static const char *regfont_checksum_name = "scalar";
+static regfont_once regfont_checksum_once = REGFONT_ONCE_INIT;
+
+/* The words left over after the vector loop, and the last partial word */
+static unsigned long checksumTail (const unsigned char *data, size_t len,
+    unsigned long sum) {
+  unsigned char last[4] = {0, 0, 0, 0};
+
+  for ( ; len >= 4; data += 4, len -= 4)
+    sum += readBE32 (data);
+  if (len > 0) {
+    memcpy (last, data, len);
+    sum += readBE32 (last);
+  }
+  return sum & 0xFFFFFFFFUL;
+}
+
+unsigned long sfntChecksumScalar (const unsigned char *data, size_t len) {
+  return checksumTail (data, len, 0);
+}
+
+#ifdef VERIFY_SSE2
+/* SSE2 has no byte shuffle, so the bytes of each 16 bit half are swapped
+ * with shifts and the halves with a word shuffle */
+#define SSE2_SWAP32(x) (x = _mm_or_si128 (_mm_slli_epi16 (x, 8), \
+      _mm_srli_epi16 (x, 8)), \
+    x = _mm_shufflelo_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1)), \
+    _mm_shufflehi_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1)))
+
+static unsigned long sfntChecksumSse2 (const unsigned char *data, size_t len) {
+  __m128i a = _mm_setzero_si128 (), b = a, c = a, d = a, x;
+  unsigned int lanes[4];
+
+  for ( ; len >= 64; data += 64, len -= 64) {
+    x = _mm_loadu_si128 ((const __m128i *) data);
+    a = _mm_add_epi32 (a, SSE2_SWAP32 (x));
+    x = _mm_loadu_si128 ((const __m128i *) (data + 16));
+    b = _mm_add_epi32 (b, SSE2_SWAP32 (x));
+    x = _mm_loadu_si128 ((const __m128i *) (data + 32));
+    c = _mm_add_epi32 (c, SSE2_SWAP32 (x));
+    x = _mm_loadu_si128 ((const __m128i *) (data + 48));
+    d = _mm_add_epi32 (d, SSE2_SWAP32 (x));
+  }
+  for ( ; len >= 16; data += 16, len -= 16) {
+    x = _mm_loadu_si128 ((const __m128i *) data);
+    a = _mm_add_epi32 (a, SSE2_SWAP32 (x));
+  }
+
+  a = _mm_add_epi32 (_mm_add_epi32 (a, b), _mm_add_epi32 (c, d));
+  _mm_storeu_si128 ((__m128i *) lanes, a);
+  return checksumTail (data, len, (unsigned long) lanes[0] + lanes[1] +
+      lanes[2] + lanes[3]);
+}
+#endif
+
+#ifdef VERIFY_AVX2
+VERIFY_TARGET_AVX2
+static unsigned long sfntChecksumAvx2 (const unsigned char *data, size_t len) {
+  const __m256i swap = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4,
+      11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+      11, 10, 9, 8, 15, 14, 13, 12);
+  __m256i a = _mm256_setzero_si256 (), b = a, c = a, d = a;
+  __m128i sum;
+  unsigned int lanes[4];
+
+  for ( ; len >= 128; data += 128, len -= 128) {
+    a = _mm256_add_epi32 (a, _mm256_shuffle_epi8 (_mm256_loadu_si256 (
+            (const __m256i *) data), swap));
+    b = _mm256_add_epi32 (b, _mm256_shuffle_epi8 (_mm256_loadu_si256 (
+            (const __m256i *) (data + 32)), swap));
+    c = _mm256_add_epi32 (c, _mm256_shuffle_epi8 (_mm256_loadu_si256 (
+            (const __m256i *) (data + 64)), swap));
+    d = _mm256_add_epi32 (d, _mm256_shuffle_epi8 (_mm256_loadu_si256 (
+            (const __m256i *) (data + 96)), swap));
+  }
+  for ( ; len >= 32; data += 32, len -= 32)
+    a = _mm256_add_epi32 (a, _mm256_shuffle_epi8 (_mm256_loadu_si256 (
+            (const __m256i *) data), swap));
+
+  a = _mm256_add_epi32 (_mm256_add_epi32 (a, b), _mm256_add_epi32 (c, d));
+  sum = _mm_add_epi32 (_mm256_castsi256_si128 (a),
+      _mm256_extracti128_si256 (a, 1));
+  _mm_storeu_si128 ((__m128i *) lanes, sum);
+  return checksumTail (data, len, (unsigned long) lanes[0] + lanes[1] +
+      lanes[2] + lanes[3]);
+}
+
+static int cpuHasAvx2 (void) {
+#ifdef __AVX2__
+  return 1;
+#elif defined(_MSC_VER)
+  int regs[4];
+
+  __cpuid (regs, 0);
+  if (regs[0] < 7)
+    return 0;
+  __cpuid (regs, 1);
+  /* The OS must save the YMM registers */
+  if ((regs[2] & (1 << 27)) == 0 || (_xgetbv (0) & 6) != 6)
+    return 0;
+  __cpuidex (regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+#endif
+}
+#endif
+
+#ifdef VERIFY_NEON
+static unsigned long sfntChecksumNeon (const unsigned char *data, size_t len) {
+  uint32x4_t a = vdupq_n_u32 (0), b = a, c = a, d = a;
+  uint32_t lanes[4];
+
+  for ( ; len >= 64; data += 64, len -= 64) {
+    a = vaddq_u32 (a, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data))));
+    b = vaddq_u32 (b, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (
+                data + 16))));
+    c = vaddq_u32 (c, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (
+                data + 32))));
+    d = vaddq_u32 (d, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (
+                data + 48))));
+  }
+  for ( ; len >= 16; data += 16, len -= 16)
+    a = vaddq_u32 (a, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (data))));
+
+  a = vaddq_u32 (vaddq_u32 (a, b), vaddq_u32 (c, d));
+  vst1q_u32 (lanes, a);
+  return checksumTail (data, len, (unsigned long) lanes[0] + lanes[1] +
+      lanes[2] + lanes[3]);
+}
+#endif
+
+static void pickChecksumKernel (void) {
+  regfont_checksum = sfntChecksumScalar;
+  regfont_checksum_name = "scalar";
+#ifdef VERIFY_SSE2
+  regfont_checksum = sfntChecksumSse2;
+  regfont_checksum_name = "SSE2";
+#endif
+#ifdef VERIFY_AVX2
+  if (cpuHasAvx2 ()) {
+    regfont_checksum = sfntChecksumAvx2;
+    regfont_checksum_name = "AVX2";
+  }
+#endif
+#ifdef VERIFY_NEON
+  regfont_checksum = sfntChecksumNeon;
+  regfont_checksum_name = "NEON";
+#endif
+}
+
+void chooseChecksumKernel (void) {
+  regfont_call_once (&regfont_checksum_once, pickChecksumKernel);
+}
+
+unsigned long sfntChecksum (const unsigned char *data, size_t len) {
+  return regfont_checksum (data, len);
+}
+
+const char *checksumKernelName (void) {
+  chooseChecksumKernel ();
+  return regfont_checksum_name;
+}
+
+/* A table tag fit to print */
+static void tagName (const unsigned char *tag, char *name) {
+  int i;
+
+  for (i = 0; i < 4; i++)
+    name[i] = tag[i] >= 0x20 && tag[i] < 0x7F ? (char) tag[i] : '?';
+  name[4] = '\0';
+}
+
+/* Check the table directory at base and the checksum of every table it
+ * lists.  The whole font checksum is the sum of the directory and the
+ * table checksums, and is only checked for a font on its own: the head
+ * table of a collection member covers tables it shares with others. */
+static int verifySfnt (regfont_session *session, const regfont_map *map,
+    size_t base, int whole, regfont_view font, unsigned long *tables) {
+  const unsigned char *data = map->data;
+  unsigned long total, adjustment = 0;
+  unsigned int ntables, i;
+  char name[5];
+  int hashead = 0;
+
+  if (base > map->size || map->size - base < 12) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) font.len, font.data);
+    msgprintf (session, stderr, "ERROR:     Font header is truncated\n");
+    return REGFONT_CORRUPT_FONT;
+  }
+  ntables = readBE16 (data + base + 4);
+  if ((map->size - base - 12) / 16 < ntables) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) font.len, font.data);
+    msgprintf (session, stderr, "ERROR:     Table directory is truncated\n");
+    return REGFONT_CORRUPT_FONT;
+  }
+  total = sfntChecksum (data + base, 12 + 16 * (size_t) ntables);
+
+  for (i = 0; i < ntables; i++) {
+    const unsigned char *entry = data + base + 12 + 16 * (size_t) i;
+    unsigned long stored = readBE32 (entry + 4), sum;
+    size_t offset = readBE32 (entry + 8), length = readBE32 (entry + 12);
+
+    tagName (entry, name);
+    if (offset > map->size || length > map->size - offset) {
+      msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+          (int) font.len, font.data);
+      msgprintf (session, stderr,
+          "ERROR:     Table '%s' runs past the end of the "
+          "file\n", name);
+      return REGFONT_CORRUPT_FONT;
+    }
+
+    sum = sfntChecksum (data + offset, length);
+    (*tables)++;
+    /* The head checksum is taken with checkSumAdjustment as zero */
+    if (memcmp (entry, "head", 4) == 0 && length >= 12) {
+      adjustment = readBE32 (data + offset + 8);
+      sum = (sum - adjustment) & 0xFFFFFFFFUL;
+      hashead = 1;
+    }
+    dbtrace ("    Table %s: checksum %08lx, stored %08lx", name, sum, stored);
+    if (sum != stored) {
+      msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+          (int) font.len, font.data);
+      msgprintf (session, stderr, "ERROR:     Checksum of table '%s' does not "
+          "match\n", name);
+      return REGFONT_CORRUPT_FONT;
+    }
+    total += sum;
+  }
+
+  if (whole && hashead &&
+      ((0xB1B0AFBAUL - total) & 0xFFFFFFFFUL) != adjustment) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) font.len, font.data);
+    msgprintf (session, stderr, "ERROR:     Font checksum does not match "
+        "checkSumAdjustment\n");
+    return REGFONT_CORRUPT_FONT;
+  }
+  return REGFONT_OK;
+}
+
+/* Verify the checksums of a TrueType, OpenType or collection font.
+ * Other fonts have none and pass. */
+int verifyFontFile (regfont_session *session, const char *fullfilename,
+    regfont_view name) {
+  regfont_verify_totals *totals = &session->verified;
+  unsigned long long start = regfont_now_ns (), elapsed;
+  unsigned long tables = 0;
+  regfont_map map;
+  int retval = REGFONT_OK;
+
+  dbtrace ("    Verifying font checksums...");
+  if (regfont_map_open (&map, fullfilename) != 0) {
+    msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+        (int) name.len, name.data);
+    msgprintf (session, stderr, "ERROR:     File is empty or cannot be read\n");
+    return REGFONT_CORRUPT_FONT;
+  }
+
+  switch (sniffFontHeader (map.data, map.size, NULL)) {
+  case REGFONT_FORMAT_TRUETYPE:
+  case REGFONT_FORMAT_OPENTYPE:
+    retval = verifySfnt (session, &map, 0, 1, name, &tables);
+    break;
+  case REGFONT_FORMAT_COLLECTION: {
+    unsigned long nfonts, i;
+
+    nfonts = map.size >= 12 ? readBE32 (map.data + 8) : 0;
+    if (nfonts == 0 || (map.size - 12) / 4 < nfonts) {
+      msgprintf (session, stderr, "ERROR: Font file is corrupt: %.*s\n",
+          (int) name.len, name.data);
+      msgprintf (session, stderr,
+          "ERROR:     Collection header is truncated\n");
+      retval = REGFONT_CORRUPT_FONT;
+      break;
+    }
+    for (i = 0; i < nfonts && retval == REGFONT_OK; i++)
+      retval = verifySfnt (session, &map, readBE32 (map.data + 12 + 4 * i),
+          0, name, &tables);
+    break;
+  }
+  default:
+    dbtrace ("    No checksums to verify");
+    regfont_map_close (&map);
+    return REGFONT_OK;
+  }
+
+  elapsed = regfont_now_ns () - start;
+  regfont_mutex_lock (&totals->lock);
+  totals->fonts++;
+  totals->tables += tables;
+  totals->bytes += map.size;
+  totals->ns += elapsed;
+  regfont_mutex_unlock (&totals->lock);
+
+  regfont_map_close (&map);
+  if (retval == REGFONT_OK)
+    dbtrace ("    Font checksums match");
+  return retval;
+}
+
+/* Throughput counts the time spent mapping and summing each file, on
+ * whichever thread did it, so it is per thread */
+void printVerify (regfont_session *session) {
+  const regfont_verify_totals *totals = &session->verified;
+
+  if (totals->fonts == 0)
+    return;
+  msgprintf (session, stdout, "Verified %lu fonts, %lu tables, %.1f MB in "
+      "%.3f ms (%.2f GB/s per thread, %s)\n", totals->fonts, totals->tables,
+      totals->bytes / 1e6, totals->ns / 1e6, totals->ns ?
+      (double) totals->bytes / totals->ns : 0.0, regfont_checksum_name);
+  fflush (stdout);
+}